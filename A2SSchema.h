@@ -0,0 +1,363 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <array>
+#include <string>
+#include <string_view>
+#include <optional>
+#include <stdexcept>
+#include <type_traits>
+
+#include "parsemsg.h"
+
+std::string UTF8_To_ANSI(std::string_view str);
+
+// Field descriptors for the A2S wire formats. A message is described once as a list of fields bound to
+// member pointers, and the same list drives Size() / Encode() / Decode(), so reader and writer can't drift.
+// Encode() doesn't check bounds: callers size the buffer with Size() first, which is exact.
+namespace A2SSchema
+{
+    template<class T> struct IsOptional : std::false_type {};
+    template<class T> struct IsOptional<std::optional<T>> : std::true_type {};
+
+    template<class T> struct Unwrap { using type = T; };
+    template<class T> struct Unwrap<std::optional<T>> { using type = T; };
+
+    // empty optionals are encoded as a default constructed value
+    template<class M>
+    const typename Unwrap<M>::type& ValueOf(const M& m)
+    {
+        if constexpr (IsOptional<M>::value)
+        {
+            static const typename M::value_type empty{};
+            return m ? *m : empty;
+        }
+        else
+            return m;
+    }
+
+    template<class M>
+    bool HasValue(const M& m)
+    {
+        if constexpr (IsOptional<M>::value)
+            return m.has_value();
+        else
+            return true;
+    }
+
+    template<class T, class M> M MemberTypeOf(M T::*);
+    template<auto Member> using FieldType = typename Unwrap<decltype(MemberTypeOf(Member))>::type;
+
+    template<class M>
+    typename Unwrap<M>::type& Emplace(M& m)
+    {
+        if constexpr (IsOptional<M>::value)
+            return m.emplace();
+        else
+            return m;
+    }
+
+    // called with (member address, offset in the reply, encoded size) for every leaf field written
+    struct NoObserver
+    {
+        constexpr void operator()(const void*, std::size_t, std::size_t) const {}
+    };
+
+    // integers, enums and floats stored as Wire on the wire (little endian, like the engine)
+    template<auto Member, class Wire>
+    struct Scalar
+    {
+        static constexpr std::size_t min_size = sizeof(Wire);
+
+        template<class T> static bool Present(const T& obj) { return HasValue(obj.*Member); }
+        template<class T> static std::size_t Size(const T&) { return sizeof(Wire); }
+
+        template<class T, class Observer>
+        static char* Encode(const T& obj, char* out, const char* base, Observer& observer)
+        {
+            const Wire value = static_cast<Wire>(ValueOf(obj.*Member));
+            std::memcpy(out, &value, sizeof(Wire));
+            observer(&(obj.*Member), out - base, sizeof(Wire));
+            return out + sizeof(Wire);
+        }
+
+        template<class T>
+        static void Decode(T& obj, BufferReader& buf)
+        {
+            obj.*Member = static_cast<FieldType<Member>>(buf.Read<Wire>());
+        }
+    };
+
+    template<auto Member> using Byte = Scalar<Member, std::uint8_t>;
+    template<auto Member> using Short = Scalar<Member, std::int16_t>;
+    template<auto Member> using Long = Scalar<Member, std::int32_t>;
+    template<auto Member> using Float = Scalar<Member, float>;
+
+    // the leading -1 of every reply
+    template<auto Member>
+    struct Header : Long<Member>
+    {
+        template<class T>
+        static void Decode(T& obj, BufferReader& buf)
+        {
+            if ((obj.*Member = buf.ReadLong()) != -1)
+                throw std::invalid_argument("unsupported protocol format");
+        }
+    };
+
+    // zero terminated, cut at an embedded NUL like MSG_WriteString.
+    // A std::string_view member decodes to a view into the reply instead of a copy.
+    template<auto Member>
+    struct String
+    {
+        static constexpr std::size_t min_size = 1;
+
+        template<class T>
+        static std::string_view View(const T& obj)
+        {
+            return ValueOf(obj.*Member).c_str();
+        }
+
+        template<class T> static bool Present(const T& obj) { return HasValue(obj.*Member); }
+        template<class T> static std::size_t Size(const T& obj) { return View(obj).size() + 1; }
+
+        template<class T, class Observer>
+        static char* Encode(const T& obj, char* out, const char* base, Observer& observer)
+        {
+            const std::string_view str = View(obj);
+            std::memcpy(out, str.data(), str.size() + 1);
+            observer(&(obj.*Member), out - base, str.size() + 1);
+            return out + str.size() + 1;
+        }
+
+        template<class T>
+        static void Decode(T& obj, BufferReader& buf)
+        {
+            if constexpr (std::is_same_v<FieldType<Member>, std::string_view>)
+                obj.*Member = buf.ReadStringView();
+            else
+                obj.*Member = UTF8_To_ANSI(buf.ReadStringView());
+        }
+    };
+
+    // std::array<int32_t, N>, e.g. the 64 bit SteamID / GameID as two longs
+    template<auto Member>
+    struct Longs
+    {
+        static constexpr std::size_t min_size = sizeof(FieldType<Member>);
+
+        template<class T> static bool Present(const T& obj) { return HasValue(obj.*Member); }
+        template<class T> static std::size_t Size(const T&) { return min_size; }
+
+        template<class T, class Observer>
+        static char* Encode(const T& obj, char* out, const char* base, Observer& observer)
+        {
+            std::memcpy(out, ValueOf(obj.*Member).data(), min_size);
+            observer(&(obj.*Member), out - base, min_size);
+            return out + min_size;
+        }
+
+        template<class T>
+        static void Decode(T& obj, BufferReader& buf)
+        {
+            auto& value = Emplace(obj.*Member);
+            for (auto& element : value)
+                element = buf.ReadLong();
+        }
+    };
+
+    // a run of fields, also the top level of a message
+    template<class... Fields>
+    struct Message
+    {
+        static constexpr std::size_t min_size = (std::size_t{ 0 } + ... + Fields::min_size);
+
+        template<class T> static bool Present(const T&) { return true; }
+        template<class T> static std::size_t Size(const T& obj) { return (std::size_t{ 0 } + ... + Fields::Size(obj)); }
+
+        template<class T, class Observer>
+        static char* Encode(const T& obj, char* out, const char* base, Observer& observer)
+        {
+            ((out = Fields::Encode(obj, out, base, observer)), ...);
+            return out;
+        }
+
+        template<class T>
+        static void Decode(T& obj, BufferReader& buf)
+        {
+            (Fields::Decode(obj, buf), ...);
+        }
+    };
+
+    // fields of a nested (optional) struct
+    template<auto Member, class... Fields>
+    struct Sub
+    {
+        static constexpr std::size_t min_size = Message<Fields...>::min_size;
+
+        template<class T> static bool Present(const T& obj) { return HasValue(obj.*Member); }
+        template<class T> static std::size_t Size(const T& obj) { return Message<Fields...>::Size(ValueOf(obj.*Member)); }
+
+        template<class T, class Observer>
+        static char* Encode(const T& obj, char* out, const char* base, Observer& observer)
+        {
+            return Message<Fields...>::Encode(ValueOf(obj.*Member), out, base, observer);
+        }
+
+        template<class T>
+        static void Decode(T& obj, BufferReader& buf)
+        {
+            Message<Fields...>::Decode(Emplace(obj.*Member), buf);
+        }
+    };
+
+    template<std::uint8_t Bit, class Field>
+    struct Flag
+    {
+        static constexpr std::uint8_t bit = Bit;
+        using field = Field;
+    };
+
+    // a bit mask byte followed by the fields whose bit is set, in list order (A2S_INFO EDF).
+    // The mask is derived from which fields are present; it may be missing entirely on old servers.
+    template<auto Member, class... Flags>
+    struct FlagByte
+    {
+        static constexpr std::size_t min_size = 0;
+
+        template<class T>
+        static std::uint8_t Mask(const T& obj)
+        {
+            return (std::uint8_t{ 0 } | ... | (Flags::field::Present(obj) ? Flags::bit : std::uint8_t{ 0 }));
+        }
+
+        template<class T> static bool Present(const T&) { return true; }
+        template<class T>
+        static std::size_t Size(const T& obj)
+        {
+            return 1 + (std::size_t{ 0 } + ... + (Flags::field::Present(obj) ? Flags::field::Size(obj) : 0));
+        }
+
+        template<class T, class Observer>
+        static char* Encode(const T& obj, char* out, const char* base, Observer& observer)
+        {
+            *out = static_cast<char>(Mask(obj));
+            observer(&(obj.*Member), out - base, 1);
+            ++out;
+            ((out = Flags::field::Present(obj) ? Flags::field::Encode(obj, out, base, observer) : out), ...);
+            return out;
+        }
+
+        template<class T>
+        static void Decode(T& obj, BufferReader& buf)
+        {
+            if (buf.Eof())
+                return;
+            const std::uint8_t mask = buf.ReadByte();
+            obj.*Member = mask;
+            ((mask & Flags::bit ? Flags::field::Decode(obj, buf) : void()), ...);
+        }
+    };
+
+    // a bool byte followed by Field when set (GoldSrc mod info)
+    template<auto Member, class Field>
+    struct Switch
+    {
+        static constexpr std::size_t min_size = 1;
+
+        template<class T> static bool Enabled(const T& obj) { return static_cast<bool>(ValueOf(obj.*Member)); }
+
+        template<class T> static bool Present(const T&) { return true; }
+        template<class T> static std::size_t Size(const T& obj) { return 1 + (Enabled(obj) ? Field::Size(obj) : 0); }
+
+        template<class T, class Observer>
+        static char* Encode(const T& obj, char* out, const char* base, Observer& observer)
+        {
+            *out = Enabled(obj) ? 1 : 0;
+            observer(&(obj.*Member), out - base, 1);
+            ++out;
+            return Enabled(obj) ? Field::Encode(obj, out, base, observer) : out;
+        }
+
+        template<class T>
+        static void Decode(T& obj, BufferReader& buf)
+        {
+            const bool enabled = buf.ReadByte() != 0 && !buf.Bad();
+            obj.*Member = enabled;
+            if (enabled)
+                Field::Decode(obj, buf);
+        }
+    };
+
+    template<char Tag, class... Fields>
+    struct Case
+    {
+        static constexpr char tag = Tag;
+        using fields = Message<Fields...>;
+    };
+
+    // a type byte selecting one of the layouts
+    template<auto Member, class... Cases>
+    struct Tagged
+    {
+        static constexpr std::size_t min_size = 1;
+
+        template<class F>
+        static void Visit(std::uint8_t tag, F&& f)
+        {
+            bool found = ((tag == static_cast<std::uint8_t>(Cases::tag) ? (f(typename Cases::fields{}), true) : false) || ...);
+            if (!found)
+                throw std::invalid_argument("unsupported protocol format");
+        }
+
+        template<class T> static bool Present(const T&) { return true; }
+
+        template<class T>
+        static std::size_t Size(const T& obj)
+        {
+            std::size_t size = 1;
+            Visit(obj.*Member, [&](auto fields) { size += decltype(fields)::Size(obj); });
+            return size;
+        }
+
+        template<class T, class Observer>
+        static char* Encode(const T& obj, char* out, const char* base, Observer& observer)
+        {
+            *out = static_cast<char>(obj.*Member);
+            observer(&(obj.*Member), out - base, 1);
+            ++out;
+            Visit(obj.*Member, [&](auto fields) { out = decltype(fields)::Encode(obj, out, base, observer); });
+            return out;
+        }
+
+        template<class T>
+        static void Decode(T& obj, BufferReader& buf)
+        {
+            obj.*Member = buf.ReadByte();
+            Visit(obj.*Member, [&](auto fields) { decltype(fields)::Decode(obj, buf); });
+        }
+    };
+
+    template<class Schema, class T>
+    std::size_t Size(const T& obj)
+    {
+        return Schema::Size(obj);
+    }
+
+    // out must hold Size<Schema>(obj) bytes, returns the end of the written data
+    template<class Schema, class T, class Observer = NoObserver>
+    char* Encode(const T& obj, char* out, Observer&& observer = {})
+    {
+        return Schema::Encode(obj, out, out, observer);
+    }
+
+    // throws std::invalid_argument on unknown layouts or truncated input
+    template<class Schema, class T>
+    void Decode(T& obj, BufferReader& buf)
+    {
+        Schema::Decode(obj, buf);
+        if (buf.Bad())
+            throw std::invalid_argument(buf.Truncated() ? "truncated string in reply" : "truncated reply");
+    }
+}
@@ -0,0 +1,141 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <map>
+#include <functional>
+#include <sstream>
+#include <asio.hpp>
+#include <asio/awaitable.hpp>
+
+#ifdef ASIO_HAS_LOCAL_SOCKETS
+#include <unistd.h>
+#include "PeerCredentials.h"
+#endif
+
+#include "log.hpp"
+
+// Local control socket: one command per line, the reply follows as text, e.g. echo sessions | socat - UNIX:gorouter.admin
+// "" disables it. Runs on the router's io_context between packets, so a command never races the relay.
+inline std::string admin_path = "gorouter.admin";
+
+class AdminServer
+{
+public:
+    using Args = std::vector<std::string>;
+    // the reply, without the trailing newline if it likes
+    using Handler = std::function<std::string(const Args&)>;
+
+    static constexpr std::size_t max_line = 4096;
+
+    void Register(std::string name, std::string usage, Handler handler)
+    {
+        commands[std::move(name)] = { std::move(usage), std::move(handler) };
+    }
+
+    std::string Execute(std::string_view line) const
+    {
+        Args args;
+        std::istringstream iss{ std::string(line) };
+        for (std::string word; iss >> word;)
+            args.push_back(std::move(word));
+        if (args.empty())
+            return {};
+        if (args[0] == "help")
+        {
+            std::ostringstream oss;
+            for (const auto& [name, command] : commands)
+                oss << name << (command.usage.empty() ? "" : " ") << command.usage << '\n';
+            return oss.str();
+        }
+        auto iter = commands.find(args[0]);
+        if (iter == commands.end())
+            return "unknown command " + args[0] + ", try help\n";
+        try
+        {
+            args.erase(args.begin());
+            return iter->second.handler(args);
+        }
+        catch (const std::exception& e)
+        {
+            return std::string("error: ") + e.what() + "\n";
+        }
+    }
+
+#ifdef ASIO_HAS_LOCAL_SOCKETS
+    asio::awaitable<void> Run(asio::io_context& ioc)
+    {
+        using asio::local::stream_protocol;
+        if (admin_path.empty())
+            co_return;
+        ::unlink(admin_path.c_str()); // a stale one from a crash; after a handoff the old process is done with it
+        stream_protocol::acceptor acceptor(ioc);
+        try
+        {
+            const OwnerOnlyUmask owner_only;
+            acceptor = stream_protocol::acceptor(ioc, stream_protocol::endpoint(admin_path), false);
+        }
+        catch (const asio::system_error& e)
+        {
+            log("[Admin] ", "cannot listen on ", admin_path, ": ", e.what());
+            co_return;
+        }
+        log("[Admin] ", "listening on ", admin_path);
+        while (true)
+        {
+            try
+            {
+                auto peer = co_await acceptor.async_accept(asio::use_awaitable);
+                // the owner, and root, which can do as it likes with the router anyway
+                if (const auto uid = PeerUid(peer.native_handle()); !uid || (*uid != ::geteuid() && *uid != 0))
+                {
+                    log("[Admin] ", "refused a connection from another user");
+                    continue;
+                }
+                asio::co_spawn(ioc, CoSession(std::move(peer)), asio::detached);
+            }
+            catch (const asio::system_error& e)
+            {
+                log("[Admin] ", "accept failed: ", e.what());
+            }
+        }
+    }
+
+private:
+    asio::awaitable<void> CoSession(asio::local::stream_protocol::socket peer)
+    {
+        try
+        {
+            std::string input;
+            while (true)
+            {
+                const std::size_t n = co_await asio::async_read_until(peer, asio::dynamic_buffer(input, max_line), '\n', asio::use_awaitable);
+                std::string reply = Execute(std::string_view(input).substr(0, n - 1));
+                input.erase(0, n);
+                if (!reply.empty() && reply.back() != '\n')
+                    reply += '\n';
+                co_await asio::async_write(peer, asio::buffer(reply), asio::use_awaitable);
+            }
+        }
+        catch (const asio::system_error& e)
+        {
+            // eof, or a line longer than max_line
+        }
+    }
+#else
+    asio::awaitable<void> Run(asio::io_context&)
+    {
+        co_return;
+    }
+
+private:
+#endif
+
+    struct Command
+    {
+        std::string usage;
+        Handler handler;
+    };
+    std::map<std::string, Command> commands;
+};
@@ -14,90 +14,164 @@
 #include <chrono>
 #include <utility>
 #include <system_error>
+#include <ostream>
 
 
 #include "parsemsg.h"
 #include "ServerManager.h"
 #include "munge.h"
 #include "net_buffer.h"
+#include "NetchanRewriter.h"
+#include "Histogram.h"
+#include "EndpointKey.h"
+#include "Handoff.h"
+#include "TrafficStats.h"
+#include "PacketCapture.h"
 
 class ClientData;
 
+// clients moved off draining backends per migration_interval, per listener
+inline int migration_batch_size = 4;
+inline std::chrono::milliseconds migration_interval{ 2000 };
+// a redirected client that hasn't come back by then counts as failed
+inline std::chrono::milliseconds migration_timeout{ 30000 };
+// a client silent for this long is dropped
+inline std::chrono::seconds client_timeout{ 10 };
+
+struct MigrationStats
+{
+    std::uint64_t started = 0;
+    std::uint64_t succeeded = 0;
+    std::uint64_t failed = 0;
+    Histogram rejoin_ms; // redirect sent until the client's new challenge request
+};
+
 class ClientManager
 {
     friend class ClientData;
     using endpoint_t = asio::ip::udp::endpoint;
 
-    std::map<endpoint_t, std::shared_ptr<ClientData>> m_ClientMap;
+    std::map<EndpointKey, std::shared_ptr<ClientData>> m_ClientMap;
     mutable std::shared_mutex sm;
     asio::io_context& ioc;
     const endpoint_t srcds_endpoint;
     asio::ip::udp::socket& main_socket;
+    MigrationStats migration;
+    std::chrono::steady_clock::time_point migrations_paused_until{};
 
 public:
     ClientManager(asio::io_context& use_ioc, endpoint_t to, asio::ip::udp::socket& out_socket) :
         ioc(use_ioc),
         srcds_endpoint(to),
         main_socket(out_socket)
-	{}
+	{
+        asio::co_spawn(ioc, Co_MigrationController(), asio::detached);
+	}
+
+    const MigrationStats& GetMigrationStats() const { return migration; }
+
+    std::size_t Size() const
+    {
+        std::shared_lock sl(sm);
+        return m_ClientMap.size();
+    }
+
+    // Rebalancing by hand (admin "migrate"): asks up to count clients on from to move to another backend
+    // (the best one when to is empty). Returns how many were redirected.
+    int MigrateClients(const std::shared_ptr<BackendServer>& from, int count, const std::shared_ptr<BackendServer>& to = nullptr);
     
     // nullable
     std::shared_ptr<ClientData> GetClientData(endpoint_t ep) const
     {
         std::shared_lock sl(sm);
-        auto iter = m_ClientMap.find(ep);
+        auto iter = m_ClientMap.find(EndpointKey(ep));
         return iter != m_ClientMap.end() ? iter->second : nullptr;
     }
 
     std::shared_ptr<ClientData> AcceptClient(asio::io_context& ioc, ClientManager::endpoint_t from);
 
-    std::shared_ptr<ClientData> RemoveClient(endpoint_t client_endpoint)
+    // Graceful restart. Export returns the sessions with their upstream sockets, which stay open here;
+    // Freeze stops reading them, from then on the next process serves the players. Thaw reads them again
+    // when the next process got none of them.
+    std::vector<HandoffSession> ExportSessions() const;
+    void Freeze();
+    void Thaw();
+    // a redirect target or a reconnect in flight doesn't survive the export, the handoff waits for them to settle
+    bool MigrationInProgress() const;
+    // no new redirects for a while, so that the ones under way can settle
+    void PauseMigrations(std::chrono::steady_clock::duration duration)
     {
-        std::unique_lock ul(sm);
-        if(auto iter = m_ClientMap.find(client_endpoint); iter != m_ClientMap.end())
-        {
-            auto sp = iter->second;
-            m_ClientMap.erase(iter);
-        	
-            auto read_endpoint = main_socket.local_endpoint();
-            log("[", read_endpoint, "]", "Remove client ", client_endpoint, " (", m_ClientMap.size(), " total)");
-        	
-            return sp;
-        }
-        return nullptr;
+        migrations_paused_until = std::chrono::steady_clock::now() + duration;
     }
+    bool MigrationsPaused() const { return std::chrono::steady_clock::now() < migrations_paused_until; }
+    // a session of the previous process, socket is its upstream socket
+    void AdoptSession(const HandoffSession& session, asio::ip::udp::socket socket);
+
+    // the limit busiest sessions by bytes, one line each
+    void DumpTraffic(std::ostream& os, std::size_t limit) const;
+
+    std::shared_ptr<ClientData> RemoveClient(endpoint_t client_endpoint);
+
+private:
+    std::vector<std::shared_ptr<ClientData>> Snapshot() const
+    {
+        std::shared_lock sl(sm);
+        std::vector<std::shared_ptr<ClientData>> clients;
+        clients.reserve(m_ClientMap.size());
+        for (const auto& [key, cd] : m_ClientMap)
+            clients.push_back(cd);
+        return clients;
+    }
+
+    // moves clients off draining backends in paced batches
+    asio::awaitable<void> Co_MigrationController();
+    void OnMigrationFinished(const ClientData& cd, bool success);
+    void OnClientRemoved(ClientData& cd);
 };
 
 class ClientData : public std::enable_shared_from_this<ClientData>
 {
+    friend class ClientManager;
     using endpoint_t = asio::ip::udp::endpoint;
 
     std::atomic<std::chrono::system_clock::time_point> last_recv_time;
+    const std::chrono::system_clock::time_point first_seen = std::chrono::system_clock::now();
+    TrafficCounters traffic;
     ClientManager &cm;
     asio::io_context& ioc;
-    endpoint_t srcds_endpoint;
+    endpoint_t srcds_endpoint; // normalized, see EndpointKey.h
     asio::ip::udp::socket& main_socket;
-    const endpoint_t client_endpoint;
+    const endpoint_t client_endpoint; // as main_socket reports it
+    std::shared_ptr<BackendServer> backend;
+    std::shared_ptr<BackendServer> redirect_target; // taken on the next reconnect
+    std::chrono::steady_clock::time_point migration_started;
+    NetchanRewriter netchan;
     endpoint_t::protocol_type::socket socket;
+    const endpoint_t::protocol_type socket_protocol;
     unsigned short port;
     int has_server_num;
-    bool reconnect;
 
 public:
     explicit ClientData(ClientManager &outer, endpoint_t from) :
+        ClientData(outer, from, OpenDualStackSocket(outer.ioc, 0))
+    {}
+
+    ClientData(ClientManager &outer, endpoint_t from, asio::ip::udp::socket upstream) :
         cm(outer),
         ioc(outer.ioc),
         has_server_num(0),
         main_socket(outer.main_socket),
         client_endpoint(from),
-        socket(ioc, endpoint_t(endpoint_t::protocol_type::v4(), 0))
+        socket(std::move(upstream)),
+        socket_protocol(socket.local_endpoint().protocol())
     {
         last_recv_time = std::chrono::system_clock::now();
-        reconnect = false;
     }
 
     ~ClientData()
     {
+        if (backend)
+            --backend->sessions;
     }
 
     asio::awaitable<void> Co_Timer()
@@ -108,9 +182,9 @@ public:
             asio::system_timer timeout_timer(ioc);
             while (true)
             {
-                timeout_timer.expires_from_now(10s);
+                timeout_timer.expires_from_now(client_timeout);
                 co_await timeout_timer.async_wait(asio::use_awaitable);
-                if (std::chrono::system_clock::now() > last_recv_time.load() + 10s)
+                if (std::chrono::system_clock::now() > last_recv_time.load() + client_timeout)
                     break;
             }
 
@@ -128,42 +202,37 @@ public:
 
 	void SelectServer()
     {
-        srcds_endpoint = GetRandomServer(ioc);
-        ++has_server_num;
+        SwitchBackend(SelectBackendServer());
     }
 
-	asio::awaitable<void> Co_ChangeDestIP()
+    void SwitchBackend(std::shared_ptr<BackendServer> next)
     {
-        //reconnect = true;
-        //SelectServer();
-
-        //constexpr char buffer[] = "\xFF\xFF\xFF\xFF" "\x09" "reconnect\n" "\0";
-        //co_await main_socket.async_send_to(asio::buffer(buffer), client_endpoint, asio::use_awaitable);
-
-        //const std::string response = "\xFF\xFF\xFF\xFF" "L" "127.0.0.1" ":" "27015";
-        //std::size_t bytes_transferred = co_await socket.async_send_to(asio::buffer(response, sizeof(response)), client_endpoint, asio::use_awaitable);
-        co_return;
+        if (!next)
+            return;
+        if (backend)
+            --backend->sessions;
+        backend = std::move(next);
+        ++backend->sessions;
+        srcds_endpoint = backend->endpoint;
+        ++has_server_num;
     }
 
-    asio::awaitable<void> Co_RedirectTest()
+    // Moves a connected player to another backend (the best one when target is empty): the client is told
+    // to "reconnect" in-band and lands on the target when its new challenge request comes in.
+    // Returns false when there is nowhere better to go or a redirect is already under way.
+    bool Redirect(std::shared_ptr<BackendServer> target = nullptr)
     {
-        auto weak_that = weak_from_this();
-        try
-        {
-        	while(auto that = weak_that.lock())
-        	{
-                using namespace std::chrono_literals;
-                asio::system_timer timeout_timer(ioc, 5s);
-                co_await timeout_timer.async_wait(asio::use_awaitable);
-                co_await Co_ChangeDestIP();
-        	}
-        }
-        catch (const asio::system_error& e)
-        {
-            if (e.code() == asio::error::operation_aborted)
-                co_return;
-            std::cout << "Error: " << e.what() << std::endl;
-        }
+        if (!target)
+            target = SelectBackendServer();
+        if (!target || target == backend || target->draining || redirect_target)
+            return false;
+
+        redirect_target = std::move(target);
+        migration_started = std::chrono::steady_clock::now();
+        ++cm.migration.started;
+        netchan.QueueReconnect();
+        log("[ClientData]", " redirect ", client_endpoint, " from ", srcds_endpoint, " to ", redirect_target->endpoint);
+        return true;
     }
 
     asio::awaitable<void> Co_Run()
@@ -176,82 +245,15 @@ public:
                 endpoint_t sender_endpoint;
                 char buffer[4096];
                 std::size_t n = co_await socket.async_receive_from(asio::buffer(buffer), sender_endpoint, asio::use_awaitable);
-                if (sender_endpoint == srcds_endpoint) {
+                if (NormalizeEndpoint(sender_endpoint) == srcds_endpoint) {
                     // srcds => router
-                	if(reconnect && n < 512)
-                	{
-                        BufferReader buf(buffer, n);
-                        auto w1 = buf.ReadLong();
-                        auto w2 = buf.ReadLong();
-                        bool send_reliable = w1 & (1 << 31);
-                        bool send_reliable_fragment = w1 & (1 << 30);
-                		bool chan_incoming_reliable_sequence = w2 & (1 << 31);
-                		int chan_outgoing_sequence = w1 & ~(1 << 31) & ~(1 << 30);
-                        int chan_incoming_sequence = w2 & ~(1 << 31);
-                        COM_UnMunge2((unsigned char*)buffer + 8, n - 8, (unsigned char)(chan_outgoing_sequence - 1));
-#if 0
-
-                        //chan_outgoing_sequence = 0;
-                        //chan_incoming_sequence = 0;
-                        send_reliable = true;
-                        send_reliable_fragment = false;
-                        //chan_incoming_reliable_sequence = false;
-                		
-                        sizebuf_t sb;
-                        MSG_Init(&sb, "ServerPacketOverride", buffer, sizeof buffer);
-                        //SelectServer();
-                		
-                        w1 = chan_outgoing_sequence | (send_reliable << 31);
-                        if (send_reliable && send_reliable_fragment)
-                            w1 |= (1 << 30);
-                        w2 = chan_incoming_sequence | (chan_incoming_reliable_sequence << 31);
-                        MSG_WriteLong(&sb, w1);
-                        MSG_WriteLong(&sb, w2);
-                		// MAX_STREAMS == 2
-                        // 
-                        //MSG_WriteByte(&sb, 0);
-                        //MSG_WriteByte(&sb, 0);
-                		
-                        //MSG_WriteByte(&sb, 9);
-                        //MSG_WriteString(&sb, "reconnect\n");
-
-                        // svc_nop = 1
-                        MSG_WriteByte(&sb, 7);
-                        MSG_WriteByte(&sb, 7);
-                        MSG_WriteByte(&sb, 7);
-                        MSG_WriteByte(&sb, 7);
-                        MSG_WriteByte(&sb, 1);
-                        MSG_WriteByte(&sb, 1);
-                        MSG_WriteByte(&sb, 1);
-                        MSG_WriteByte(&sb, 1);
-                        MSG_WriteByte(&sb, 1);
-
-                        n = MSG_GetNumBytesWritten(&sb); // 20
-#else
-                        //SelectServer();
-                        //char append[] = "\x01" "\x09" "reconnect\n";
-                        //char append[] = "\x01";
-                        //strcpy(buffer + n, append);
-                        //n += strlen(append);
-                        buffer[n++] = 'r';
-                        buffer[n++] = 'e';
-                        buffer[n++] = 'c';
-                        buffer[n++] = 'o';
-                        buffer[n++] = 'n';
-                        buffer[n++] = 'n';
-                        buffer[n++] = 'e';
-                        buffer[n++] = 'c';
-                        buffer[n++] = 't';
-                        buffer[n++] = '\n';
-                        buffer[n++] = '\0';
-                        reconnect = false;
-#endif
-                        log("[RedirectTest]", " Co_RedirectTest()");
-                        COM_Munge2((unsigned char*)buffer + 8, n - 8, (unsigned char)(chan_outgoing_sequence - 1));
-                	}
+                    packet_capture.Record(CaptureDirection::FromBackend, srcds_endpoint, client_endpoint, buffer, n);
+                    n = netchan.OnServerPacket(buffer, n, sizeof(buffer));
                     co_await main_socket.async_wait(main_socket.wait_write, asio::use_awaitable);
                     std::size_t bytes_transferred = co_await main_socket.async_send_to(asio::const_buffer(buffer, n), client_endpoint, asio::use_awaitable);
-                    //log("[ClientData]", " server ", srcds_endpoint, " forward to ", client_endpoint);
+                    traffic.Down(bytes_transferred);
+                    backend->traffic.Down(bytes_transferred);
+                    log_at(LogLevel::debug, "[ClientData]", " server ", srcds_endpoint, " forward to ", client_endpoint);
                     continue;
                 }
             }
@@ -268,26 +270,209 @@ public:
     {
         asio::co_spawn(ioc, Co_Timer(), asio::detached);
         asio::co_spawn(ioc, Co_Run(), asio::detached);
-        //asio::co_spawn(ioc, Co_RedirectTest(), asio::detached);
     }
 
-    asio::awaitable<void> OnRecv(const char *buffer, std::size_t n)
+    asio::awaitable<void> OnRecv(char *buffer, std::size_t n)
     {
         // router => srcds
     	if(!has_server_num)
             SelectServer();
+        if (!backend)
+            co_return; // no backend resolved yet
         last_recv_time = std::chrono::system_clock::now();
+        netchan.OnClientPacket(buffer, n);
         co_await socket.async_wait(socket.wait_write, asio::use_awaitable);
-        co_await socket.async_send_to(asio::buffer(buffer, n), srcds_endpoint, asio::use_awaitable);
-        //log("[ClientData]", " client ", client_endpoint, " forward to ", srcds_endpoint);
+        co_await socket.async_send_to(asio::buffer(buffer, n), EndpointFor(socket_protocol, srcds_endpoint), asio::use_awaitable);
+        traffic.Up(n);
+        backend->traffic.Up(n);
+        log_at(LogLevel::debug, "[ClientData]", " client ", client_endpoint, " forward to ", srcds_endpoint);
     }
 
 	void OnReconnect()
     {
-        SelectServer();
+        // new netchan, and srcds on the other side may be a different one
+        netchan.Reset();
+        if (redirect_target)
+        {
+            cm.OnMigrationFinished(*this, true);
+            SwitchBackend(std::exchange(redirect_target, nullptr));
+        }
+        else
+            SelectServer();
     }
 };
 
+inline int ClientManager::MigrateClients(const std::shared_ptr<BackendServer>& from, int count, const std::shared_ptr<BackendServer>& to)
+{
+    int moved = 0;
+    if (MigrationsPaused())
+        return moved;
+    for (const auto& cd : Snapshot())
+    {
+        if (moved >= count)
+            break;
+        if (cd->backend == from && cd->Redirect(to))
+            ++moved;
+    }
+    return moved;
+}
+
+inline asio::awaitable<void> ClientManager::Co_MigrationController()
+{
+    asio::steady_timer timer(ioc);
+    while (true)
+    {
+        try
+        {
+            timer.expires_after(migration_interval);
+            co_await timer.async_wait(asio::use_awaitable);
+        }
+        catch (const asio::system_error& e)
+        {
+            co_return; // asio::error::operation_aborted
+        }
+
+        const auto now = std::chrono::steady_clock::now();
+        const auto clients = Snapshot();
+        for (const auto& cd : clients)
+        {
+            if (cd->redirect_target && now - cd->migration_started > migration_timeout)
+            {
+                // never came back, it may still do so later and then simply gets a fresh pick
+                OnMigrationFinished(*cd, false);
+                cd->redirect_target = nullptr;
+                cd->netchan.Cancel();
+            }
+        }
+
+        int batch = 0;
+        for (const auto& cd : clients)
+        {
+            if (batch >= migration_batch_size || now < migrations_paused_until)
+                break;
+            if (cd->backend && cd->backend->draining && cd->Redirect())
+                ++batch;
+        }
+        if (batch)
+            log("[", main_socket.local_endpoint(), "]", "Migrating ", batch, " clients off draining backends (",
+                migration.started, " started, ", migration.succeeded, " ok, ", migration.failed, " failed)");
+    }
+}
+
+inline void ClientManager::OnMigrationFinished(const ClientData& cd, bool success)
+{
+    const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - cd.migration_started);
+    if (success)
+    {
+        ++migration.succeeded;
+        migration.rejoin_ms.Record(elapsed.count());
+        log("[", main_socket.local_endpoint(), "]", "Client ", cd.client_endpoint, " rejoined via ", cd.redirect_target->endpoint, " after ", elapsed.count(), "ms (rejoin ", migration.rejoin_ms.ToString(), ")");
+    }
+    else
+    {
+        ++migration.failed;
+        log("[", main_socket.local_endpoint(), "]", "Client ", cd.client_endpoint, " did not rejoin after ", elapsed.count(), "ms");
+    }
+}
+
+inline void ClientManager::OnClientRemoved(ClientData& cd)
+{
+    if (cd.redirect_target)
+    {
+        OnMigrationFinished(cd, false);
+        cd.redirect_target = nullptr;
+    }
+}
+
+inline std::vector<HandoffSession> ClientManager::ExportSessions() const
+{
+    std::vector<HandoffSession> sessions;
+    const auto port = main_socket.local_endpoint().port();
+    for (const auto& cd : Snapshot())
+    {
+        // clients that never got a backend just start over with the new process
+        if (!cd->backend || !cd->socket.is_open())
+            continue;
+        sessions.push_back({ port, cd->client_endpoint, cd->srcds_endpoint, cd->netchan.Parity(), cd->socket.native_handle() });
+    }
+    return sessions;
+}
+
+inline bool ClientManager::MigrationInProgress() const
+{
+    const auto clients = Snapshot();
+    return std::ranges::any_of(clients, [](const auto& cd) { return cd->redirect_target || !cd->netchan.Idle(); });
+}
+
+inline void ClientManager::Freeze()
+{
+    for (const auto& cd : Snapshot())
+    {
+        asio::error_code ec;
+        cd->socket.cancel(ec);
+    }
+}
+
+inline void ClientManager::Thaw()
+{
+    // the reads Freeze cancelled still end with operation_aborted, cancel() only touched those
+    for (const auto& cd : Snapshot())
+        asio::co_spawn(ioc, cd->Co_Run(), asio::detached);
+}
+
+inline void ClientManager::AdoptSession(const HandoffSession& session, asio::ip::udp::socket socket)
+{
+    auto cd = std::make_shared<ClientData>(*this, session.client, std::move(socket));
+    auto backend = FindBackendServer(session.backend);
+    if (!backend)
+    {
+        // not in our list (yet), keep relaying to it; it is never picked for anyone else
+        backend = std::make_shared<BackendServer>(session.backend);
+        log("[", main_socket.local_endpoint(), "]", "Adopted client ", session.client, " is on unknown backend ", session.backend);
+    }
+    cd->SwitchBackend(std::move(backend));
+    cd->netchan.RestoreParity(session.parity);
+    {
+        std::unique_lock ul(sm);
+        m_ClientMap.emplace(EndpointKey(session.client), cd);
+    }
+    cd->Run();
+}
+
+inline std::shared_ptr<ClientData> ClientManager::RemoveClient(endpoint_t client_endpoint)
+{
+    std::unique_lock ul(sm);
+    if(auto iter = m_ClientMap.find(EndpointKey(client_endpoint)); iter != m_ClientMap.end())
+    {
+        auto sp = iter->second;
+        m_ClientMap.erase(iter);
+        OnClientRemoved(*sp);
+
+        auto read_endpoint = main_socket.local_endpoint();
+        log("[", read_endpoint, "]", "Remove client ", client_endpoint, " (", m_ClientMap.size(), " total), ", sp->traffic);
+
+        return sp;
+    }
+    return nullptr;
+}
+
+inline void ClientManager::DumpTraffic(std::ostream& os, std::size_t limit) const
+{
+    auto clients = Snapshot();
+    limit = std::min(limit, clients.size());
+    std::partial_sort(clients.begin(), clients.begin() + limit, clients.end(), [](const auto& a, const auto& b) { return a->traffic.Bytes() > b->traffic.Bytes(); });
+    const auto now = std::chrono::system_clock::now();
+    using std::chrono::duration_cast;
+    using std::chrono::seconds;
+    for (std::size_t i = 0; i < limit; ++i)
+    {
+        const auto& cd = *clients[i];
+        os << "session " << NormalizeEndpoint(cd.client_endpoint) << " => " << cd.srcds_endpoint << ' ' << cd.traffic
+            << " age=" << duration_cast<seconds>(now - cd.first_seen).count() << "s"
+            << " idle=" << duration_cast<seconds>(now - cd.last_recv_time.load()).count() << "s\n";
+    }
+}
+
 inline std::shared_ptr<ClientData> ClientManager::AcceptClient(asio::io_context &ioc, ClientManager::endpoint_t client_endpoint) {
 	if(auto cd = GetClientData(client_endpoint))
 	{
@@ -295,7 +480,7 @@ inline std::shared_ptr<ClientData> ClientManager::AcceptClient(asio::io_context
         return cd;
 	}
     auto cd = std::make_shared<ClientData>(*this, client_endpoint);
-    m_ClientMap.emplace(client_endpoint, cd);
+    m_ClientMap.emplace(EndpointKey(client_endpoint), cd);
     cd->Run();
     auto read_endpoint = main_socket.local_endpoint();
     log("[", read_endpoint, "]", "Add new client ", client_endpoint, " (", m_ClientMap.size(), " total)");
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <compare>
+#include <functional>
+#include <asio.hpp>
+
+#include "log.hpp"
+
+// Dual-stack helpers. A v6 socket with v6_only(false) reports v4 peers as ::ffff:a.b.c.d, so endpoints are kept
+// normalized to plain v4 everywhere (backends, logs, comparisons) and mapped back only when sending on such a socket.
+
+// ::ffff:a.b.c.d => a.b.c.d, anything else unchanged
+inline asio::ip::address NormalizeAddress(const asio::ip::address& address)
+{
+    if (address.is_v6() && address.to_v6().is_v4_mapped())
+        return asio::ip::make_address_v4(asio::ip::v4_mapped, address.to_v6());
+    return address;
+}
+
+inline asio::ip::udp::endpoint NormalizeEndpoint(const asio::ip::udp::endpoint& endpoint)
+{
+    return { NormalizeAddress(endpoint.address()), endpoint.port() };
+}
+
+// the form of endpoint that a socket of protocol can send to: v4 mapped into v6 on a dual-stack socket
+inline asio::ip::udp::endpoint EndpointFor(const asio::ip::udp& protocol, const asio::ip::udp::endpoint& endpoint)
+{
+    if (protocol == asio::ip::udp::v6() && endpoint.address().is_v4())
+        return { asio::ip::make_address_v6(asio::ip::v4_mapped, endpoint.address().to_v4()), endpoint.port() };
+    if (protocol == asio::ip::udp::v4())
+        return NormalizeEndpoint(endpoint);
+    return endpoint;
+}
+
+// asks the socket for its family, hot paths keep the protocol around instead
+inline asio::ip::udp::endpoint EndpointFor(const asio::ip::udp::socket& socket, const asio::ip::udp::endpoint& endpoint)
+{
+    return EndpointFor(socket.local_endpoint().protocol(), endpoint);
+}
+
+// [::]:port taking both families, or 0.0.0.0:port where the host has no IPv6; throws asio::system_error
+inline asio::ip::udp::socket OpenDualStackSocket(asio::io_context& ioc, unsigned short port)
+{
+    using asio::ip::udp;
+    udp::socket socket(ioc);
+    asio::error_code ec;
+    socket.open(udp::v6(), ec);
+    if (!ec)
+        socket.set_option(asio::ip::v6_only(false), ec);
+    if (!ec)
+        socket.bind(udp::endpoint(udp::v6(), port), ec);
+    if (!ec)
+        return socket;
+
+    log("[Socket] ", "no dual-stack socket on port ", port, " (", ec.message(), "), IPv4 only");
+    socket.close(ec);
+    socket = udp::socket(ioc, udp::endpoint(udp::v4(), port));
+    return socket;
+}
+
+// Client table key: 128 bit address with v4 stored v4-mapped, so a player is the same key whichever socket family
+// saw it, and comparing is three integer compares instead of a sockaddr walk.
+struct EndpointKey
+{
+    std::uint64_t high = 0;
+    std::uint64_t low = 0;
+    std::uint16_t port = 0;
+
+    EndpointKey() = default;
+    EndpointKey(const asio::ip::udp::endpoint& endpoint) : port(endpoint.port())
+    {
+        const auto address = endpoint.address();
+        const auto bytes = address.is_v4()
+            ? asio::ip::make_address_v6(asio::ip::v4_mapped, address.to_v4()).to_bytes()
+            : address.to_v6().to_bytes();
+        std::memcpy(&high, bytes.data(), sizeof(high));
+        std::memcpy(&low, bytes.data() + sizeof(high), sizeof(low));
+    }
+
+    friend auto operator<=>(const EndpointKey&, const EndpointKey&) = default;
+};
+
+template<>
+struct std::hash<EndpointKey>
+{
+    std::size_t operator()(const EndpointKey& key) const noexcept
+    {
+        return std::hash<std::uint64_t>()(key.high ^ (key.low * 0x9E3779B97F4A7C15ull) ^ key.port);
+    }
+};
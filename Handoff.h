@@ -0,0 +1,446 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <chrono>
+#include <sstream>
+#include <optional>
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+#include <thread>
+#include <asio.hpp>
+
+#ifdef __linux__
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "PeerCredentials.h"
+#endif
+
+#include "log.hpp"
+
+// Zero-downtime upgrade: a starting router connects to handoff_path, and the running one passes its listen sockets
+// and relayed sessions (with their upstream sockets) over SCM_RIGHTS, then stops reading and exits after handoff_drain.
+// "" disables it. Linux only, elsewhere a restart still drops everyone.
+inline std::string handoff_path = "gorouter.handoff";
+inline std::chrono::milliseconds handoff_drain{ 2000 };
+// how long a starting router waits for a running one that is in the middle of migrating clients
+inline std::chrono::seconds handoff_busy_wait{ 60 };
+
+struct HandoffListener
+{
+    unsigned short port;
+    int fd;
+};
+
+struct HandoffSession
+{
+    unsigned short listen_port;
+    asio::ip::udp::endpoint client;
+    asio::ip::udp::endpoint backend;
+    bool parity; // NetchanRewriter state the client relies on
+    int fd; // upstream socket towards the backend
+};
+
+struct HandoffState
+{
+    std::vector<HandoffListener> listeners;
+    std::vector<HandoffSession> sessions;
+};
+
+// The configured ports plus every inherited one, so nobody is dropped because the config changed.
+// A 0 (any free port) takes an inherited port that wasn't asked for.
+inline std::vector<unsigned int> MergeInheritedPorts(std::vector<unsigned int> ports, const HandoffState& state)
+{
+    std::vector<unsigned int> extra;
+    for (const auto& listener : state.listeners)
+        if (std::find(ports.begin(), ports.end(), listener.port) == ports.end())
+            extra.push_back(listener.port);
+    for (auto& port : ports)
+    {
+        if (port || extra.empty())
+            continue;
+        port = extra.back();
+        extra.pop_back();
+    }
+    ports.insert(ports.end(), extra.begin(), extra.end());
+    return ports;
+}
+
+// the protocol of an inherited socket, for udp::socket::assign
+inline std::optional<asio::ip::udp> SocketProtocol(int fd)
+{
+#ifdef __linux__
+    sockaddr_storage addr{};
+    socklen_t len = sizeof(addr);
+    if (::getsockname(fd, reinterpret_cast<sockaddr*>(&addr), &len) != 0)
+        return std::nullopt;
+    if (addr.ss_family == AF_INET)
+        return asio::ip::udp::v4();
+    if (addr.ss_family == AF_INET6)
+        return asio::ip::udp::v6();
+#endif
+    return std::nullopt;
+}
+
+#ifdef __linux__
+namespace handoff_detail
+{
+    // SCM_MAX_FD
+    constexpr std::size_t max_fds_per_message = 253;
+    constexpr std::size_t max_message_size = 64 * 1024;
+    constexpr auto request = std::string_view("TAKEOVER 1");
+    constexpr auto busy = std::string_view("BUSY");
+    constexpr auto busy_retry = std::chrono::seconds(1);
+
+    // One text line per descriptor, the descriptors ride along in the same message:
+    //   L <port>
+    //   C <listen port> <client address> <client port> <backend address> <backend port> <parity>
+    // and a last message "END" without any. A router that can't hand over right now answers "BUSY" instead.
+    inline bool SendMessage(int sock, const std::string& text, const std::vector<int>& fds)
+    {
+        iovec iov{ const_cast<char*>(text.data()), text.size() };
+        msghdr msg{};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        std::vector<char> control(CMSG_SPACE(sizeof(int) * fds.size()));
+        if (!fds.empty())
+        {
+            msg.msg_control = control.data();
+            msg.msg_controllen = control.size();
+            cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+            std::memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(int) * fds.size());
+        }
+        return ::sendmsg(sock, &msg, MSG_NOSIGNAL) == static_cast<ssize_t>(text.size());
+    }
+
+    // false on error or when the peer is gone
+    inline bool ReceiveMessage(int sock, std::string& text, std::vector<int>& fds)
+    {
+        text.resize(max_message_size);
+        iovec iov{ text.data(), text.size() };
+        std::vector<char> control(CMSG_SPACE(sizeof(int) * max_fds_per_message));
+        msghdr msg{};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.data();
+        msg.msg_controllen = control.size();
+        const ssize_t n = ::recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+        if (n <= 0)
+            return false;
+        text.resize(n);
+        fds.clear();
+        for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+        {
+            if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+                continue;
+            const std::size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            const std::size_t offset = fds.size();
+            fds.resize(offset + count);
+            std::memcpy(fds.data() + offset, CMSG_DATA(cmsg), count * sizeof(int));
+        }
+        return !(msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC));
+    }
+
+    // The descriptors handed over are the router's sockets: both ends only deal with a process of the same user,
+    // or with root, which could take them with ptrace anyway.
+    inline bool PeerIsOwnerOrRoot(int sock)
+    {
+        const auto uid = PeerUid(sock);
+        return uid && (*uid == ::geteuid() || *uid == 0);
+    }
+
+    inline int Connect(const std::string& path)
+    {
+        sockaddr_un addr{};
+        if (path.size() >= sizeof(addr.sun_path))
+            return -1;
+        addr.sun_family = AF_UNIX;
+        std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+        const int sock = ::socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+        if (sock < 0)
+            return -1;
+        if (::connect(sock, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) != 0)
+        {
+            ::close(sock);
+            return -1;
+        }
+        if (!PeerIsOwnerOrRoot(sock))
+        {
+            log("[Handoff] ", handoff_path, " is served by another user, not taking over");
+            ::close(sock);
+            return -1;
+        }
+        timeval timeout{ 5, 0 }; // the old process may be stuck, starting fresh beats hanging
+        ::setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        return sock;
+    }
+
+    inline asio::ip::udp::endpoint ReadEndpoint(std::istream& is)
+    {
+        std::string address;
+        unsigned short port = 0;
+        is >> address >> port;
+        return { asio::ip::make_address(address), port };
+    }
+
+    // one record and its descriptor into state, false if the line doesn't parse
+    inline bool ParseRecord(const std::string& line, int fd, HandoffState& state)
+    {
+        std::istringstream fields(line);
+        char type = 0;
+        fields >> type;
+        try
+        {
+            if (type == 'L')
+            {
+                unsigned short port = 0;
+                if (!(fields >> port))
+                    return false;
+                state.listeners.push_back({ port, fd });
+                return true;
+            }
+            if (type == 'C')
+            {
+                HandoffSession session{};
+                fields >> session.listen_port;
+                session.client = ReadEndpoint(fields);
+                session.backend = ReadEndpoint(fields);
+                if (!(fields >> session.parity))
+                    return false;
+                session.fd = fd;
+                state.sessions.push_back(session);
+                return true;
+            }
+        }
+        catch (const std::exception& e)
+        {
+            // a malformed address
+        }
+        return false;
+    }
+
+    enum class Received
+    {
+        Complete,
+        Cut, // the connection broke before "END"
+        Busy,
+    };
+
+    inline Received ReceiveState(int sock, HandoffState& state)
+    {
+        std::string text;
+        std::vector<int> fds;
+        for (bool first = true; ReceiveMessage(sock, text, fds); first = false)
+        {
+            if (text == "END")
+                return Received::Complete;
+            if (first && text == busy && fds.empty())
+                return Received::Busy;
+            std::istringstream iss(text);
+            std::string line;
+            std::size_t used = 0;
+            // every line owns the next descriptor, after one that doesn't parse the pairing can't be trusted
+            while (std::getline(iss, line))
+            {
+                if (used == fds.size())
+                {
+                    log("[Handoff] ", "record without a descriptor \"", line, "\"");
+                    break;
+                }
+                const int fd = fds[used++];
+                if (!ParseRecord(line, fd, state))
+                {
+                    log("[Handoff] ", "bad record \"", line, "\"");
+                    ::close(fd);
+                    break;
+                }
+            }
+            for (; used < fds.size(); ++used)
+                ::close(fds[used]);
+        }
+        return Received::Cut;
+    }
+}
+
+// Called before binding anything. Empty when no router is listening on handoff_path.
+inline std::optional<HandoffState> ReceiveHandoff()
+{
+    using namespace handoff_detail;
+    if (handoff_path.empty())
+        return std::nullopt;
+
+    HandoffState state;
+    Received received = Received::Cut;
+    for (auto waited = std::chrono::seconds(0); ; waited += busy_retry)
+    {
+        const int sock = Connect(handoff_path);
+        if (sock < 0)
+            return std::nullopt;
+        received = SendMessage(sock, std::string(request), {}) ? ReceiveState(sock, state) : Received::Cut;
+        ::close(sock);
+        if (received != Received::Busy)
+            break;
+        if (waited >= handoff_busy_wait)
+        {
+            log("[Handoff] ", "the router on ", handoff_path, " stayed busy for ", handoff_busy_wait.count(), "s, starting without it");
+            return std::nullopt;
+        }
+        if (waited == std::chrono::seconds(0))
+            log("[Handoff] ", "the router on ", handoff_path, " is migrating clients, waiting");
+        std::this_thread::sleep_for(busy_retry);
+    }
+
+    if (received == Received::Cut)
+    {
+        // every descriptor stands on its own, keep what arrived; the old process exits either way
+        log("[Handoff] ", "takeover from ", handoff_path, " cut short: ", std::strerror(errno));
+        if (state.listeners.empty() && state.sessions.empty())
+            return std::nullopt;
+    }
+    log("[Handoff] ", "took over ", state.listeners.size(), " listen sockets and ", state.sessions.size(), " sessions from ", handoff_path);
+    return state;
+}
+
+// Waits for the next process on handoff_path. export_state is called once a takeover request came in and must
+// either stop this process from reading its sockets, or return nothing to have the request turned away as BUSY;
+// the descriptors it returns stay open here until on_done exits. If not a single one of them got across, resume
+// has to undo export_state and this process keeps serving, handoff_path included.
+template<class ExportState, class OnDone, class Resume>
+asio::awaitable<void> CoServeHandoff(asio::io_context& ioc, ExportState export_state, OnDone on_done, Resume resume)
+{
+    using namespace handoff_detail;
+    using protocol = asio::generic::seq_packet_protocol;
+    sockaddr_un addr{};
+    if (handoff_path.empty() || handoff_path.size() >= sizeof(addr.sun_path))
+        co_return;
+    addr.sun_family = AF_UNIX;
+    std::memcpy(addr.sun_path, handoff_path.c_str(), handoff_path.size() + 1);
+
+    using acceptor_t = asio::basic_socket_acceptor<protocol>;
+    acceptor_t acceptor(ioc);
+    auto listen = [&] {
+        ::unlink(handoff_path.c_str()); // left over from a crashed or already replaced process
+        try
+        {
+            const OwnerOnlyUmask owner_only;
+            acceptor = acceptor_t(ioc, protocol::endpoint(&addr, sizeof(addr)), false);
+            return true;
+        }
+        catch (const asio::system_error& e)
+        {
+            log("[Handoff] ", "cannot listen on ", handoff_path, ": ", e.what());
+            return false;
+        }
+    };
+    if (!listen())
+        co_return;
+
+    while (true)
+    {
+        protocol::socket peer(ioc);
+        try
+        {
+            peer = co_await acceptor.async_accept(asio::use_awaitable);
+            if (!PeerIsOwnerOrRoot(peer.native_handle()))
+            {
+                log("[Handoff] ", "refused a takeover request from another user");
+                continue;
+            }
+            char buffer[64];
+            asio::socket_base::message_flags flags = 0;
+            const std::size_t n = co_await peer.async_receive(asio::buffer(buffer), flags, asio::use_awaitable);
+            if (std::string_view(buffer, n) != request)
+                continue;
+        }
+        catch (const asio::system_error& e)
+        {
+            log("[Handoff] ", "accept failed: ", e.what());
+            continue;
+        }
+
+        // async_receive left the socket non-blocking, and a few messages full of descriptors fill the send buffer;
+        // wait for the new process to read them, but not forever, everything else stands still meanwhile
+        asio::error_code ec;
+        peer.native_non_blocking(false, ec);
+        timeval timeout{ 5, 0 };
+        ::setsockopt(peer.native_handle(), SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        const std::optional<HandoffState> exported = export_state();
+        if (!exported)
+        {
+            log("[Handoff] ", "turned a takeover request away, clients are being migrated");
+            SendMessage(peer.native_handle(), std::string(busy), {});
+            continue;
+        }
+        const HandoffState& state = *exported;
+        log("[Handoff] ", "handing ", state.listeners.size(), " listen sockets and ", state.sessions.size(), " sessions over");
+
+        bool ok = true;
+        bool delivered = false;
+        std::string text;
+        std::vector<int> fds;
+        auto flush = [&] {
+            if (!fds.empty())
+            {
+                ok = ok && SendMessage(peer.native_handle(), text, fds);
+                delivered = delivered || ok;
+            }
+            text.clear();
+            fds.clear();
+        };
+        auto add = [&](const std::string& line, int fd) {
+            if (fds.size() == max_fds_per_message || text.size() + line.size() > max_message_size)
+                flush();
+            text += line;
+            fds.push_back(fd);
+        };
+        for (const auto& listener : state.listeners)
+            add("L " + std::to_string(listener.port) + "\n", listener.fd);
+        for (const auto& session : state.sessions)
+        {
+            std::ostringstream line;
+            line << "C " << session.listen_port << ' ' << session.client.address().to_string() << ' ' << session.client.port() << ' '
+                << session.backend.address().to_string() << ' ' << session.backend.port() << ' ' << session.parity << '\n';
+            add(line.str(), session.fd);
+        }
+        flush();
+        ok = ok && SendMessage(peer.native_handle(), "END", {});
+        if (!ok)
+            log("[Handoff] ", "sending to the new process failed: ", std::strerror(errno));
+        if (!delivered && !(state.listeners.empty() && state.sessions.empty()))
+        {
+            // it has none of our sockets, so they are still ours alone; the new process starts without us
+            // and may take the path over as well, the last one to bind it gets the next takeover request
+            log("[Handoff] ", "nothing was handed over, serving on");
+            resume();
+            acceptor.close(ec);
+            if (!listen())
+                co_return;
+            continue;
+        }
+
+        // the handoff path belongs to the new process now
+        acceptor.close(ec);
+        asio::steady_timer drain(ioc, handoff_drain);
+        co_await drain.async_wait(asio::redirect_error(asio::use_awaitable, ec));
+        on_done();
+        co_return;
+    }
+}
+#else
+inline std::optional<HandoffState> ReceiveHandoff()
+{
+    return std::nullopt;
+}
+
+template<class ExportState, class OnDone, class Resume>
+asio::awaitable<void> CoServeHandoff(asio::io_context&, ExportState, OnDone, Resume)
+{
+    co_return;
+}
+#endif
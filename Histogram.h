@@ -0,0 +1,64 @@
+#pragma once
+
+#include <array>
+#include <bit>
+#include <cstdint>
+#include <sstream>
+#include <string>
+#include <algorithm>
+
+// Fixed log2 buckets: bucket 0 holds 0, bucket i holds [2^(i-1), 2^i). Cheap enough to record on every event,
+// percentiles are reported as the upper bound of their bucket.
+class Histogram
+{
+public:
+    static constexpr std::size_t bucket_count = 32;
+
+    void Record(std::uint64_t value)
+    {
+        ++buckets[std::min<std::size_t>(std::bit_width(value), bucket_count - 1)];
+        ++count;
+        sum += value;
+        max = std::max(max, value);
+    }
+
+    std::uint64_t Count() const { return count; }
+    std::uint64_t Max() const { return max; }
+    std::uint64_t Mean() const { return count ? sum / count : 0; }
+
+    // p in [0, 1]
+    std::uint64_t Percentile(double p) const
+    {
+        if (!count)
+            return 0;
+        const auto rank = static_cast<std::uint64_t>(p * (count - 1)) + 1;
+        std::uint64_t seen = 0;
+        for (std::size_t i = 0; i < bucket_count; ++i)
+        {
+            seen += buckets[i];
+            if (seen >= rank)
+                return std::min(max, i ? (std::uint64_t{ 1 } << i) - 1 : 0);
+        }
+        return max;
+    }
+
+    // "n=12 mean=340 p50<=511 p99<=1023 max=900"
+    std::string ToString() const
+    {
+        std::ostringstream oss;
+        oss << "n=" << count << " mean=" << Mean() << " p50<=" << Percentile(0.5) << " p99<=" << Percentile(0.99) << " max=" << max;
+        return oss.str();
+    }
+
+    void Reset()
+    {
+        buckets = {};
+        count = sum = max = 0;
+    }
+
+private:
+    std::array<std::uint64_t, bucket_count> buckets{};
+    std::uint64_t count = 0;
+    std::uint64_t sum = 0;
+    std::uint64_t max = 0;
+};
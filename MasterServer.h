@@ -0,0 +1,271 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <chrono>
+#include <cstdint>
+#include <random>
+#include <functional>
+#include <algorithm>
+#include <cstring>
+#include <sstream>
+#include <asio.hpp>
+#include <asio/awaitable.hpp>
+
+#include "log.hpp"
+#include "ServerManager.h"
+#include "TSourceEngineQuery.h"
+
+inline constexpr std::string_view master_servers[] = {
+    "hlmaster.net:27010",
+    "hl1master.dt-club.net:27010",
+    "hl1master.steampowered.com:27010",
+    "css.setti.info:27010", // alive
+    "188.40.40.201:27010", // alive
+    "69.28.140.247:27010",
+    "209.197.20.34:27010",
+    "69.28.158.131:27010",
+    "hl1master.5eplay.com:27010",
+	"68.142.72.250:27010"
+};
+static_assert(std::ranges::all_of(master_servers, [](std::string_view server) { return ParseHostPortView(server).has_value(); }));
+
+// GoldSrc master protocol: the server asks for a challenge with a bare 'q', the master answers
+// "\xFF\xFF\xFF\xFF" "s\n" + int32 challenge to that address, and the server sends the '0' infostring heartbeat with it.
+inline bool IsMasterChallengePacket(const char* buffer, std::size_t n)
+{
+    return n >= 9 && !std::memcmp(buffer, "\xFF\xFF\xFF\xFF" "s", 5);
+}
+
+// how often a master that answers gets a heartbeat, like HLDS; jittered by +-10%
+inline std::chrono::seconds master_heartbeat_interval{ 300 };
+
+// Heartbeats for every listen port to every master from one timer. Masters are resolved once, a round sends the
+// challenge requests in small jittered batches, and the listen loop hands the answers to OnChallenge().
+// A master that didn't answer a round is retried with exponential backoff instead of every interval.
+class MasterServerScheduler
+{
+public:
+    static constexpr std::chrono::seconds reply_timeout{ 5 };
+    static constexpr std::chrono::seconds retry_base{ 30 };
+    static constexpr std::chrono::seconds max_backoff{ 3600 };
+    static constexpr std::size_t batch_size = 16;
+    static constexpr std::chrono::milliseconds batch_spacing{ 50 };
+
+    // nullptr while there is nothing to advertise yet
+    using InfoSource = std::function<const TSourceEngineQuery::ServerInfoQueryResult*()>;
+
+    MasterServerScheduler(asio::io_context& ioc, InfoSource info) :
+        ioc(ioc),
+        timer(ioc),
+        info(std::move(info)),
+        rng(std::random_device{}())
+    {}
+
+    // the socket has to outlive the scheduler
+    void Register(asio::ip::udp::socket& socket)
+    {
+        sockets.push_back(&socket);
+    }
+
+    // no more heartbeats from this process, the one that took over the listen sockets sends them;
+    // a Run spawned after this starts over, for a handoff that fell through
+    void Stop()
+    {
+        ++generation;
+        timer.cancel();
+    }
+
+    asio::awaitable<void> Run(std::vector<std::string> names)
+    {
+        const std::uint64_t run = generation;
+        const auto resolved = co_await ResolveAll(ioc, names);
+        if (run != generation)
+            co_return;
+        const auto now = std::chrono::steady_clock::now();
+        for (const auto& name : names)
+        {
+            auto iter = resolved.find(name);
+            if (iter == resolved.end())
+                continue; // already logged by ResolveOne
+            if (std::ranges::any_of(masters, [&](const Master& m) { return m.endpoint == iter->second; }))
+                continue;
+            // spread the first round so that the masters don't all fire at once
+            masters.push_back({ name, iter->second, now + Jitter(reply_timeout, 0.0, 1.0) });
+            log("[MasterServer] ", name, " resolved to ", iter->second);
+        }
+        if (masters.empty())
+        {
+            log("[MasterServer] ", "no master server resolved, heartbeats disabled");
+            co_return;
+        }
+
+        std::vector<Master*> due;
+        while (run == generation)
+        {
+            const auto current = std::chrono::steady_clock::now();
+            due.clear();
+            for (auto& master : masters)
+            {
+                if (master.awaiting && current >= master.reply_deadline)
+                    FinishRound(master, current);
+                if (!master.awaiting && current >= master.next_due)
+                    due.push_back(&master);
+            }
+            if (!due.empty())
+                co_await SendChallenges(due, run);
+            if (run != generation)
+                break;
+
+            auto wake = asio::steady_timer::time_point::max();
+            for (const auto& master : masters)
+                wake = std::min(wake, master.awaiting ? master.reply_deadline : master.next_due);
+            timer.expires_at(wake);
+            asio::error_code ec;
+            co_await timer.async_wait(asio::redirect_error(asio::use_awaitable, ec));
+        }
+    }
+
+    // returns false if sender is not one of our masters
+    asio::awaitable<bool> OnChallenge(asio::ip::udp::socket& socket, const asio::ip::udp::endpoint& sender, const char* buffer, std::size_t n)
+    {
+        auto master = std::ranges::find_if(masters, [&, from = NormalizeEndpoint(sender)](const Master& m) { return m.endpoint == from; });
+        if (master == masters.end() || !master->awaiting)
+            co_return master != masters.end();
+
+        const std::size_t offset = buffer[5] == '\n' ? 6 : 5;
+        if (n < offset + 4)
+            co_return true;
+        std::int32_t challenge;
+        std::memcpy(&challenge, buffer + offset, sizeof(challenge));
+
+        const auto* finfo = info();
+        if (!finfo)
+            co_return true;
+        const std::string heartbeat = MakeHeartbeat(challenge, *finfo);
+        asio::error_code ec;
+        co_await socket.async_send_to(asio::buffer(heartbeat), sender, asio::redirect_error(asio::use_awaitable, ec));
+        if (ec)
+        {
+            log("[MasterServer] ", "heartbeat to ", master->name, " failed: ", ec.message());
+            co_return true;
+        }
+        master->answered = true;
+        co_return true;
+    }
+
+    static std::string MakeHeartbeat(std::int32_t challenge, const TSourceEngineQuery::ServerInfoQueryResult& finfo)
+    {
+        // values can't contain the infostring separator
+        auto value = [](std::string str) {
+            std::erase(str, '\\');
+            std::erase(str, '\n');
+            return str;
+        };
+        const bool windows = finfo.Environment == TSourceEngineQuery::Environment_e::windows || finfo.Environment == TSourceEngineQuery::Environment_e::WINDOWS;
+        std::ostringstream oss;
+        oss << "0\n"
+            << "\\protocol\\" << static_cast<int>(finfo.Protocol)
+            << "\\challenge\\" << challenge
+            << "\\players\\" << finfo.PlayerCount
+            << "\\max\\" << finfo.MaxPlayers
+            << "\\bots\\" << finfo.BotCount
+            << "\\gamedir\\" << value(finfo.Folder)
+            << "\\map\\" << value(finfo.Map)
+            << "\\password\\" << (finfo.Visibility == TSourceEngineQuery::Private ? 1 : 0)
+            << "\\os\\" << (windows ? 'w' : 'l')
+            << "\\lan\\0"
+            << "\\region\\255"
+            << "\\type\\d"
+            << "\\secure\\" << (finfo.VAC ? 1 : 0)
+            << "\\version\\" << value(finfo.GameVersion.value_or("1.1.2.7"))
+            << "\\product\\" << value(finfo.Folder)
+            << "\n";
+        return oss.str();
+    }
+
+private:
+    struct Master
+    {
+        std::string name;
+        asio::ip::udp::endpoint endpoint;
+        asio::steady_timer::time_point next_due;
+        asio::steady_timer::time_point reply_deadline{};
+        bool awaiting = false;
+        bool answered = false; // at least one listen port got a challenge this round
+        int failures = 0;
+    };
+
+    asio::steady_timer::duration Jitter(asio::steady_timer::duration d, double low, double high)
+    {
+        const double factor = std::uniform_real_distribution<double>(low, high)(rng);
+        return std::chrono::duration_cast<asio::steady_timer::duration>(d * factor);
+    }
+
+    void FinishRound(Master& master, asio::steady_timer::time_point now)
+    {
+        master.awaiting = false;
+        if (master.answered)
+        {
+            if (master.failures)
+                log("[MasterServer] ", master.name, " is reachable again after ", master.failures, " failed rounds");
+            master.failures = 0;
+            master.next_due = now + Jitter(master_heartbeat_interval, 0.9, 1.1);
+            return;
+        }
+        ++master.failures;
+        const auto backoff = std::min<asio::steady_timer::duration>(retry_base * (1ll << std::min(master.failures - 1, 16)), max_backoff);
+        master.next_due = now + Jitter(backoff, 0.9, 1.1);
+        if (master.failures == 1 || master.failures % 4 == 0)
+            log("[MasterServer] ", "no answer from ", master.name, " (", master.failures, " in a row), next try in ",
+                std::chrono::duration_cast<std::chrono::seconds>(backoff).count(), "s");
+    }
+
+    asio::awaitable<void> SendChallenges(const std::vector<Master*>& due, std::uint64_t run)
+    {
+        const auto now = std::chrono::steady_clock::now();
+        if (!info() || sockets.empty())
+        {
+            // nothing to advertise yet, doesn't count against the masters
+            for (auto* master : due)
+                master->next_due = now + Jitter(reply_timeout, 1.0, 2.0);
+            co_return;
+        }
+        for (auto* master : due)
+        {
+            master->awaiting = true;
+            master->answered = false;
+            master->reply_deadline = now + reply_timeout;
+        }
+
+        constexpr char request[] = { 'q' };
+        std::size_t in_batch = 0;
+        for (auto* socket : sockets)
+        {
+            for (auto* master : due)
+            {
+                if (in_batch == batch_size)
+                {
+                    in_batch = 0;
+                    timer.expires_after(Jitter(batch_spacing, 0.5, 1.5));
+                    asio::error_code ec;
+                    co_await timer.async_wait(asio::redirect_error(asio::use_awaitable, ec));
+                    if (run != generation)
+                        co_return;
+                }
+                asio::error_code ec;
+                co_await socket->async_send_to(asio::buffer(request), EndpointFor(*socket, master->endpoint), asio::redirect_error(asio::use_awaitable, ec));
+                ++in_batch;
+            }
+        }
+    }
+
+    asio::io_context& ioc;
+    asio::steady_timer timer;
+    InfoSource info;
+    std::mt19937 rng;
+    std::vector<asio::ip::udp::socket*> sockets;
+    std::vector<Master> masters;
+    std::uint64_t generation = 0; // bumped by Stop, a Run of an older one returns
+};
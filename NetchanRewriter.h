@@ -0,0 +1,179 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <string>
+#include <deque>
+
+#include "munge.h"
+
+// Injects "reconnect" into the GoldSrc netchan stream between srcds and one client.
+//
+// A command goes out as svc_stufftext in the reliable part of an otherwise unreliable server packet:
+// the reliable bit is set, the command is put in front of the payload and the packet is munged again
+// with its own sequence. The client flips its reliable bit when it takes the message, and the router
+// flips it back on everything the client sends afterwards, so srcds never sees an ack for a reliable it didn't
+// send. A command that wasn't taken is injected again. If srcds sends a reliable of its own before the injected
+// one is acked, the two toggles can't be told apart; the injection then counts as lost and the parity may be off.
+// That is harmless only because the command ends the connection, which is why nothing else can be injected.
+class NetchanRewriter
+{
+public:
+    static constexpr std::uint8_t svc_stufftext = 9;
+    static constexpr std::size_t max_packet_size = 1400;
+    static constexpr int max_attempts = 8;
+
+    // once is enough, the client is gone after it
+    void QueueReconnect()
+    {
+        if (queued.empty())
+            queued.push_back(std::string(1, static_cast<char>(svc_stufftext)) + "reconnect\n" + '\0');
+    }
+
+    // drops what wasn't sent yet, one in flight still settles with the client's next ack
+    void Cancel()
+    {
+        queued.clear();
+        attempts = 0;
+    }
+
+    bool Idle() const { return queued.empty() && !inflight; }
+    int Delivered() const { return delivered; }
+    int Failed() const { return failed; }
+
+    // carried across a graceful restart: the client keeps toggling on top of what it took from us
+    bool Parity() const { return parity; }
+    void RestoreParity(bool value)
+    {
+        parity = value;
+        client_seen = true;
+    }
+
+    // a new connection starts both sequences over
+    void Reset()
+    {
+        queued.clear();
+        inflight = false;
+        parity = false;
+        client_seen = false;
+        server_reliable_pending = false;
+        attempts = 0;
+    }
+
+    // srcds => client, returns the new length; buffer must have room for max_len bytes
+    std::size_t OnServerPacket(char* buffer, std::size_t n, std::size_t max_len)
+    {
+        std::uint32_t w1;
+        if (n < 8 || IsConnectionless(buffer))
+            return n;
+        std::memcpy(&w1, buffer, sizeof(w1));
+        const std::uint32_t sequence = w1 & ~(reliable_bit | fragment_bit);
+
+        if (w1 & reliable_bit)
+        {
+            // srcds has its own reliable on the wire, wait until the client acked it
+            server_reliable_pending = true;
+            server_reliable_sequence = sequence;
+            if (inflight)
+                inflight_ambiguous = true;
+            return n;
+        }
+
+        if (queued.empty() || inflight || server_reliable_pending || !client_seen)
+            return n;
+
+        const std::string& message = queued.front();
+        const std::size_t limit = std::min(max_len, max_packet_size);
+        if (n + message.size() > limit)
+            return n;
+
+        auto payload = reinterpret_cast<unsigned char*>(buffer) + 8;
+        COM_UnMunge2(payload, static_cast<int>(n - 8), sequence & 0xFF);
+        // the reliable part goes in front of the unreliable datagram
+        std::memmove(payload + message.size(), payload, n - 8);
+        std::memcpy(payload, message.data(), message.size());
+        n += message.size();
+        COM_Munge2(payload, static_cast<int>(n - 8), sequence & 0xFF);
+
+        w1 |= reliable_bit;
+        std::memcpy(buffer, &w1, sizeof(w1));
+
+        inflight = true;
+        inflight_ambiguous = false;
+        inflight_sequence = sequence;
+        // the client toggles this when it takes the message
+        inflight_expected = !client_reliable;
+        ++attempts;
+        return n;
+    }
+
+    // client => srcds, rewrites the reliable ack bit in place
+    void OnClientPacket(char* buffer, std::size_t n)
+    {
+        std::uint32_t w2;
+        if (n < 8 || IsConnectionless(buffer))
+            return;
+        std::memcpy(&w2, buffer + 4, sizeof(w2));
+        const std::uint32_t ack = w2 & ~reliable_bit;
+        const bool reliable = (w2 & reliable_bit) != 0;
+
+        client_seen = true;
+        client_reliable = reliable;
+        if (server_reliable_pending && ack >= server_reliable_sequence)
+            server_reliable_pending = false;
+
+        if (inflight && ack >= inflight_sequence)
+        {
+            inflight = false;
+            if (reliable == inflight_expected && !inflight_ambiguous)
+            {
+                parity = !parity;
+                if (!queued.empty()) // unless cancelled meanwhile
+                    queued.pop_front();
+                ++delivered;
+                attempts = 0;
+            }
+            else if (attempts >= max_attempts && !queued.empty())
+            {
+                queued.pop_front();
+                ++failed;
+                attempts = 0;
+            }
+        }
+
+        if (parity)
+        {
+            w2 ^= reliable_bit;
+            std::memcpy(buffer + 4, &w2, sizeof(w2));
+        }
+    }
+
+private:
+    static constexpr std::uint32_t reliable_bit = 1u << 31;
+    static constexpr std::uint32_t fragment_bit = 1u << 30;
+
+    static bool IsConnectionless(const char* buffer)
+    {
+        return !std::memcmp(buffer, "\xFF\xFF\xFF\xFF", 4);
+    }
+
+    std::deque<std::string> queued;
+    bool inflight = false;
+    std::uint32_t inflight_sequence = 0;
+    bool inflight_expected = false;
+    bool inflight_ambiguous = false;
+    int attempts = 0;
+
+    // reliable bit as the client reports it, before the parity fix
+    bool client_reliable = false;
+    bool client_seen = false;
+    // the client took an odd number of injected reliables
+    bool parity = false;
+
+    bool server_reliable_pending = false;
+    std::uint32_t server_reliable_sequence = 0;
+
+    int delivered = 0;
+    int failed = 0;
+};
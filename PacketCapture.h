@@ -0,0 +1,214 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <memory>
+#include <asio.hpp>
+
+#include "log.hpp"
+#include "EndpointKey.h"
+
+// In-process capture of the last capture_packets packets (0 = off), every capture_sample-th one,
+// cut to capture_snaplen bytes; written as a pcap to capture_path on demand.
+inline std::size_t capture_packets = 0;
+inline std::size_t capture_sample = 1;
+inline std::size_t capture_snaplen = 512;
+inline std::string capture_path = "gorouter.pcap";
+
+enum class CaptureDirection : std::uint8_t
+{
+    FromClient, // on a listen socket, clients and A2S alike
+    FromBackend, // on a session's upstream socket, before the netchan rewrite
+};
+
+// Fixed ring of fixed-size slots. A writer claims a slot with one fetch_add and marks it complete with its
+// sequence number, so the exporter copies without stopping the relay and skips slots rewritten meanwhile.
+// Disabled it costs the relay one branch.
+class PacketCapture
+{
+public:
+    void Enable(std::size_t packets, std::size_t snaplen, std::size_t sample)
+    {
+        if (!packets)
+            return;
+        snap = std::max<std::size_t>(snaplen, 64);
+        every = std::max<std::size_t>(sample, 1);
+        slots = std::make_unique<Slot[]>(packets);
+        data.assign(packets * snap, 0);
+        count = packets;
+        log("[Capture] ", "keeping the last ", packets, " packets", every > 1 ? " sampled 1 in " + std::to_string(every) : std::string(),
+            ", up to ", snap, " bytes each");
+    }
+
+    bool Enabled() const { return count != 0; }
+
+    // from/to as the packet travelled; for FromBackend, to is the client it is relayed to
+    void Record(CaptureDirection direction, const asio::ip::udp::endpoint& from, const asio::ip::udp::endpoint& to, const char* buffer, std::size_t n)
+    {
+        if (!count)
+            return;
+        if (every > 1 && seen.fetch_add(1, std::memory_order_relaxed) % every)
+            return;
+        const std::uint64_t sequence = head.fetch_add(1, std::memory_order_relaxed);
+        Slot& slot = slots[sequence % count];
+        slot.sequence.store(0, std::memory_order_release);
+        slot.time = std::chrono::system_clock::now();
+        slot.direction = direction;
+        slot.from = NormalizeEndpoint(from);
+        slot.to = NormalizeEndpoint(to);
+        if (slot.to.address().is_unspecified() && slot.from.address().is_v4())
+            slot.to = { asio::ip::address_v4::any(), slot.to.port() }; // the dual-stack listen address, as v4 reads better
+        slot.length = static_cast<std::uint32_t>(n);
+        slot.captured = static_cast<std::uint32_t>(std::min(n, snap));
+        std::memcpy(&data[(sequence % count) * snap], buffer, slot.captured);
+        slot.sequence.store(sequence + 1, std::memory_order_release);
+    }
+
+    // oldest first, as raw IP (LINKTYPE_RAW) with synthesized IPv4 / IPv6 and UDP headers; returns packets written
+    std::size_t WritePcap(const std::string& path) const
+    {
+        std::ofstream ofs(path, std::ios::binary | std::ios::trunc);
+        if (!ofs)
+        {
+            log("[Capture] ", "cannot write ", path);
+            return 0;
+        }
+        const std::uint32_t header[] = { 0xa1b2c3d4, 0x00040002, 0, 0, static_cast<std::uint32_t>(snap + 48), 101 };
+        ofs.write(reinterpret_cast<const char*>(header), sizeof(header));
+
+        std::size_t written = 0;
+        const std::uint64_t end = head.load(std::memory_order_acquire);
+        std::vector<char> payload(snap);
+        for (std::uint64_t sequence = end > count ? end - count : 0; sequence < end; ++sequence)
+        {
+            const Slot& slot = slots[sequence % count];
+            if (slot.sequence.load(std::memory_order_acquire) != sequence + 1)
+                continue;
+            const Slot copy = slot;
+            std::memcpy(payload.data(), &data[(sequence % count) * snap], copy.captured);
+            if (slot.sequence.load(std::memory_order_acquire) != sequence + 1)
+                continue; // overwritten while copying
+            WriteRecord(ofs, copy, payload.data());
+            ++written;
+        }
+        log("[Capture] ", "wrote ", written, " packets to ", path);
+        return written;
+    }
+
+private:
+    struct Slot
+    {
+        std::atomic<std::uint64_t> sequence = 0; // sequence + 1 once complete, 0 while written
+        std::chrono::system_clock::time_point time;
+        CaptureDirection direction{};
+        asio::ip::udp::endpoint from;
+        asio::ip::udp::endpoint to;
+        std::uint32_t length = 0;
+        std::uint32_t captured = 0;
+
+        Slot() = default;
+        Slot(const Slot& other) :
+            sequence(other.sequence.load(std::memory_order_relaxed)),
+            time(other.time), direction(other.direction), from(other.from), to(other.to), length(other.length), captured(other.captured)
+        {}
+    };
+
+    static void Put16(std::string& out, std::uint16_t value)
+    {
+        out += static_cast<char>(value >> 8);
+        out += static_cast<char>(value & 0xFF);
+    }
+
+    // ones' complement sum of big-endian 16-bit words, an odd last byte padded with zero
+    static std::uint32_t Sum16(const char* data, std::size_t n, std::uint32_t sum = 0)
+    {
+        for (std::size_t i = 0; i + 1 < n; i += 2)
+            sum += (static_cast<std::uint8_t>(data[i]) << 8) | static_cast<std::uint8_t>(data[i + 1]);
+        if (n & 1)
+            sum += static_cast<std::uint8_t>(data[n - 1]) << 8;
+        return sum;
+    }
+
+    static std::uint16_t Checksum(std::uint32_t sum)
+    {
+        while (sum >> 16)
+            sum = (sum & 0xFFFF) + (sum >> 16);
+        return static_cast<std::uint16_t>(~sum);
+    }
+
+    static void WriteRecord(std::ofstream& ofs, const Slot& slot, const char* payload)
+    {
+        // v4 only when both ends are, otherwise both as v6 (v4-mapped where needed)
+        const bool v4 = slot.from.address().is_v4() && slot.to.address().is_v4();
+        std::string ip;
+        const std::uint16_t udp_length = static_cast<std::uint16_t>(8 + slot.length);
+        if (v4)
+        {
+            ip = { 0x45, 0 };
+            Put16(ip, static_cast<std::uint16_t>(20 + udp_length));
+            ip += std::string{ 0, 0, 0x40, 0, 64, 17, 0, 0 }; // id, don't fragment, ttl, udp, checksum
+            const auto from = slot.from.address().to_v4().to_bytes();
+            const auto to = slot.to.address().to_v4().to_bytes();
+            ip.append(reinterpret_cast<const char*>(from.data()), from.size());
+            ip.append(reinterpret_cast<const char*>(to.data()), to.size());
+            const std::uint16_t checksum = Checksum(Sum16(ip.data(), ip.size()));
+            ip[10] = static_cast<char>(checksum >> 8);
+            ip[11] = static_cast<char>(checksum & 0xFF);
+        }
+        else
+        {
+            auto to_v6 = [](const asio::ip::address& address) {
+                return address.is_v4() ? asio::ip::make_address_v6(asio::ip::v4_mapped, address.to_v4()) : address.to_v6();
+            };
+            ip = { 0x60, 0, 0, 0 };
+            Put16(ip, udp_length);
+            ip += std::string{ 17, 64 };
+            const auto from = to_v6(slot.from.address()).to_bytes();
+            const auto to = to_v6(slot.to.address()).to_bytes();
+            ip.append(reinterpret_cast<const char*>(from.data()), from.size());
+            ip.append(reinterpret_cast<const char*>(to.data()), to.size());
+        }
+        Put16(ip, slot.from.port());
+        Put16(ip, slot.to.port());
+        Put16(ip, udp_length);
+        Put16(ip, 0); // optional over IPv4
+        if (!v4)
+        {
+            // mandatory over IPv6: pseudo-header (addresses, length, next header), UDP header and payload.
+            // A packet cut to the snaplen gets the sum of what was kept, which tools show as unverifiable
+            std::uint32_t sum = Sum16(ip.data() + 8, 32) + udp_length + 17;
+            sum = Sum16(ip.data() + 40, 8, sum);
+            std::uint16_t checksum = Checksum(Sum16(payload, slot.captured, sum));
+            if (!checksum)
+                checksum = 0xFFFF;
+            ip[46] = static_cast<char>(checksum >> 8);
+            ip[47] = static_cast<char>(checksum & 0xFF);
+        }
+
+        const auto since_epoch = std::chrono::duration_cast<std::chrono::microseconds>(slot.time.time_since_epoch()).count();
+        const std::uint32_t record[] = {
+            static_cast<std::uint32_t>(since_epoch / 1000000),
+            static_cast<std::uint32_t>(since_epoch % 1000000),
+            static_cast<std::uint32_t>(ip.size() + slot.captured),
+            static_cast<std::uint32_t>(ip.size() + slot.length),
+        };
+        ofs.write(reinterpret_cast<const char*>(record), sizeof(record));
+        ofs.write(ip.data(), ip.size());
+        ofs.write(payload, slot.captured);
+    }
+
+    std::size_t count = 0;
+    std::size_t snap = 0;
+    std::size_t every = 1;
+    std::unique_ptr<Slot[]> slots;
+    std::vector<char> data;
+    std::atomic<std::uint64_t> head = 0;
+    std::atomic<std::uint64_t> seen = 0;
+};
+
+inline PacketCapture packet_capture;
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <optional>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// The admin and handoff sockets are for the router's own user. They are bound under umask 0077, so they are
+// never reachable by others, not even between bind and a chmod, and every peer's uid is checked as well since
+// not every system honours the mode of a unix socket. Whether root counts is up to each caller.
+
+// uid of the process on the other end of a connected unix socket, nullopt if the system won't tell
+inline std::optional<uid_t> PeerUid(int fd)
+{
+#ifdef SO_PEERCRED
+    ucred cred{};
+    socklen_t len = sizeof(cred);
+    if (::getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0)
+        return std::nullopt;
+    return cred.uid;
+#else
+    uid_t uid;
+    gid_t gid;
+    if (::getpeereid(fd, &uid, &gid) != 0)
+        return std::nullopt;
+    return uid;
+#endif
+}
+
+// umask 0077 for the lifetime of the object, around the bind of an owner-only socket
+class OwnerOnlyUmask
+{
+public:
+    OwnerOnlyUmask() : old_mask(::umask(0077)) {}
+    ~OwnerOnlyUmask() { ::umask(old_mask); }
+    OwnerOnlyUmask(const OwnerOnlyUmask&) = delete;
+    OwnerOnlyUmask& operator=(const OwnerOnlyUmask&) = delete;
+
+private:
+    mode_t old_mask;
+};
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <unordered_map>
+#include <asio.hpp>
+
+#include "log.hpp"
+#include "EndpointKey.h"
+
+// A2S answers per source address and listen port: sustained rate per second (0 = unlimited) and burst size.
+// Generous on purpose, whole CGNAT pools share one v4 address.
+inline double a2s_rate_limit = 50;
+inline double a2s_rate_burst = 100;
+
+// Token bucket per source address. Keyed without the port, a browser opens a new one for every refresh.
+class SourceRateLimiter
+{
+public:
+    static constexpr std::size_t max_sources = 65536;
+    static constexpr std::chrono::seconds sweep_interval{ 60 };
+
+    bool Allow(const asio::ip::udp::endpoint& endpoint)
+    {
+        if (a2s_rate_limit <= 0)
+            return true;
+        const auto now = std::chrono::steady_clock::now();
+        if (buckets.size() >= max_sources || now >= next_sweep)
+            Sweep(now);
+
+        EndpointKey key(endpoint);
+        key.port = 0;
+        auto [iter, inserted] = buckets.try_emplace(key, Bucket{ a2s_rate_burst, now });
+        Bucket& bucket = iter->second;
+        if (!inserted)
+        {
+            const std::chrono::duration<double> elapsed = now - bucket.last;
+            bucket.tokens = std::min(a2s_rate_burst, bucket.tokens + elapsed.count() * a2s_rate_limit);
+            bucket.last = now;
+        }
+        if (bucket.tokens < 1)
+        {
+            ++dropped;
+            return false;
+        }
+        bucket.tokens -= 1;
+        return true;
+    }
+
+    std::uint64_t Dropped() const { return dropped; }
+    std::size_t Sources() const { return buckets.size(); }
+
+private:
+    struct Bucket
+    {
+        double tokens;
+        std::chrono::steady_clock::time_point last;
+    };
+
+    // a bucket that has refilled completely is the same as no bucket
+    void Sweep(std::chrono::steady_clock::time_point now)
+    {
+        const auto refill = std::chrono::duration<double>(a2s_rate_burst / a2s_rate_limit);
+        std::erase_if(buckets, [&](const auto& entry) { return now - entry.second.last >= refill; });
+        if (buckets.size() >= max_sources)
+            buckets.clear(); // under a spoofed flood, forgetting is cheaper than tracking
+        if (dropped != dropped_reported)
+        {
+            log("[RateLimit] ", dropped - dropped_reported, " A2S queries dropped, ", buckets.size(), " sources tracked");
+            dropped_reported = dropped;
+        }
+        next_sweep = now + sweep_interval;
+    }
+
+    std::unordered_map<EndpointKey, Bucket> buckets;
+    std::chrono::steady_clock::time_point next_sweep{};
+    std::uint64_t dropped = 0;
+    std::uint64_t dropped_reported = 0;
+};
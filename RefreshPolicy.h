@@ -0,0 +1,42 @@
+#pragma once
+
+#include <chrono>
+#include <random>
+#include <algorithm>
+
+// When to query a cached upstream again: soon while what it reports keeps changing, doubling up to the stable
+// interval while it doesn't, and exponential backoff from the fast interval while it fails. All jittered by +-10%
+// so that several routers drift apart. The caller keeps serving the last good answer in the meantime.
+class RefreshPolicy
+{
+public:
+    using duration = std::chrono::steady_clock::duration;
+
+    RefreshPolicy() : rng(std::random_device{}()) {}
+
+    duration OnSuccess(bool changed, duration fast, duration stable)
+    {
+        failures = 0;
+        interval = changed || interval == duration::zero() ? fast : std::min<duration>(interval * 2, stable);
+        return Jitter(interval);
+    }
+
+    duration OnFailure(duration fast, duration max_backoff)
+    {
+        ++failures;
+        return Jitter(std::min<duration>(fast * (1ll << std::min(failures - 1, 16)), max_backoff));
+    }
+
+    int Failures() const { return failures; }
+
+private:
+    duration Jitter(duration d)
+    {
+        const double factor = std::uniform_real_distribution<double>(0.9, 1.1)(rng);
+        return std::chrono::duration_cast<duration>(d * factor);
+    }
+
+    std::mt19937 rng;
+    duration interval{};
+    int failures = 0;
+};
@@ -0,0 +1,393 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <chrono>
+#include <functional>
+#include <fstream>
+#include <sstream>
+#include <set>
+#include <charconv>
+#include <stdexcept>
+#include <algorithm>
+
+#include "log.hpp"
+#include "parse_ip.h"
+#include "ServerManager.h"
+#include "ClientManager.h"
+#include "MasterServer.h"
+#include "RateLimiter.h"
+#include "SteamPump.h"
+#include "Handoff.h"
+#include "PacketCapture.h"
+#include "AdminSocket.h"
+
+// Settings that only main.cpp uses. Subsystem knobs stay inline globals next to their code
+// (backend_target_occupancy, migration_*, ...) and are bound into the same option table below.
+struct RouterConfig
+{
+    std::vector<unsigned int> ports;
+    unsigned int ephemeral_ports = 0; // listeners on any free port
+    unsigned int dest_port = 6666;
+    std::string desc_host = "z4.moemod.com"; // the server whose A2S replies are cached and served
+    std::vector<std::string> masters{ std::begin(master_servers), std::end(master_servers) };
+    std::vector<std::string> server_names;
+    std::vector<std::string> map_names;
+    int player_num = -1;
+
+    std::chrono::seconds a2s_cache_interval{ 180 }; // while nothing changes
+    std::chrono::seconds a2s_cache_fast_interval{ 15 }; // while players or map change, and the first retry
+    std::chrono::seconds a2s_cache_max_backoff{ 600 };
+    std::chrono::milliseconds a2s_query_timeout{ 500 };
+    std::chrono::seconds backend_poll_interval{ 15 };
+    int socket_buffer_size = 0; // SO_RCVBUF / SO_SNDBUF of the listen sockets, 0 = OS default
+};
+
+inline RouterConfig router_config;
+
+namespace router_config_detail
+{
+    inline std::string_view Trim(std::string_view sv)
+    {
+        while (!sv.empty() && (sv.front() == ' ' || sv.front() == '\t' || sv.front() == '\r'))
+            sv.remove_prefix(1);
+        while (!sv.empty() && (sv.back() == ' ' || sv.back() == '\t' || sv.back() == '\r'))
+            sv.remove_suffix(1);
+        if (sv.size() >= 2 && sv.front() == '"' && sv.back() == '"')
+            sv = sv.substr(1, sv.size() - 2);
+        return sv;
+    }
+
+    template<class T>
+    T ParseNumber(std::string_view sv)
+    {
+        T value{};
+        auto [ptr, ec] = std::from_chars(sv.data(), sv.data() + sv.size(), value);
+        if (ec != std::errc() || ptr != sv.data() + sv.size())
+            throw std::invalid_argument("not a number: " + std::string(sv));
+        return value;
+    }
+
+    // "500ms", "15s", "5m" or a bare number in the unit of the option
+    template<class Duration>
+    Duration ParseDuration(std::string_view sv)
+    {
+        using namespace std::chrono;
+        const auto unit = sv.find_first_not_of("0123456789");
+        const auto count = ParseNumber<long long>(sv.substr(0, unit));
+        const auto suffix = unit == std::string_view::npos ? std::string_view() : sv.substr(unit);
+        if (suffix.empty())
+            return Duration(count);
+        if (suffix == "ms")
+            return duration_cast<Duration>(milliseconds(count));
+        if (suffix == "s")
+            return duration_cast<Duration>(seconds(count));
+        if (suffix == "m")
+            return duration_cast<Duration>(minutes(count));
+        throw std::invalid_argument("unknown unit: " + std::string(sv));
+    }
+
+    template<class T> std::string ToString(const T& value) { std::ostringstream oss; oss << value; return oss.str(); }
+    template<class Rep, class Period> std::string ToString(const std::chrono::duration<Rep, Period>& d)
+    {
+        return std::to_string(std::chrono::duration_cast<std::chrono::milliseconds>(d).count()) + "ms";
+    }
+    template<class T> std::string ToString(const std::vector<T>& values)
+    {
+        std::string res;
+        for (const auto& value : values)
+            res += (res.empty() ? "" : ",") + ToString(value);
+        return res;
+    }
+}
+
+// One row per setting: the key in the config file, the command line flag and how to set / show it.
+// Lists take comma separated values or repeated keys / flags; a list given on the command line
+// replaces the one from the file.
+struct ConfigOption
+{
+    std::string_view key;
+    std::string_view flag; // aliases separated by '|'
+    std::string_view help;
+    bool list;
+    std::function<void(std::string_view)> set;
+    // lists: every item is parsed before the list is touched, so a bad one leaves it as it was
+    std::function<void(const std::vector<std::string_view>& items, bool replace)> assign;
+    std::function<std::string()> show;
+};
+
+template<class T>
+ConfigOption MakeOption(std::string_view key, std::string_view flag, T& target, std::string_view help)
+{
+    using namespace router_config_detail;
+    ConfigOption option{ key, flag, help, false, {}, {}, [&target] { return ToString(target); } };
+    if constexpr (std::is_same_v<T, std::string>)
+        option.set = [&target](std::string_view sv) { target = sv; };
+    else if constexpr (requires { typename T::period; })
+        option.set = [&target](std::string_view sv) { target = ParseDuration<T>(sv); };
+    else
+        option.set = [&target](std::string_view sv) { target = ParseNumber<T>(sv); };
+    return option;
+}
+
+// parse(item, out) appends what one item stands for to out, or throws
+template<class T, class Parse>
+ConfigOption MakeListOption(std::string_view key, std::string_view flag, std::vector<T>& target, std::string_view help, Parse parse)
+{
+    return { key, flag, help, true, {},
+        [&target, parse](const std::vector<std::string_view>& items, bool replace) {
+            std::vector<T> parsed;
+            for (auto item : items)
+                parse(item, parsed);
+            if (replace)
+                target = std::move(parsed);
+            else
+                target.insert(target.end(), parsed.begin(), parsed.end());
+        },
+        [&target] { return router_config_detail::ToString(target); } };
+}
+
+// host:port lists, checked like the built-in ones
+inline ConfigOption MakeServerListOption(std::string_view key, std::string_view flag, std::vector<std::string>& target, std::string_view help)
+{
+    return MakeListOption(key, flag, target, help, [](std::string_view sv, std::vector<std::string>& out) {
+        if (!ParseHostPortView(sv))
+            throw std::invalid_argument("not a host:port: " + std::string(sv));
+        out.emplace_back(sv);
+    });
+}
+
+inline ConfigOption MakeStringListOption(std::string_view key, std::string_view flag, std::vector<std::string>& target, std::string_view help)
+{
+    return MakeListOption(key, flag, target, help, [](std::string_view sv, std::vector<std::string>& out) { out.emplace_back(sv); });
+}
+
+inline const std::vector<ConfigOption>& ConfigOptions()
+{
+    using namespace router_config_detail;
+    auto& c = router_config;
+    static const std::vector<ConfigOption> options = {
+        { "log.level", "-loglevel", "error, warn, info or debug", false,
+            [](std::string_view sv) {
+                const auto level = ParseLogLevel(sv);
+                if (!level)
+                    throw std::invalid_argument("not a log level: " + std::string(sv));
+                log_level = *level;
+            },
+            {},
+            [] { return std::string(LogLevelName(log_level)); } },
+
+        MakeListOption("listen.port", "-port|-ports", c.ports, "listen port, or a range like 27015-27020",
+            [](std::string_view sv, std::vector<unsigned int>& out) {
+                const auto dash = sv.find('-');
+                const auto first = ParseNumber<unsigned>(sv.substr(0, dash));
+                const auto last = dash == std::string_view::npos ? first : ParseNumber<unsigned>(sv.substr(dash + 1));
+                if (!first || !last || first > 65535 || last > 65535)
+                    throw std::invalid_argument("not a port or port range: " + std::string(sv));
+                for (unsigned port = std::min(first, last); port <= std::max(first, last); ++port)
+                    out.push_back(port);
+            }),
+        MakeOption("listen.ephemeral", "-portsnum", c.ephemeral_ports, "additional listeners on any free port"),
+        MakeOption("listen.socket_buffer", "-socketbuf", c.socket_buffer_size, "SO_RCVBUF/SO_SNDBUF of listen sockets in bytes, 0 = OS default"),
+
+        MakeOption("backend.desc_host", "-deschost", c.desc_host, "server whose A2S replies are served"),
+        MakeOption("backend.dest_port", "-destport", c.dest_port, "port of desc_host"),
+        MakeServerListOption("backend.server", "-backend", backend_names, "backend host:port"),
+        MakeOption("backend.target_occupancy", "-occupancy", backend_target_occupancy, "fill a backend up to this fraction before spreading"),
+        MakeOption("backend.poll_interval", "-pollinterval", c.backend_poll_interval, "A2S_INFO poll of every backend"),
+        MakeOption("backend.resolve_interval", "-resolveinterval", resolve_interval, "DNS refresh of backend names"),
+        MakeOption("backend.resolve_timeout", "-resolvetimeout", resolve_timeout, "give up on one name after this long"),
+        MakeOption("backend.resolver_cache", "-resolvercache", resolver_cache_path, "last-known endpoints file"),
+
+        MakeStringListOption("server.hostname", "+hostname", c.server_names, "advertised server name, picked at random per reply"),
+        MakeStringListOption("server.map", "+map", c.map_names, "advertised map, picked at random per reply"),
+        MakeOption("server.maxplayers", "+maxplayers", c.player_num, "advertised player count, -1 = the real one"),
+
+        MakeServerListOption("master.server", "-master", c.masters, "master server host:port"),
+        MakeOption("master.heartbeat_interval", "-heartbeat", master_heartbeat_interval, "heartbeat period per master"),
+
+        MakeOption("a2s.cache_interval", "-a2sinterval", c.a2s_cache_interval, "refresh of the cached A2S replies while nothing changes"),
+        MakeOption("a2s.cache_fast_interval", "-a2sfastinterval", c.a2s_cache_fast_interval, "refresh while player count or map change"),
+        MakeOption("a2s.cache_max_backoff", "-a2sbackoff", c.a2s_cache_max_backoff, "longest retry delay while the refresh fails"),
+        MakeOption("a2s.query_timeout", "-a2stimeout", c.a2s_query_timeout, "timeout of one A2S query to a backend"),
+        MakeOption("a2s.rate", "-a2srate", a2s_rate_limit, "A2S answers per second per source address, 0 = unlimited"),
+        MakeOption("a2s.burst", "-a2sburst", a2s_rate_burst, "A2S answers a source may burst"),
+
+        MakeOption("client.timeout", "-clienttimeout", client_timeout, "drop a client silent for this long"),
+        MakeOption("migration.batch_size", "-migrationbatch", migration_batch_size, "clients moved off draining backends per interval"),
+        MakeOption("migration.interval", "-migrationinterval", migration_interval, "pace of the migration batches"),
+        MakeOption("migration.timeout", "-migrationtimeout", migration_timeout, "a redirected client not back by then failed"),
+
+        MakeOption("traffic.top_sources", "-topsources", traffic_top_sources, "source addresses tracked for the heavy hitter list"),
+        MakeOption("traffic.dump_sessions", "-dumpsessions", traffic_dump_sessions, "sessions and sources listed per traffic dump"),
+
+        MakeOption("capture.packets", "-capture", capture_packets, "packets kept in the capture ring, 0 = off"),
+        MakeOption("capture.sample", "-capturesample", capture_sample, "capture 1 in this many packets"),
+        MakeOption("capture.snaplen", "-capturesnaplen", capture_snaplen, "bytes kept per captured packet"),
+        MakeOption("capture.path", "-capturefile", capture_path, "pcap written on SIGUSR2"),
+
+        MakeOption("admin.path", "-admin", admin_path, "unix socket for admin commands"),
+
+        MakeOption("restart.handoff_path", "-handoff", handoff_path, "unix socket for graceful restarts"),
+        MakeOption("restart.drain", "-handoffdrain", handoff_drain, "how long the old process lingers after a handoff"),
+        MakeOption("restart.busy_wait", "-handoffwait", handoff_busy_wait, "how long a new process waits for a migrating one to hand over"),
+
+        MakeOption("steam.pump_min_interval", "-steampumpmin", steam_pump_min_interval, "Steam pump period after traffic"),
+        MakeOption("steam.pump_max_interval", "-steampumpmax", steam_pump_max_interval, "Steam pump period while idle"),
+    };
+    return options;
+}
+
+class ConfigLoader
+{
+public:
+    // "key = value" lines under [section] headers, # or ; comments
+    bool LoadFile(const std::string& path)
+    {
+        std::ifstream ifs(path);
+        if (!ifs)
+        {
+            log("[Config] ", "cannot read ", path);
+            return false;
+        }
+        std::set<std::string_view> seen;
+        std::string line, section;
+        int line_number = 0;
+        while (std::getline(ifs, line))
+        {
+            ++line_number;
+            std::string_view sv = line;
+            sv = router_config_detail::Trim(sv.substr(0, sv.find_first_of("#;")));
+            if (sv.empty())
+                continue;
+            if (sv.front() == '[' && sv.back() == ']')
+            {
+                section = router_config_detail::Trim(sv.substr(1, sv.size() - 2));
+                continue;
+            }
+            const auto eq = sv.find('=');
+            if (eq == std::string_view::npos)
+            {
+                log("[Config] ", path, ":", line_number, ": expected key = value");
+                continue;
+            }
+            const auto key = router_config_detail::Trim(sv.substr(0, eq));
+            const std::string full_key = section.empty() ? std::string(key) : section + "." + std::string(key);
+            const auto* option = Find([&](const ConfigOption& o) { return o.key == full_key; });
+            if (!option)
+            {
+                log("[Config] ", path, ":", line_number, ": unknown key ", full_key);
+                continue;
+            }
+            Apply(*option, router_config_detail::Trim(sv.substr(eq + 1)), seen);
+        }
+        return true;
+    }
+
+    // every flag takes one value; -config <file> is read first wherever it appears, so the command line wins
+    template<std::ranges::input_range ArgsRange>
+    void LoadArgs(ArgsRange args)
+    {
+        std::vector<std::string_view> argv(std::ranges::begin(args), std::ranges::end(args));
+        for (std::size_t i = 1; i + 1 < argv.size(); ++i)
+            if (argv[i] == "-config")
+                LoadFile(std::string(argv[i + 1]));
+
+        std::set<std::string_view> seen;
+        for (std::size_t i = 1; i < argv.size(); ++i)
+        {
+            if (argv[i] == "-config")
+            {
+                ++i;
+                continue;
+            }
+            const auto* option = Find([&](const ConfigOption& o) { return HasFlag(o, argv[i]); });
+            if (!option)
+                continue; // srcds-style arguments we don't know are fine
+            if (i + 1 >= argv.size())
+            {
+                log("[Config] ", argv[i], " needs a value");
+                break;
+            }
+            Apply(*option, argv[++i], seen);
+        }
+    }
+
+    // the effective settings, one line per option
+    static void Dump()
+    {
+        for (const auto& option : ConfigOptions())
+            log("[Config] ", option.key, " = ", option.show());
+    }
+
+    static void Usage()
+    {
+        for (const auto& option : ConfigOptions())
+            log("  ", option.flag, " / ", option.key, (option.list ? " (list)" : ""), ": ", option.help);
+    }
+
+    // A change at runtime, a list is replaced as a whole. Settings read at startup (ports, paths) only
+    // take effect on the next start. Returns the error, empty on success.
+    static std::string Set(std::string_view key, std::string_view value)
+    {
+        const auto* option = Find([&](const ConfigOption& o) { return o.key == key; });
+        if (!option)
+            return "unknown key " + std::string(key);
+        std::set<std::string_view> seen;
+        if (auto error = Apply(*option, value, seen); !error.empty())
+            return error;
+        log("[Config] ", option->key, " = ", option->show(), " (live)");
+        return {};
+    }
+
+private:
+    static bool HasFlag(const ConfigOption& option, std::string_view arg)
+    {
+        for (std::string_view flags = option.flag; !flags.empty();)
+        {
+            const auto bar = flags.find('|');
+            if (flags.substr(0, bar) == arg)
+                return true;
+            flags.remove_prefix(bar == std::string_view::npos ? flags.size() : bar + 1);
+        }
+        return false;
+    }
+
+    template<class Pred>
+    static const ConfigOption* Find(Pred pred)
+    {
+        const auto& options = ConfigOptions();
+        auto iter = std::ranges::find_if(options, pred);
+        return iter == options.end() ? nullptr : &*iter;
+    }
+
+    // a list is replaced by the first value from each source and appended to by the rest; returns the error, if any
+    static std::string Apply(const ConfigOption& option, std::string_view value, std::set<std::string_view>& seen)
+    {
+        try
+        {
+            if (!option.list)
+            {
+                option.set(value);
+                return {};
+            }
+            std::vector<std::string_view> items;
+            while (!value.empty())
+            {
+                const auto comma = value.find(',');
+                if (auto item = router_config_detail::Trim(value.substr(0, comma)); !item.empty())
+                    items.push_back(item);
+                value.remove_prefix(comma == std::string_view::npos ? value.size() : comma + 1);
+            }
+            option.assign(items, !seen.contains(option.key));
+            seen.insert(option.key);
+        }
+        catch (const std::exception& e)
+        {
+            log("[Config] ", option.key, ": ", e.what());
+            return e.what();
+        }
+        return {};
+    }
+};
@@ -1,9 +1,21 @@
 #pragma once
 #include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <algorithm>
+#include <map>
+#include <optional>
+#include <functional>
+#include <fstream>
+#include <cstdio>
 #include <asio.hpp>
 #include <asio/awaitable.hpp>
 #include "parse_ip.h"
-inline std::string dest_servers[] = {
+#include "log.hpp"
+#include "EndpointKey.h"
+#include "TrafficStats.h"
+inline constexpr std::string_view dest_servers[] = {
     "134.175.190.225:27016",
     "134.175.190.225:27010",
     "106.55.247.210:27015",
@@ -14,33 +26,301 @@ inline std::string dest_servers[] = {
     "121.37.13.108:27020"
 };
 /*
-inline std::string dest_servers[] = {
+inline constexpr std::string_view dest_servers[] = {
     "z4.moemod.com:6666"
 };
 */
-inline std::vector<asio::ip::udp::endpoint> dest_servers_endpoints;
+static_assert(std::ranges::all_of(dest_servers, [](std::string_view server) { return ParseHostPortView(server).has_value(); }));
 
-asio::awaitable<void> InitServers(asio::io_context& ioc)
+// the backends in use, dest_servers unless configured otherwise
+inline std::vector<std::string> backend_names{ std::begin(dest_servers), std::end(dest_servers) };
+
+// fill servers up to this fraction of MaxPlayers before spreading to emptier ones
+inline double backend_target_occupancy = 0.75;
+
+struct BackendServer
+{
+    explicit BackendServer(asio::ip::udp::endpoint ep) : endpoint(ep) {}
+
+    const asio::ip::udp::endpoint endpoint;
+    std::atomic_int sessions = 0; // ClientData bound to this backend by us
+    std::atomic_int player_count = -1; // latest A2S_INFO, -1 if never polled
+    std::atomic_int max_players = -1;
+    std::atomic_int sessions_at_poll = 0;
+    std::atomic_bool draining = false; // no new sessions, ClientManager moves the existing ones away
+    TrafficCounters traffic; // relayed by all our sessions on it, ever
+
+    void UpdateFill(int PlayerCount, int MaxPlayers)
+    {
+        player_count = PlayerCount;
+        max_players = MaxPlayers;
+        sessions_at_poll = sessions.load();
+    }
+
+    int EstimatedPlayers() const
+    {
+        const int now = sessions.load();
+        const int polled = player_count.load();
+        if (polled < 0)
+            return now;
+        // our own sessions are live while A2S is up to one poll old, so apply their delta since then
+        return std::max(now, polled + now - sessions_at_poll.load());
+    }
+
+    double Occupancy() const
+    {
+        // 32 is the GoldSrc slot limit, good enough until the first poll answers
+        const int slots = max_players.load();
+        return static_cast<double>(EstimatedPlayers()) / (slots > 0 ? slots : 32);
+    }
+
+    bool IsFull() const
+    {
+        const int slots = max_players.load();
+        return slots > 0 && EstimatedPlayers() >= slots;
+    }
+};
+
+using BackendServerList = std::vector<std::shared_ptr<BackendServer>>;
+// Published as a whole: readers take a snapshot with BackendServers(), UpdateServers swaps in a new list.
+inline std::atomic<std::shared_ptr<const BackendServerList>> dest_servers_backends{ std::make_shared<const BackendServerList>() };
+
+inline std::shared_ptr<const BackendServerList> BackendServers()
+{
+    return dest_servers_backends.load();
+}
+
+// last-known addresses, so a restart can serve before DNS answers
+inline std::string resolver_cache_path = "gorouter.endpoints";
+
+// how often names are looked up again after startup, jittered by +-20%
+inline std::chrono::seconds resolve_interval{ 300 };
+
+// how long one name may take before it counts as failed
+inline std::chrono::seconds resolve_timeout{ 10 };
+
+// "host:port" => endpoint
+using ResolvedEndpoints = std::map<std::string, asio::ip::udp::endpoint>;
+
+inline ResolvedEndpoints LoadResolverCache()
+{
+    ResolvedEndpoints result;
+    std::ifstream ifs(resolver_cache_path);
+    std::string name, address;
+    unsigned short port;
+    while (ifs >> name >> address >> port)
+    {
+        asio::error_code ec;
+        auto ip = asio::ip::make_address(address, ec);
+        if (!ec)
+            result[name] = asio::ip::udp::endpoint(NormalizeAddress(ip), port);
+    }
+    return result;
+}
+
+inline void SaveResolverCache(const ResolvedEndpoints& endpoints)
+{
+    const std::string tmp = resolver_cache_path + ".tmp";
+    {
+        std::ofstream ofs(tmp, std::ios::trunc);
+        for (const auto& [name, ep] : endpoints)
+            ofs << name << ' ' << ep.address().to_string() << ' ' << ep.port() << '\n';
+        if (!ofs)
+        {
+            log("[ServerManager] ", "write ", tmp, " failed");
+            return;
+        }
+    }
+    std::rename(tmp.c_str(), resolver_cache_path.c_str());
+}
+
+// one name => its endpoint, as soon as that name is resolved
+using ResolvedCallback = std::function<void(const std::string& name, const asio::ip::udp::endpoint& endpoint)>;
+
+inline asio::awaitable<void> ResolveOne(asio::io_context& ioc, std::string name, ResolvedCallback on_resolved,
+    std::shared_ptr<std::size_t> pending, std::shared_ptr<asio::steady_timer> done)
 {
     using namespace asio::ip;
-    for(auto dest_server : dest_servers)
+    struct Lookup
     {
-        auto [host, port] = ParseHostPort(dest_server);
+        explicit Lookup(asio::io_context& ioc) : resolver(ioc), wake(ioc, resolve_timeout) {}
+        udp::resolver resolver;
+        asio::steady_timer wake; // the deadline, cancelled early by the answer
+        std::optional<udp::resolver::results_type> endpoints;
+        asio::error_code ec;
+    };
+    // getaddrinfo can't be interrupted, so wait on the deadline and let a late answer land in the abandoned Lookup
+    auto lookup = std::make_shared<Lookup>(ioc);
+    auto [host, port] = ParseHostPort(name);
+    lookup->resolver.async_resolve(host, port, [lookup](const asio::error_code& ec, udp::resolver::results_type endpoints) {
+        lookup->ec = ec;
+        lookup->endpoints = std::move(endpoints);
+        lookup->wake.cancel();
+    });
+    asio::error_code ec;
+    co_await lookup->wake.async_wait(asio::redirect_error(asio::use_awaitable, ec));
 
-        udp::resolver resolver(ioc);
-        auto dest_endpoints = co_await resolver.async_resolve(udp::v4(), host, port, asio::use_awaitable);
-        udp::endpoint dest_endpoint;
-        for (const auto& ep : dest_endpoints)
-            dest_endpoint = ep;
+    if (!lookup->endpoints)
+    {
+        lookup->resolver.cancel();
+        log("[ServerManager] ", "resolve ", name, " timed out after ", resolve_timeout.count(), "s");
+    }
+    else if (lookup->ec)
+    {
+        log("[ServerManager] ", "resolve ", name, " failed: ", lookup->ec.message());
+    }
+    else
+    {
+        // IPv4 when the name has both, IPv6 only for v6 literals and v6-only hosts
+        std::optional<udp::endpoint> best;
+        for (const auto& entry : *lookup->endpoints)
+        {
+            const auto ep = NormalizeEndpoint(entry.endpoint());
+            if (!best || (best->address().is_v6() && ep.address().is_v4()))
+                best = ep;
+        }
+        if (best)
+            on_resolved(name, *best);
+    }
+    if (--*pending == 0)
+        done->cancel();
+}
+
+// Every name at once, each reported through on_resolved as soon as it is known, so one dead DNS entry only
+// costs its own timeout and doesn't hold up the others. Returns once every name answered or timed out.
+inline asio::awaitable<void> ResolveEach(asio::io_context& ioc, const std::vector<std::string>& names, ResolvedCallback on_resolved)
+{
+    auto pending = std::make_shared<std::size_t>(names.size());
+    auto done = std::make_shared<asio::steady_timer>(ioc, asio::steady_timer::time_point::max());
+    for (const auto& name : names)
+        asio::co_spawn(ioc, ResolveOne(ioc, name, on_resolved, pending, done), asio::detached);
+    if (*pending)
+    {
+        asio::error_code ec;
+        co_await done->async_wait(asio::redirect_error(asio::use_awaitable, ec));
+    }
+}
+
+// ResolveEach, collected. Failed names are missing from the result.
+inline asio::awaitable<ResolvedEndpoints> ResolveAll(asio::io_context& ioc, const std::vector<std::string>& names)
+{
+    ResolvedEndpoints result;
+    co_await ResolveEach(ioc, names, [&result](const std::string& name, const asio::ip::udp::endpoint& endpoint) {
+        result[name] = endpoint;
+    });
+    co_return result;
+}
 
-        dest_servers_endpoints.emplace_back(dest_endpoint);
-        log("[ServerManager] ", "add server ip ", dest_endpoint);
+// Rebuilds dest_servers_backends in backend_names order. Backends whose address is unchanged are kept
+// with their counters, names that never resolved are left out. A backend whose address went away is
+// marked draining, so the sessions still on it get migrated.
+inline void UpdateServers(const ResolvedEndpoints& resolved)
+{
+    const auto current = BackendServers();
+    auto next = std::make_shared<BackendServerList>();
+    for (const auto& name : backend_names)
+    {
+        auto iter = resolved.find(name);
+        if (iter == resolved.end())
+            continue;
+        // two names for one server are still one backend
+        if (std::any_of(next->begin(), next->end(), [&](const auto& backend) { return backend->endpoint == iter->second; }))
+            continue;
+        auto backend = std::find_if(current->begin(), current->end(), [&](const auto& backend) { return backend->endpoint == iter->second; });
+        if (backend != current->end())
+        {
+            next->push_back(*backend);
+            continue;
+        }
+        next->push_back(std::make_shared<BackendServer>(iter->second));
+        log("[ServerManager] ", "add server ip ", iter->second);
     }
+    for (const auto& backend : *current)
+    {
+        if (std::find(next->begin(), next->end(), backend) != next->end())
+            continue;
+        backend->draining = true;
+        log("[ServerManager] ", "remove server ip ", backend->endpoint, " (", backend->sessions.load(), " sessions to migrate)");
+    }
+    dest_servers_backends.store(std::move(next));
 }
 
-asio::ip::udp::endpoint GetRandomServer(asio::io_context &ioc)
+// nullable
+inline std::shared_ptr<BackendServer> FindBackendServer(const asio::ip::udp::endpoint& endpoint)
+{
+    for (const auto& backend : *BackendServers())
+        if (backend->endpoint == endpoint)
+            return backend;
+    return nullptr;
+}
+
+// a literal address:port as the admin commands take it, nullopt without a port or for a hostname
+inline std::optional<asio::ip::udp::endpoint> ParseBackendEndpoint(std::string_view text)
+{
+    const auto hp = ParseHostPortView(text);
+    if (!hp || hp->port.empty())
+        return std::nullopt;
+    asio::error_code ec;
+    const auto address = asio::ip::make_address(hp->host, ec);
+    if (ec)
+        return std::nullopt;
+    return asio::ip::udp::endpoint(NormalizeAddress(address), static_cast<unsigned short>(std::stoi(std::string(hp->port))));
+}
+
+// returns false if there is no such backend
+inline bool DrainBackend(const asio::ip::udp::endpoint& endpoint, bool drain = true)
+{
+    auto backend = FindBackendServer(endpoint);
+    if (!backend)
+        return false;
+    backend->draining = drain;
+    log("[ServerManager] ", drain ? "drain " : "undrain ", endpoint);
+    return true;
+}
+
+// nullable
+// Fill-aware least-connections: pack players into the fullest server still below the target occupancy,
+// otherwise fall back to the least occupied one. Full servers are skipped unless every server is full,
+// draining ones unless every server is draining.
+inline std::shared_ptr<BackendServer> SelectBackendServer()
 {
     static std::size_t srv_id = 0;
-    srv_id = (srv_id + 1) % dest_servers_endpoints.size();
-    return dest_servers_endpoints[srv_id];
-}
\ No newline at end of file
+    const auto backends = BackendServers();
+    const std::size_t size = backends->size();
+    if (!size)
+        return nullptr;
+    srv_id = (srv_id + 1) % size;
+
+    std::shared_ptr<BackendServer> filling, emptiest, emptiest_full, emptiest_draining;
+    double filling_occupancy = -1, emptiest_occupancy = 0, emptiest_full_occupancy = 0, emptiest_draining_occupancy = 0;
+    for (std::size_t i = 0; i < size; ++i)
+    {
+        // walk from the round-robin cursor so that ties are spread across servers
+        const auto& backend = (*backends)[(srv_id + i) % size];
+        const double occupancy = backend->Occupancy();
+        if (backend->draining)
+        {
+            if (!emptiest_draining || occupancy < emptiest_draining_occupancy)
+                emptiest_draining = backend, emptiest_draining_occupancy = occupancy;
+            continue;
+        }
+        if (backend->IsFull())
+        {
+            if (!emptiest_full || occupancy < emptiest_full_occupancy)
+                emptiest_full = backend, emptiest_full_occupancy = occupancy;
+            continue;
+        }
+        if (occupancy < backend_target_occupancy && occupancy > filling_occupancy)
+            filling = backend, filling_occupancy = occupancy;
+        if (!emptiest || occupancy < emptiest_occupancy)
+            emptiest = backend, emptiest_occupancy = occupancy;
+    }
+    if (filling)
+        return filling;
+    if (emptiest)
+        return emptiest;
+    // everything is full, let srcds tell the player so
+    if (emptiest_full)
+        return emptiest_full;
+    return emptiest_draining;
+}
@@ -0,0 +1,168 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <algorithm>
+#include <utility>
+#include <asio.hpp>
+#include <asio/awaitable.hpp>
+
+#ifdef __linux__
+#include <sys/socket.h>
+#include <netinet/in.h>
+#endif
+
+#include "log.hpp"
+#include "EndpointKey.h"
+
+// pump period right after traffic, and the one it backs off to while idle
+inline std::chrono::milliseconds steam_pump_min_interval{ 10 };
+inline std::chrono::milliseconds steam_pump_max_interval{ 250 };
+
+// Drives a SteamGameServer-like object on one listen socket: runs callbacks and drains outgoing packets on a single
+// timer that tightens to steam_pump_min_interval after traffic (or Poke()) and backs off to steam_pump_max_interval while idle.
+// GameServer only needs int GetNextOutgoingPacket(void*, int, uint32*, uint16*), so a stub can stand in for Steam.
+template<class GameServer>
+class SteamPump
+{
+public:
+    static constexpr std::chrono::seconds stats_interval{ 60 };
+    static constexpr std::size_t batch_size = 32;
+    static constexpr std::size_t max_packet_size = 2048;
+
+    struct Stats
+    {
+        std::uint64_t wakeups = 0;
+        std::uint64_t packets = 0;
+        std::uint64_t bytes = 0;
+        std::uint64_t batches = 0;
+    };
+
+    SteamPump(asio::io_context& ioc, asio::ip::udp::socket& socket) :
+        socket(socket),
+        protocol(socket.local_endpoint().protocol()),
+        timer(ioc)
+    {}
+
+    // incoming Steam traffic was handed to the server, answers are likely: run now and stay fast for a while
+    void Poke()
+    {
+        poked = true;
+        timer.cancel();
+    }
+
+    const Stats& GetStats() const { return stats; }
+
+    asio::awaitable<void> Run(GameServer& server, std::function<void()> run_callbacks)
+    {
+        auto interval = std::chrono::duration_cast<std::chrono::steady_clock::duration>(steam_pump_min_interval);
+        auto next_stats = std::chrono::steady_clock::now() + stats_interval;
+        Stats reported;
+        while (true)
+        {
+            if (!poked)
+            {
+                timer.expires_after(interval);
+                asio::error_code ec;
+                co_await timer.async_wait(asio::redirect_error(asio::use_awaitable, ec)); // cancelled by Poke()
+            }
+            const bool was_poked = std::exchange(poked, false);
+            ++stats.wakeups;
+
+            run_callbacks();
+            const std::size_t sent = co_await Flush(server);
+
+            if (sent || was_poked)
+                interval = steam_pump_min_interval;
+            else
+                interval = std::min<std::chrono::steady_clock::duration>(interval * 2, steam_pump_max_interval);
+
+            if (const auto now = std::chrono::steady_clock::now(); now >= next_stats)
+            {
+                log("[Steam] ", socket.local_endpoint(), " sent ", stats.packets - reported.packets, " packets (",
+                    stats.bytes - reported.bytes, " bytes) in ", stats.batches - reported.batches, " batches, ",
+                    stats.wakeups - reported.wakeups, " wakeups in the last ", stats_interval.count(), "s");
+                reported = stats;
+                next_stats = now + stats_interval;
+            }
+        }
+    }
+
+private:
+    struct Packet
+    {
+        std::array<char, max_packet_size> data;
+        int size;
+        asio::ip::udp::endpoint endpoint;
+    };
+
+    asio::awaitable<std::size_t> Flush(GameServer& server)
+    {
+        std::size_t total = 0;
+        while (true)
+        {
+            std::size_t count = 0;
+            for (; count < batch_size; ++count)
+            {
+                Packet& packet = batch[count];
+                std::uint32_t ip = 0;
+                std::uint16_t port = 0;
+                packet.size = server.GetNextOutgoingPacket(packet.data.data(), static_cast<int>(packet.data.size()), &ip, &port);
+                if (packet.size <= 0)
+                    break;
+                packet.endpoint = EndpointFor(protocol, asio::ip::udp::endpoint(asio::ip::address_v4(ip), port));
+            }
+            if (!count)
+                co_return total;
+
+            co_await Send(count);
+            total += count;
+            if (count < batch_size)
+                co_return total;
+        }
+    }
+
+    asio::awaitable<void> Send(std::size_t count)
+    {
+        ++stats.batches;
+        std::size_t sent = 0;
+#ifdef __linux__
+        // one syscall for the whole batch, whatever doesn't fit right now goes the asio way below
+        std::array<mmsghdr, batch_size> msgs{};
+        std::array<iovec, batch_size> iovs{};
+        for (std::size_t i = 0; i < count; ++i)
+        {
+            iovs[i].iov_base = batch[i].data.data();
+            iovs[i].iov_len = batch[i].size;
+            msgs[i].msg_hdr.msg_name = batch[i].endpoint.data();
+            msgs[i].msg_hdr.msg_namelen = static_cast<socklen_t>(batch[i].endpoint.size());
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        if (int n = ::sendmmsg(socket.native_handle(), msgs.data(), static_cast<unsigned>(count), MSG_DONTWAIT); n > 0)
+        {
+            sent = n;
+            for (std::size_t i = 0; i < sent; ++i)
+                stats.bytes += batch[i].size;
+        }
+#endif
+        for (; sent < count; ++sent)
+        {
+            asio::error_code ec;
+            co_await socket.async_send_to(asio::const_buffer(batch[sent].data.data(), batch[sent].size), batch[sent].endpoint,
+                asio::redirect_error(asio::use_awaitable, ec));
+            if (!ec)
+                stats.bytes += batch[sent].size;
+        }
+        stats.packets += count;
+    }
+
+    asio::ip::udp::socket& socket;
+    const asio::ip::udp protocol;
+    asio::steady_timer timer;
+    bool poked = false;
+    Stats stats;
+    std::array<Packet, batch_size> batch;
+};
@@ -1,26 +1,372 @@
 #include <iostream>
+#include <map>
+#include <cstring>
+#include <algorithm>
+#include <bit>
+#include <span>
+#include <climits>
 
 #include "TSourceEngineQuery.h"
 
 #include "parsemsg.h"
+#include "A2SSchema.h"
 #include "net_buffer.h"
+#include "EndpointKey.h"
+#include "log.hpp"
 
 using namespace std::chrono_literals;
 using asio::ip::udp;
 
-TSourceEngineQuery::TSourceEngineQuery(asio::io_context &ioc) : ioc(ioc)
+struct TSourceEngineQuery::Engine : std::enable_shared_from_this<Engine>
 {
+    enum class QueryType_e
+    {
+        ServerInfo,
+        ServerFill, // A2S_INFO too, but decoded in place instead of keeping the replies
+        PlayerList,
+        Rules,
+    };
+
+    // the A2S_INFO request formats, as a mask
+    enum InfoProbe_e : uint8_t
+    {
+        ProbeTSource = 1, // "TSource Engine Query", answered with 'I'
+        ProbeDetails = 2, // "details", answered with 'm'
+        ProbeInfo = 4, // "info"
+        ProbeAll = ProbeTSource | ProbeDetails | ProbeInfo,
+    };
+
+    // which formats a server answered; complete once a full A2S_INFO round ran to its deadline
+    struct InfoFormats
+    {
+        uint8_t answered = 0;
+        bool complete = false;
+    };
+
+    struct PendingQuery
+    {
+        PendingQuery(asio::io_context& ioc, udp::endpoint endpoint, QueryType_e type) :
+            endpoint(endpoint), type(type), done(ioc, std::chrono::steady_clock::time_point::max()) {}
+
+        const udp::endpoint endpoint;
+        const QueryType_e type;
+        asio::steady_timer done; // never expires, cancelled to wake up the waiters
+        std::vector<std::string> replies;
+        std::optional<ServerFillResult> fill;
+        std::size_t expected_replies = 0; // 0 = collect until the deadline
+        uint8_t probes = ProbeAll; // A2S_INFO formats requested
+        uint8_t answered = 0; // and those that replied
+        int challenges = 0;
+        bool finished = false;
+    };
+
+    using query_key_t = std::pair<udp::endpoint, QueryType_e>;
+
+    // a split reply in reassembly, keyed by sender and split packet ID
+    struct SplitReply
+    {
+        std::chrono::steady_clock::time_point started;
+        std::vector<std::string> fragments;
+    };
+    using split_key_t = std::pair<udp::endpoint, int32_t>;
+    static constexpr std::size_t max_splits_per_server = 4;
+    static constexpr std::size_t max_fragments = 32;
+    static constexpr auto split_timeout = 5s;
+
+    asio::io_context& ioc;
+    udp::socket socket;
+    const udp protocol;
+    asio::steady_timer expire_timer;
+    std::map<query_key_t, std::shared_ptr<PendingQuery>> pending;
+    std::multimap<std::chrono::steady_clock::time_point, std::weak_ptr<PendingQuery>> deadlines;
+    std::map<split_key_t, SplitReply> splits;
+    std::map<udp::endpoint, InfoFormats> info_formats;
+    char buffer[4096];
+
+    explicit Engine(asio::io_context& ioc) :
+        ioc(ioc),
+        socket(OpenDualStackSocket(ioc, 0)),
+        protocol(socket.local_endpoint().protocol()),
+        expire_timer(ioc, std::chrono::steady_clock::time_point::max())
+    {}
+
+    void Start()
+    {
+        asio::co_spawn(ioc, CoReceive(shared_from_this()), asio::detached);
+        asio::co_spawn(ioc, CoExpire(shared_from_this()), asio::detached);
+    }
+
+    void Stop()
+    {
+        asio::error_code ec;
+        socket.close(ec);
+        expire_timer.cancel();
+        for (auto& [key, query] : pending)
+            query->done.cancel();
+        pending.clear();
+        splits.clear();
+    }
+
+    void Send(const udp::endpoint& endpoint, const void* data, std::size_t len)
+    {
+        // fire and forget, a lost request is reported as a timeout anyway
+        asio::error_code ec;
+        socket.send_to(asio::buffer(data, len), EndpointFor(protocol, endpoint), 0, ec);
+        if (ec)
+            log("[TSourceEngineQuery] Send to ", endpoint, " failed: ", ec.message());
+    }
+
+    void SendRequest(const PendingQuery& query, int32_t challenge)
+    {
+        char accessor[4];
+        std::memcpy(accessor, &challenge, sizeof(accessor));
+        if (query.type == QueryType_e::ServerInfo || query.type == QueryType_e::ServerFill)
+        {
+            if (challenge == -1)
+            {
+                static constexpr char request1[] = "\xFF\xFF\xFF\xFF" "TSource Engine Query"; // Source / GoldSrc Steam
+                static constexpr char request2[] = "\xFF\xFF\xFF\xFF" "details"; // GoldSrc WON
+                static constexpr char request3[] = "\xFF\xFF\xFF\xFF" "info"; // Xash3D
+                if (query.probes & ProbeTSource)
+                    Send(query.endpoint, request1, sizeof(request1));
+                if (query.probes & ProbeDetails)
+                    Send(query.endpoint, request2, sizeof(request2));
+                if (query.probes & ProbeInfo)
+                    Send(query.endpoint, request3, sizeof(request3));
+            }
+            else
+            {
+                // newer Source servers challenge A2S_INFO as well
+                char request[29] = "\xFF\xFF\xFF\xFF" "TSource Engine Query";
+                std::memcpy(request + 25, accessor, sizeof(accessor));
+                Send(query.endpoint, request, sizeof(request));
+            }
+        }
+        else
+        {
+            const char type = query.type == QueryType_e::PlayerList ? 'U' : 'V';
+            const char request[10] = { '\xFF', '\xFF', '\xFF', '\xFF', type, accessor[0], accessor[1], accessor[2], accessor[3], '\0' };
+            Send(query.endpoint, request, sizeof(request));
+        }
+    }
+
+    void Finish(const std::shared_ptr<PendingQuery>& query)
+    {
+        if (std::exchange(query->finished, true))
+            return;
+        if (auto iter = pending.find({ query->endpoint, query->type }); iter != pending.end() && iter->second == query)
+            pending.erase(iter);
+        query->done.cancel();
+    }
+
+    // the formats worth sending: all of them until the server answered, then only those it answers
+    uint8_t InfoProbesFor(const udp::endpoint& endpoint, QueryType_e type) const
+    {
+        auto iter = info_formats.find(endpoint);
+        if (iter == info_formats.end() || !iter->second.answered)
+            return ProbeAll;
+        const InfoFormats& formats = iter->second;
+        if (type == QueryType_e::ServerFill)
+            return formats.answered & ProbeTSource ? ProbeTSource : ProbeDetails; // any one reply will do
+        return formats.complete ? formats.answered : static_cast<uint8_t>(ProbeAll);
+    }
+
+    void Expire(const std::shared_ptr<PendingQuery>& query)
+    {
+        if (!query->finished && query->type == QueryType_e::ServerInfo)
+        {
+            if (query->probes == ProbeAll && query->answered)
+                info_formats[query->endpoint] = { query->answered, true }; // the next round finishes without waiting out the timeout
+            else if (query->probes != ProbeAll)
+                info_formats.erase(query->endpoint); // a known format went quiet, probe everything again
+        }
+        else if (!query->finished && query->type == QueryType_e::ServerFill && query->probes != ProbeAll)
+            info_formats.erase(query->endpoint);
+        Finish(query);
+    }
+
+    void Dispatch(const udp::endpoint& sender, const char* reply, std::size_t reply_length)
+    {
+        if (reply_length < 5)
+            return;
+
+        const char type = reply[4];
+        if (type == 'A' && reply_length >= 9)
+        {
+            int32_t challenge;
+            std::memcpy(&challenge, reply + 5, sizeof(challenge));
+            // challenges are issued per address, so it applies to everything we are waiting on from that server
+            for (auto query_type : { QueryType_e::ServerInfo, QueryType_e::ServerFill, QueryType_e::PlayerList, QueryType_e::Rules })
+            {
+                if (auto iter = pending.find({ sender, query_type }); iter != pending.end() && iter->second->challenges++ < 2)
+                    SendRequest(*iter->second, challenge);
+            }
+        }
+        else if (type == 'I' || type == 'm')
+        {
+            // validate in place first, malformed replies are dropped before anything is copied
+            const auto view = MakeServerInfoQueryViewFromBuffer(reply, reply_length);
+            if (!view)
+                return;
+            const uint8_t probe = type == 'I' ? ProbeTSource : ProbeDetails;
+            if (auto iter = pending.find({ sender, QueryType_e::ServerFill }); iter != pending.end())
+            {
+                auto query = iter->second;
+                query->fill = ServerFillResult{ view->PlayerCount, view->MaxPlayers, view->BotCount };
+                info_formats[sender].answered |= probe;
+                Finish(query);
+            }
+            if (auto iter = pending.find({ sender, QueryType_e::ServerInfo }); iter != pending.end())
+            {
+                auto query = iter->second;
+                query->answered |= probe;
+                query->replies.emplace_back(reply, reply_length);
+                if (query->expected_replies && query->replies.size() >= query->expected_replies)
+                    Finish(query);
+            }
+        }
+        else if (type == 'D' || type == 'E')
+        {
+            if (auto iter = pending.find({ sender, type == 'D' ? QueryType_e::PlayerList : QueryType_e::Rules }); iter != pending.end())
+            {
+                auto query = iter->second;
+                query->replies.emplace_back(reply, reply_length);
+                Finish(query);
+            }
+        }
+    }
+
+    void DispatchFragment(const udp::endpoint& sender, const char* reply, std::size_t reply_length)
+    {
+        if (reply_length < 10)
+            return;
+
+        // only from servers we are waiting on; the type byte is only known once reassembled, Dispatch matches it to the query
+        if (auto iter = pending.lower_bound({ sender, QueryType_e{} }); iter == pending.end() || iter->first.first != sender)
+            return;
+
+        const auto now = std::chrono::steady_clock::now();
+        std::erase_if(splits, [&](const auto& item) { return now - item.second.started > split_timeout; });
+
+        int32_t id;
+        std::memcpy(&id, reply + 4, sizeof(id));
+        const split_key_t key{ sender, id };
+        auto iter = splits.find(key);
+        if (iter == splits.end())
+        {
+            std::size_t in_progress = 0;
+            for (auto other = splits.lower_bound({ sender, INT32_MIN }); other != splits.end() && other->first.first == sender; ++other)
+                ++in_progress;
+            if (in_progress >= max_splits_per_server)
+                return;
+            iter = splits.emplace(key, SplitReply{ now, {} }).first;
+        }
+        auto& fragments = iter->second.fragments;
+        if (fragments.size() >= max_fragments)
+            return;
+        fragments.emplace_back(reply, reply_length);
+
+        if (auto payload = ReassembleSplitPacket(fragments))
+        {
+            splits.erase(iter);
+            Dispatch(sender, payload->data(), payload->size());
+        }
+    }
+
+    static asio::awaitable<void> CoReceive(std::shared_ptr<Engine> self)
+    {
+        while (self->socket.is_open())
+        {
+            try
+            {
+                udp::endpoint sender_endpoint;
+                std::size_t reply_length = co_await self->socket.async_receive_from(asio::buffer(self->buffer), sender_endpoint, asio::use_awaitable);
+                sender_endpoint = NormalizeEndpoint(sender_endpoint); // pending queries are keyed on the plain v4 form
+                if (reply_length >= 4 && !std::memcmp(self->buffer, "\xFF\xFF\xFF\xFF", 4))
+                    self->Dispatch(sender_endpoint, self->buffer, reply_length);
+                else if (reply_length >= 4 && !std::memcmp(self->buffer, "\xFE\xFF\xFF\xFF", 4))
+                    self->DispatchFragment(sender_endpoint, self->buffer, reply_length);
+            }
+            catch (const asio::system_error& e)
+            {
+                if (e.code() == asio::error::operation_aborted)
+                    co_return;
+                // connection_reset and friends from ICMP port unreachable, the query simply times out
+                continue;
+            }
+        }
+    }
+
+    static asio::awaitable<void> CoExpire(std::shared_ptr<Engine> self)
+    {
+        while (self->socket.is_open())
+        {
+            asio::error_code ec;
+            co_await self->expire_timer.async_wait(asio::redirect_error(asio::use_awaitable, ec));
+            // rescheduled to an earlier deadline or really expired, either way sweep and rearm
+
+            const auto now = std::chrono::steady_clock::now();
+            while (!self->deadlines.empty() && self->deadlines.begin()->first <= now)
+            {
+                if (auto query = self->deadlines.begin()->second.lock())
+                    self->Expire(query);
+                self->deadlines.erase(self->deadlines.begin());
+            }
+            self->expire_timer.expires_at(self->deadlines.empty() ? std::chrono::steady_clock::time_point::max() : self->deadlines.begin()->first);
+        }
+    }
 
+    asio::awaitable<std::shared_ptr<PendingQuery>> QueryAsync(udp::endpoint endpoint, QueryType_e type, std::chrono::steady_clock::duration timeout)
+    {
+        endpoint = NormalizeEndpoint(endpoint);
+        auto self = shared_from_this();
+        std::shared_ptr<PendingQuery> query;
+        if (auto iter = pending.find({ endpoint, type }); iter != pending.end())
+        {
+            // the same request is already in flight, just wait for its answer
+            query = iter->second;
+        }
+        else
+        {
+            query = std::make_shared<PendingQuery>(ioc, endpoint, type);
+            if (type == QueryType_e::ServerInfo || type == QueryType_e::ServerFill)
+            {
+                query->probes = InfoProbesFor(endpoint, type);
+                if (type == QueryType_e::ServerInfo && query->probes != ProbeAll)
+                    query->expected_replies = std::popcount(query->probes);
+            }
+            pending.emplace(query_key_t{ endpoint, type }, query);
+
+            const auto deadline = std::chrono::steady_clock::now() + timeout;
+            deadlines.emplace(deadline, query);
+            if (deadline < expire_timer.expiry())
+                expire_timer.expires_at(deadline);
+
+            SendRequest(*query, -1);
+        }
+
+        if (!query->finished)
+        {
+            asio::error_code ec;
+            co_await query->done.async_wait(asio::redirect_error(asio::use_awaitable, ec));
+        }
+        co_return query;
+    }
+};
+
+TSourceEngineQuery::TSourceEngineQuery(asio::io_context &ioc) : engine(std::make_shared<Engine>(ioc))
+{
+    engine->Start();
 }
 
 TSourceEngineQuery::~TSourceEngineQuery()
 {
-
+    engine->Stop();
 }
 
-std::string UTF8_To_ANSI(const std::string &str)
+std::string UTF8_To_ANSI(std::string_view str)
 {
-    return str;
+    return std::string(str);
 }
 
 std::string ANSI_To_UTF8(const std::string& str)
@@ -28,77 +374,145 @@ std::string ANSI_To_UTF8(const std::string& str)
     return str;
 }
 
+namespace {
+    using Info = TSourceEngineQuery::ServerInfoQueryResult;
+    using PlayerList = TSourceEngineQuery::PlayerListQueryResult;
+    using Player = PlayerList::PlayerInfo_s;
+    using namespace A2SSchema;
+
+    // T is ServerInfoQueryResult or ServerInfoQueryView, which share their member names
+    template<class T>
+    using ServerInfoSchemaOf = Message<
+        Header<&T::header1>,
+        Tagged<&T::header2,
+            // Steam
+            Case<'I',
+                Byte<&T::Protocol>,
+                String<&T::ServerName>,
+                String<&T::Map>,
+                String<&T::Folder>,
+                String<&T::Game>,
+                Short<&T::SteamID>,
+                Byte<&T::PlayerCount>,
+                Byte<&T::MaxPlayers>,
+                Byte<&T::BotCount>,
+                Byte<&T::ServerType>,
+                Byte<&T::Environment>,
+                Byte<&T::Visibility>,
+                Byte<&T::VAC>,
+                String<&T::GameVersion>,
+                FlagByte<&T::EDF,
+                    Flag<0x80, Short<&T::Port>>,
+                    Flag<0x10, Longs<&T::SteamIDExtended>>,
+                    Flag<0x40, Sub<&T::SourceTVData,
+                        Short<&T::SourceTVData_s::SourceTVPort>,
+                        String<&T::SourceTVData_s::SourceTVName>>>,
+                    Flag<0x20, String<&T::Keywords>>,
+                    Flag<0x01, Longs<&T::GameID>>>>,
+            // Non-Steam
+            Case<'m',
+                String<&T::LocalAddress>,
+                String<&T::ServerName>,
+                String<&T::Map>,
+                String<&T::Folder>,
+                String<&T::Game>,
+                Byte<&T::PlayerCount>,
+                Byte<&T::MaxPlayers>,
+                Byte<&T::Protocol>,
+                Byte<&T::ServerType>,
+                Byte<&T::Environment>,
+                Byte<&T::Visibility>,
+                Switch<&T::Mod, Sub<&T::ModData,
+                    String<&T::ModData_s::Link>,
+                    String<&T::ModData_s::DownloadLink>,
+                    Byte<&T::ModData_s::NULL_>,
+                    Long<&T::ModData_s::Version>,
+                    Long<&T::ModData_s::Size>,
+                    Byte<&T::ModData_s::Type>,
+                    Byte<&T::ModData_s::DLL>>>,
+                Byte<&T::VAC>,
+                Byte<&T::BotCount>>>>;
+    using ServerInfoSchema = ServerInfoSchemaOf<Info>;
+
+    constexpr std::size_t max_player_list = 255; // the count is a single byte
+
+    using PlayerInfoSchema = Message<
+        Byte<&Player::Index>,
+        String<&Player::Name>,
+        Long<&Player::Score>,
+        Float<&Player::Duration>>;
+    static_assert(PlayerInfoSchema::min_size == 10);
+
+    // the body of A2S_PLAYER is a challenge or a count byte followed by PlayerInfoSchema entries
+    using PlayerListHeaderSchema = Message<
+        Header<&PlayerList::header1>,
+        Byte<&PlayerList::header2>>;
+}
+
 auto TSourceEngineQuery::MakeServerInfoQueryResultFromBuffer(const char *reply, std::size_t reply_length) -> ServerInfoQueryResult
 {
     BufferReader buf(reply, reply_length);
     ServerInfoQueryResult result{};
     result.GenerateTime = std::chrono::steady_clock::now();
-    result.header1 = buf.ReadLong(); // header -1
-    result.header2 = buf.ReadByte(); // header ('I')
+    A2SSchema::Decode<ServerInfoSchema>(result, buf);
+    return result;
+}
+
+auto TSourceEngineQuery::MakeServerInfoQueryViewFromBuffer(const char* reply, std::size_t reply_length) -> std::optional<ServerInfoQueryView>
+{
+    // checked up front so that garbage is dropped without Decode throwing
+    if (reply_length < 5 || std::memcmp(reply, "\xFF\xFF\xFF\xFF", 4) || (reply[4] != 'I' && reply[4] != 'm'))
+        return std::nullopt;
+
+    BufferReader buf(reply, reply_length);
+    ServerInfoQueryView view{};
+    ServerInfoSchemaOf<ServerInfoQueryView>::Decode(view, buf);
+    if (buf.Bad())
+        return std::nullopt;
+    return view;
+}
+
+std::size_t TSourceEngineQuery::ServerInfoQueryResultSize(const ServerInfoQueryResult& result)
+{
+    return A2SSchema::Size<ServerInfoSchema>(result);
+}
+
+std::size_t TSourceEngineQuery::WriteServerInfoQueryResultToBuffer(const ServerInfoQueryResult& result, char* buffer, std::size_t max_len)
+{
+    if (ServerInfoQueryResultSize(result) > max_len)
+        throw std::length_error("server info does not fit into the buffer");
+    return A2SSchema::Encode<ServerInfoSchema>(result, buffer) - buffer;
+}
+
+auto TSourceEngineQuery::MakePlayerListQueryResultFromBuffer(const char *reply, std::size_t reply_length) -> PlayerListQueryResult
+{
+    PlayerListQueryResult result;
+    BufferReader buf(reply, reply_length);
+    result.GenerateTime = std::chrono::steady_clock::now();
+    result.header1 = buf.ReadLong();
 
     if (result.header1 != -1)
         throw std::invalid_argument("unsupported protocol format");
 
-    if (result.header2 == 'I')
-    {
-        // Steam版
-        result.Protocol = buf.ReadByte();
-        result.ServerName = UTF8_To_ANSI(buf.ReadString());
-        result.Map = UTF8_To_ANSI(buf.ReadString());
-        result.Folder = UTF8_To_ANSI(buf.ReadString());
-        result.Game = UTF8_To_ANSI(buf.ReadString());
-        result.SteamID = buf.ReadShort();
-        result.PlayerCount = buf.ReadByte();
-        result.MaxPlayers = buf.ReadByte();
-        result.BotCount = buf.ReadByte();
-        result.ServerType = static_cast<ServerType_e>(buf.ReadByte());
-        result.Environment = static_cast<Environment_e>(buf.ReadByte());
-        result.Visibility = static_cast<Visibility_e>(buf.ReadByte());
-        result.VAC = buf.ReadByte();
-        result.GameVersion = UTF8_To_ANSI(buf.ReadString());
-
-        int EDF = buf.ReadByte();
-        if (EDF & 0x80)
-            result.Port = buf.ReadShort();
-        if (EDF & 0x10)
-            result.SteamIDExtended = { buf.ReadLong(), buf.ReadLong() };
-        if (EDF & 0x40)
-            result.SourceTVData = { buf.ReadShort(), UTF8_To_ANSI(buf.ReadString()) };
-        if (EDF & 0x20)
-            result.Keywords = UTF8_To_ANSI(buf.ReadString());
-        if (EDF & 0x01)
-            result.GameID = { buf.ReadLong(), buf.ReadLong() };
+    result.header2 = buf.ReadByte();
+    if (result.header2 == 'A')
+    {
+        result.Results.emplace<0>(buf.ReadLong());
     }
-    else if (result.header2 == 'm')
-    {
-        // 非Steam版
-        result.LocalAddress = UTF8_To_ANSI(buf.ReadString());
-        result.ServerName = UTF8_To_ANSI(buf.ReadString());
-        result.Map = UTF8_To_ANSI(buf.ReadString());
-        result.Folder = UTF8_To_ANSI(buf.ReadString());
-        result.Game = UTF8_To_ANSI(buf.ReadString());
-        result.PlayerCount = buf.ReadByte();
-        result.MaxPlayers = buf.ReadByte();
-        result.Protocol = buf.ReadByte();
-        result.ServerType = static_cast<ServerType_e>(buf.ReadByte());
-        result.Environment = static_cast<Environment_e>(buf.ReadByte());
-        result.Visibility = static_cast<Visibility_e>(buf.ReadByte());
-
-        if ((result.Mod = buf.ReadByte()) == true)
+    else if (result.header2 == 'D')
+    {
+        volatile auto Players = buf.ReadByte();
+        std::vector<PlayerListQueryResult::PlayerInfo_s> infos;
+        while (!buf.Eof())
         {
-            result.ModData = {
-                    UTF8_To_ANSI(buf.ReadString()),
-                    UTF8_To_ANSI(buf.ReadString()),
-                    buf.ReadByte(),
-                    buf.ReadLong(),
-                    buf.ReadLong(),
-                    static_cast<ServerInfoQueryResult::ModData_s::ModType_e>(buf.ReadByte()),
-                    static_cast<bool>(buf.ReadByte())
-            };
+            PlayerListQueryResult::PlayerInfo_s info;
+            PlayerInfoSchema::Decode(info, buf);
+            // drop a partial trailing entry instead of filling it with -1
+            if (buf.Bad())
+                break;
+            infos.push_back(std::move(info));
         }
-
-        result.VAC = buf.ReadByte();
-        result.BotCount = buf.ReadByte();
+        result.Results.emplace<1>(std::move(infos));
     }
     else
     {
@@ -107,89 +521,123 @@ auto TSourceEngineQuery::MakeServerInfoQueryResultFromBuffer(const char *reply,
     return result;
 }
 
-std::size_t TSourceEngineQuery::WriteServerInfoQueryResultToBuffer(const ServerInfoQueryResult& result, char* buffer, std::size_t max_len)
+auto TSourceEngineQuery::MakeServerInfoReplyTemplate(const ServerInfoQueryResult& info, const std::vector<std::string>& names, const std::vector<std::string>& maps) -> ServerInfoReplyTemplate
 {
-    sizebuf_t buf;
-    MSG_Init(&buf, "TSourceEngineQuery", buffer, max_len);
-
-    MSG_WriteLong(&buf, (result.header1)); // header -1
-    MSG_WriteByte(&buf, (result.header2)); // header ('I')
-    if (result.header2 == 'I')
-    {
-        // Steam
-        MSG_WriteByte(&buf, (result.Protocol));
-        MSG_WriteString(&buf, (ANSI_To_UTF8(result.ServerName).c_str()));
-        MSG_WriteString(&buf, (ANSI_To_UTF8(result.Map).c_str()));
-        MSG_WriteString(&buf, (ANSI_To_UTF8(result.Folder).c_str()));
-        MSG_WriteString(&buf, (ANSI_To_UTF8(result.Game).c_str()));
-        MSG_WriteShort(&buf, (result.SteamID.value_or(0)));
-        MSG_WriteByte(&buf, (result.PlayerCount));
-        MSG_WriteByte(&buf, (result.MaxPlayers));
-        MSG_WriteByte(&buf, (result.BotCount));
-        MSG_WriteByte(&buf, (static_cast<std::uint8_t>(result.ServerType)));
-        MSG_WriteByte(&buf, (static_cast<std::uint8_t>(result.Environment)));
-        MSG_WriteByte(&buf, (static_cast<std::uint8_t>(result.Visibility)));
-        MSG_WriteByte(&buf, (result.VAC));
-        MSG_WriteString(&buf, (ANSI_To_UTF8(result.GameVersion.value_or("")).c_str()));
-
-        int EDF = 0;
-        EDF |= result.Port.has_value() ? 0x80 : 0;
-        EDF |= result.SteamIDExtended.has_value() ? 0x10 : 0;
-        EDF |= result.SourceTVData.has_value() ? 0x40 : 0;
-        EDF |= result.Keywords.has_value() ? 0x20 : 0;
-        EDF |= result.GameID.has_value() ? 0x10 : 0;
-        MSG_WriteByte(&buf, (EDF));
-        if(result.Port.has_value())
-            MSG_WriteShort(&buf, (result.Port.value()));
-        if(result.SteamIDExtended.has_value())
-            (MSG_WriteLong(&buf, (result.SteamIDExtended.value()[0])), MSG_WriteLong(&buf, (result.SteamIDExtended.value()[1])));
-        if(result.SourceTVData.has_value())
-            (MSG_WriteShort(&buf, (result.SourceTVData->SourceTVPort)), MSG_WriteString(&buf, (ANSI_To_UTF8(result.SourceTVData->SourceTVName).c_str())));
-        if(result.Keywords.has_value())
-             MSG_WriteString(&buf, (result.Keywords->c_str()));
-        if(result.GameID.has_value())
-            (MSG_WriteLong(&buf, (result.GameID.value()[0])), MSG_WriteLong(&buf, (result.GameID.value()[1])));
+    struct SlotRange
+    {
+        ServerInfoReplyTemplate::Slot_e slot;
+        std::size_t offset;
+        std::size_t size;
+    };
+    std::vector<SlotRange> slots;
+
+    std::string reply(ServerInfoQueryResultSize(info), '\0');
+    // fields are reported in wire order
+    A2SSchema::Encode<ServerInfoSchema>(info, reply.data(), [&](const void* field, std::size_t offset, std::size_t size) {
+        if (field == &info.ServerName)
+            slots.push_back({ ServerInfoReplyTemplate::ServerName, offset, size });
+        else if (field == &info.Map)
+            slots.push_back({ ServerInfoReplyTemplate::Map, offset, size });
+        else if (field == &info.VAC)
+            slots.push_back({ ServerInfoReplyTemplate::VAC, offset, size });
+    });
+    if (slots.size() != 3)
+        throw std::invalid_argument("unsupported protocol format");
+
+    ServerInfoReplyTemplate result;
+    std::size_t pos = 0;
+    for (std::size_t i = 0; i < slots.size(); ++i)
+    {
+        result.Fixed[i] = reply.substr(pos, slots[i].offset - pos);
+        result.Order[i] = slots[i].slot;
+        pos = slots[i].offset + slots[i].size;
     }
-    else if (result.header2 == 'm')
-    {
-        // Non-Steam
-        MSG_WriteString(&buf, (ANSI_To_UTF8(result.LocalAddress.value()).c_str()));
-        MSG_WriteString(&buf, (ANSI_To_UTF8(result.ServerName).c_str()));
-        MSG_WriteString(&buf, (ANSI_To_UTF8(result.Map).c_str()));
-        MSG_WriteString(&buf, (ANSI_To_UTF8(result.Folder).c_str()));
-        MSG_WriteString(&buf, (ANSI_To_UTF8(result.Game).c_str()));
-        MSG_WriteByte(&buf, (result.PlayerCount));
-        MSG_WriteByte(&buf, (result.MaxPlayers));
-        MSG_WriteByte(&buf, (result.Protocol));
-        MSG_WriteByte(&buf, (static_cast<std::uint8_t>(result.ServerType)));
-        MSG_WriteByte(&buf, (static_cast<std::uint8_t>(result.Environment)));
-        MSG_WriteByte(&buf, (static_cast<std::uint8_t>(result.Visibility)));
-
-        MSG_WriteByte(&buf, (result.Mod.value_or(false)));
-        if (result.Mod)
+    result.Fixed[3] = reply.substr(pos);
+
+    auto serialize = [](const std::vector<std::string>& candidates, const std::string& fallback) {
+        std::vector<std::string> out;
+        for (const std::string& str : candidates)
+            out.emplace_back(str.c_str()).push_back('\0');
+        if (out.empty())
+            out.emplace_back(fallback.c_str()).push_back('\0');
+        return out;
+    };
+    result.ServerNames = serialize(names, info.ServerName);
+    result.Maps = serialize(maps, info.Map);
+    return result;
+}
+
+std::array<asio::const_buffer, 7> TSourceEngineQuery::ServerInfoReplyTemplate::Buffers(std::size_t name, std::size_t map, const uint8_t& vac) const
+{
+    std::array<asio::const_buffer, 7> buffers;
+    for (std::size_t i = 0; i < Order.size(); ++i)
+    {
+        buffers[i * 2] = asio::buffer(Fixed[i]);
+        switch (Order[i])
         {
-            MSG_WriteString(&buf, (ANSI_To_UTF8(result.ModData->Link).c_str()));
-            MSG_WriteString(&buf, (ANSI_To_UTF8(result.ModData->DownloadLink).c_str()));
-            MSG_WriteByte(&buf, (result.ModData->NULL_));
-            MSG_WriteLong(&buf, (result.ModData->Version));
-            MSG_WriteLong(&buf, (result.ModData->Size));
-            MSG_WriteByte(&buf, (static_cast<std::uint8_t>(result.ModData->Type)));
-            MSG_WriteByte(&buf, (static_cast<std::uint8_t>(result.ModData->DLL)));
+        case ServerName: buffers[i * 2 + 1] = asio::buffer(ServerNames[name % ServerNames.size()]); break;
+        case Map: buffers[i * 2 + 1] = asio::buffer(Maps[map % Maps.size()]); break;
+        case VAC: buffers[i * 2 + 1] = asio::buffer(&vac, 1); break;
         }
+    }
+    buffers[6] = asio::buffer(Fixed[3]);
+    return buffers;
+}
 
-        MSG_WriteByte(&buf, (result.VAC));
-        MSG_WriteByte(&buf, (result.BotCount));
+std::size_t TSourceEngineQuery::PlayerListQueryResultSize(const PlayerListQueryResult& result)
+{
+    std::size_t size = PlayerListHeaderSchema::min_size;
+    if (result.header2 == 'A')
+    {
+        size += sizeof(int32_t);
+    }
+    else if (result.header2 == 'D')
+    {
+        size += 1;
+        const auto& infos = std::get<1>(result.Results);
+        for (const PlayerListQueryResult::PlayerInfo_s& info : std::span(infos).first(std::min(infos.size(), max_player_list)))
+            size += A2SSchema::Size<PlayerInfoSchema>(info);
     }
     else
     {
         throw std::invalid_argument("unsupported protocol format");
     }
-    return MSG_GetNumBytesWritten(&buf);
+    return size;
 }
 
-auto TSourceEngineQuery::MakePlayerListQueryResultFromBuffer(const char *reply, std::size_t reply_length) -> PlayerListQueryResult
+std::size_t TSourceEngineQuery::WritePlayerListQueryResultToBuffer(const PlayerListQueryResult& result, char* buffer, std::size_t max_len)
 {
-    PlayerListQueryResult result;
+    if (PlayerListQueryResultSize(result) > max_len)
+        throw std::length_error("player list does not fit into the buffer");
+
+    char* out = A2SSchema::Encode<PlayerListHeaderSchema>(result, buffer);
+    if (result.header2 == 'A')
+    {
+        const int32_t challenge = std::get<0>(result.Results);
+        std::memcpy(out, &challenge, sizeof(challenge));
+        out += sizeof(challenge);
+    }
+    else
+    {
+        const std::vector<PlayerListQueryResult::PlayerInfo_s> &infos = std::get<1>(result.Results);
+        const std::size_t count = std::min(infos.size(), max_player_list);
+        *out++ = static_cast<char>(count);
+        for (const PlayerListQueryResult::PlayerInfo_s &info : std::span(infos).first(count))
+            out = A2SSchema::Encode<PlayerInfoSchema>(info, out);
+    }
+    return out - buffer;
+}
+
+std::vector<std::string> TSourceEngineQuery::WritePlayerListQueryResultToPackets(const PlayerListQueryResult& result, SplitPacketFormat_e format, int32_t id)
+{
+    std::string reply(PlayerListQueryResultSize(result), '\0');
+    WritePlayerListQueryResultToBuffer(result, reply.data(), reply.size());
+    return SplitPacket(reply, format, id);
+}
+
+auto TSourceEngineQuery::MakeRulesQueryResultFromBuffer(const char* reply, std::size_t reply_length) -> RulesQueryResult
+{
+    RulesQueryResult result;
     BufferReader buf(reply, reply_length);
     result.GenerateTime = std::chrono::steady_clock::now();
     result.header1 = buf.ReadLong();
@@ -202,19 +650,25 @@ auto TSourceEngineQuery::MakePlayerListQueryResultFromBuffer(const char *reply,
     {
         result.Results.emplace<0>(buf.ReadLong());
     }
-    else if (result.header2 == 'D')
+    else if (result.header2 == 'E' && reply_length >= 7)
     {
-        volatile auto Players = buf.ReadByte();
-        std::vector<PlayerListQueryResult::PlayerInfo_s> infos;
-        while (!buf.Eof())
+        const auto count = static_cast<std::uint16_t>(buf.ReadShort());
+        // keep the name/value pairs exactly as they are on the wire, cut after the last complete pair
+        const std::string_view strings(reply + 7, reply_length - 7);
+        std::size_t end = 0;
+        std::uint16_t complete = 0;
+        while (complete < count)
         {
-            auto Index = buf.ReadByte();
-            auto Name = UTF8_To_ANSI(buf.ReadString());
-            auto Score = buf.ReadLong();
-            float Duration = buf.ReadFloat();
-            infos.push_back({ Index, std::move(Name), Score, Duration });
+            const auto name_end = strings.find('\0', end);
+            if (name_end == std::string_view::npos)
+                break;
+            const auto value_end = strings.find('\0', name_end + 1);
+            if (value_end == std::string_view::npos)
+                break;
+            end = value_end + 1;
+            ++complete;
         }
-        result.Results.emplace<1>(std::move(infos));
+        result.Results.emplace<1>(RulesQueryResult::RuleTable_s{ complete, std::string(strings.substr(0, end)) });
     }
     else
     {
@@ -223,112 +677,161 @@ auto TSourceEngineQuery::MakePlayerListQueryResultFromBuffer(const char *reply,
     return result;
 }
 
-std::size_t TSourceEngineQuery::WritePlayerListQueryResultToBuffer(const PlayerListQueryResult& result, char* buffer, std::size_t max_len)
+std::vector<std::string> TSourceEngineQuery::WriteRulesQueryResultToPackets(const RulesQueryResult& result, SplitPacketFormat_e format, int32_t id)
 {
-    sizebuf_t buf;
-    MSG_Init(&buf, "TSourceEngineQuery", buffer, max_len);
-	
-    MSG_WriteLong(&buf, (result.header1));
-    MSG_WriteLong(&buf, (result.header2));
+    std::string reply = "\xFF\xFF\xFF\xFF";
+    reply.push_back(static_cast<char>(result.header2));
     if (result.header2 == 'A')
     {
-        MSG_WriteLong(&buf, (std::get<0>(result.Results)));
+        const int32_t challenge = std::get<0>(result.Results);
+        reply.append(reinterpret_cast<const char*>(&challenge), sizeof(challenge));
     }
-    else if (result.header2 == 'D')
+    else if (result.header2 == 'E')
     {
-        const std::vector<PlayerListQueryResult::PlayerInfo_s> &infos = std::get<1>(result.Results);
-    	for(const PlayerListQueryResult::PlayerInfo_s &info : infos)
-    	{
-            MSG_WriteByte(&buf, (info.Index));
-            MSG_WriteString(&buf, (ANSI_To_UTF8(info.Name).c_str()));
-            MSG_WriteLong(&buf, (info.Score));
-            MSG_WriteFloat(&buf, info.Duration);
-    	}
+        const RulesQueryResult::RuleTable_s& table = std::get<1>(result.Results);
+        reply.push_back(static_cast<char>(table.Count & 0xFF));
+        reply.push_back(static_cast<char>(table.Count >> 8));
+        reply.append(table.Strings);
     }
     else
     {
         throw std::invalid_argument("unsupported protocol format");
     }
-    return MSG_GetNumBytesWritten(&buf);
+    return SplitPacket(reply, format, id);
+}
+
+std::vector<std::string> TSourceEngineQuery::SplitPacket(std::string_view reply, SplitPacketFormat_e format, int32_t id, std::size_t max_packet_size)
+{
+    if (reply.size() <= max_packet_size)
+        return { std::string(reply) };
+
+    const std::size_t header_len = format == SplitPacketFormat_e::GoldSrc ? 9 : 12;
+    const std::size_t max_total = format == SplitPacketFormat_e::GoldSrc ? 15 : 255;
+    const std::size_t chunk = max_packet_size - header_len;
+    const std::size_t total = (reply.size() + chunk - 1) / chunk;
+    if (total > max_total)
+        throw std::length_error("reply too large for a split packet");
+
+    std::vector<std::string> packets;
+    packets.reserve(total);
+    for (std::size_t number = 0; number < total; ++number)
+    {
+        const auto payload = reply.substr(number * chunk, chunk);
+        std::string packet(header_len + payload.size(), '\0');
+        std::memcpy(packet.data(), "\xFE\xFF\xFF\xFF", 4);
+        std::memcpy(packet.data() + 4, &id, sizeof(id));
+        if (format == SplitPacketFormat_e::GoldSrc)
+        {
+            packet[8] = static_cast<char>((number << 4) | total);
+        }
+        else
+        {
+            const auto size = static_cast<int16_t>(max_packet_size);
+            packet[8] = static_cast<char>(total);
+            packet[9] = static_cast<char>(number);
+            std::memcpy(packet.data() + 10, &size, sizeof(size));
+        }
+        std::memcpy(packet.data() + header_len, payload.data(), payload.size());
+        packets.emplace_back(std::move(packet));
+    }
+    return packets;
+}
+
+std::optional<std::string> TSourceEngineQuery::ReassembleSplitPacket(const std::vector<std::string>& fragments)
+{
+    // Both layouts share the long ID, the payload of fragment 0 starting with -1 tells them apart.
+    // Source: bzip2 compressed replies (ID & 0x80000000) are not supported.
+    for (auto format : { SplitPacketFormat_e::Source, SplitPacketFormat_e::GoldSrc })
+    {
+        const std::size_t header_len = format == SplitPacketFormat_e::GoldSrc ? 9 : 10;
+        std::vector<std::string_view> payloads;
+        std::size_t total = 0;
+        bool valid = !fragments.empty();
+        for (std::string_view fragment : fragments)
+        {
+            if (fragment.size() <= header_len || (format == SplitPacketFormat_e::Source && (fragment[7] & 0x80)))
+            {
+                valid = false;
+                break;
+            }
+
+            const auto b8 = static_cast<std::uint8_t>(fragment[8]);
+            const auto b9 = static_cast<std::uint8_t>(fragment[9]);
+            const std::size_t count = format == SplitPacketFormat_e::GoldSrc ? (b8 & 0x0F) : b8;
+            const std::size_t number = format == SplitPacketFormat_e::GoldSrc ? (b8 >> 4) : b9;
+            if (!count || number >= count || (total && count != total))
+            {
+                valid = false;
+                break;
+            }
+            total = count;
+            payloads.resize(total);
+            // duplicated fragments simply overwrite each other
+            payloads[number] = fragment.substr(header_len);
+        }
+
+        if (!valid || std::ranges::any_of(payloads, [](std::string_view payload) { return payload.empty(); }))
+            continue;
+
+        // Source: the short size field is missing on some old engine builds, fragment 0 tells
+        std::size_t skip = 0;
+        if (format == SplitPacketFormat_e::Source && payloads[0].substr(0, 4) != "\xFF\xFF\xFF\xFF")
+            skip = 2;
+        if (payloads[0].substr(skip, 4) != "\xFF\xFF\xFF\xFF" || std::ranges::any_of(payloads, [skip](std::string_view payload) { return payload.size() <= skip; }))
+            continue;
+
+        std::string result;
+        for (auto payload : payloads)
+            result.append(payload.substr(skip));
+        return result;
+    }
+    return std::nullopt;
+}
+
+auto TSourceEngineQuery::SplitPacketFormatOf(const ServerInfoQueryResult& info) -> SplitPacketFormat_e
+{
+    // protocol 48 is GoldSrc, Source servers report 7 or 17
+    return info.header2 == 'm' || info.Protocol >= 47 ? SplitPacketFormat_e::GoldSrc : SplitPacketFormat_e::Source;
 }
 
 // Reference: https://developer.valvesoftware.com/wiki/Server_queries#A2S_INFO
 auto TSourceEngineQuery::GetServerInfoDataAsync(asio::ip::udp::endpoint endpoint, std::chrono::system_clock::duration timeout) -> asio::awaitable<std::vector<ServerInfoQueryResult>>
 {
-    udp::socket socket(ioc, udp::endpoint(udp::v4(), 0));
-
-    constexpr auto A2S_INFO = 'T';
-    static constexpr char request1[] = "\xFF\xFF\xFF\xFF" "TSource Engine Query"; // Source / GoldSrc Steam
-    static constexpr char request2[] = "\xFF\xFF\xFF\xFF" "details"; // GoldSrc WON
-    static constexpr char request3[] = "\xFF\xFF\xFF\xFF" "info"; // Xash3D
-    co_await socket.async_send_to(asio::buffer(request1, sizeof(request1)), endpoint, asio::use_awaitable);
-    co_await socket.async_send_to(asio::buffer(request2, sizeof(request2)), endpoint, asio::use_awaitable);
-    co_await socket.async_send_to(asio::buffer(request3, sizeof(request3)), endpoint, asio::use_awaitable);
-
-    asio::system_timer ddl(ioc, timeout);
-    asio::co_spawn(ioc, [&ddl, &socket]() -> asio::awaitable<void> {
-        try {
-            co_await ddl.async_wait(asio::use_awaitable);
-            socket.close();
-        }
-        catch (const asio::system_error& e) { co_return; } // asio::error::operation_aborted
-        }, asio::detached);
+    auto query = co_await engine->QueryAsync(endpoint, Engine::QueryType_e::ServerInfo, std::chrono::duration_cast<std::chrono::steady_clock::duration>(timeout));
 
     std::vector<TSourceEngineQuery::ServerInfoQueryResult> result;
-    while (1)
+    for (const auto& reply : query->replies)
     {
         try {
-            udp::endpoint sender_endpoint(udp::v4(), 0);
-            char buffer[4096];
-            std::size_t reply_length = co_await socket.async_receive_from(asio::buffer(buffer, 4096), sender_endpoint, asio::use_awaitable);
-            if (sender_endpoint == endpoint && reply_length > 5)
-                result.emplace_back(TSourceEngineQuery::MakeServerInfoQueryResultFromBuffer(buffer, reply_length));
+            result.emplace_back(TSourceEngineQuery::MakeServerInfoQueryResultFromBuffer(reply.data(), reply.size()));
         }
         catch (const std::invalid_argument& e) {
             continue;
         }
-        catch (const asio::system_error& e) {
-            if (e.code() == asio::error::operation_aborted && !result.empty())
-                break;
-            break;
-        }
     }
     co_return result;
 }
 
-auto TSourceEngineQuery::GetPlayerListDataAsync(asio::ip::udp::endpoint endpoint, std::chrono::system_clock::duration timeout) -> asio::awaitable<PlayerListQueryResult>
+auto TSourceEngineQuery::GetServerFillAsync(asio::ip::udp::endpoint endpoint, std::chrono::system_clock::duration timeout) -> asio::awaitable<std::optional<ServerFillResult>>
 {
-    udp::socket socket(ioc, udp::endpoint(udp::v4(), 0));
-
-    asio::system_timer ddl(ioc, timeout);
-    asio::co_spawn(ioc, [&ddl, &socket]() -> asio::awaitable<void> {
-        try {
-            co_await ddl.async_wait(asio::use_awaitable);
-            socket.close();
-        }
-        catch (const asio::system_error& e) { co_return; } // asio::error::operation_aborted
-        }, asio::detached);
-	
-    char buffer[4096];
-
-    // first attempt
-    constexpr char request_challenge[] = "\xFF\xFF\xFF\xFF" "U" "\xFF\xFF\xFF\xFF";
-    std::size_t bytes_transferred = co_await socket.async_send_to(asio::buffer(request_challenge, sizeof(request_challenge)), endpoint, asio::use_awaitable);
-
-    udp::endpoint sender_endpoint(udp::v4(), 0);
-    std::size_t reply_length = co_await socket.async_receive_from(asio::buffer(buffer, 4096), sender_endpoint, asio::use_awaitable);
-
-    TSourceEngineQuery::PlayerListQueryResult first_result = TSourceEngineQuery::MakePlayerListQueryResultFromBuffer(buffer, reply_length);
-    if (first_result.Results.index() == 1)
-        co_return first_result;
+    auto query = co_await engine->QueryAsync(endpoint, Engine::QueryType_e::ServerFill, std::chrono::duration_cast<std::chrono::steady_clock::duration>(timeout));
+    co_return query->fill;
+}
 
-    // second attempt
-    const int32_t challenge = std::get<int32_t>(first_result.Results);
-    const char(&accessor)[4] = reinterpret_cast<const char(&)[4]>(challenge);
-    char request3[10] = { '\xFF', '\xFF', '\xFF', '\xFF', 'U', accessor[0], accessor[1], accessor[2], accessor[3], '\0' };
-    bytes_transferred = co_await socket.async_send_to(asio::buffer(request3, sizeof(request3)), endpoint, asio::use_awaitable);
-    reply_length = co_await socket.async_receive_from(asio::buffer(buffer, 4096), sender_endpoint, asio::use_awaitable);
+auto TSourceEngineQuery::GetPlayerListDataAsync(asio::ip::udp::endpoint endpoint, std::chrono::system_clock::duration timeout) -> asio::awaitable<PlayerListQueryResult>
+{
+    auto query = co_await engine->QueryAsync(endpoint, Engine::QueryType_e::PlayerList, std::chrono::duration_cast<std::chrono::steady_clock::duration>(timeout));
+    if (query->replies.empty())
+        throw asio::system_error(asio::error::timed_out);
+    const auto& reply = query->replies.front();
+    co_return TSourceEngineQuery::MakePlayerListQueryResultFromBuffer(reply.data(), reply.size());
+}
 
-    ddl.cancel();
-    co_return TSourceEngineQuery::MakePlayerListQueryResultFromBuffer(buffer, reply_length);
-}
\ No newline at end of file
+auto TSourceEngineQuery::GetRulesDataAsync(asio::ip::udp::endpoint endpoint, std::chrono::system_clock::duration timeout) -> asio::awaitable<RulesQueryResult>
+{
+    auto query = co_await engine->QueryAsync(endpoint, Engine::QueryType_e::Rules, std::chrono::duration_cast<std::chrono::steady_clock::duration>(timeout));
+    if (query->replies.empty())
+        throw asio::system_error(asio::error::timed_out);
+    const auto& reply = query->replies.front();
+    co_return TSourceEngineQuery::MakeRulesQueryResultFromBuffer(reply.data(), reply.size());
+}
@@ -1,10 +1,13 @@
 #pragma once
 
 #include <string>
+#include <string_view>
 #include <array>
 #include <vector>
 #include <optional>
 #include <variant>
+#include <memory>
+#include <chrono>
 
 #include <asio.hpp>
 #include <asio/awaitable.hpp>
@@ -100,6 +103,78 @@ public:
         std::optional<std::array<int32_t, 2>> GameID;
     };
 
+    // Allocation-free A2S_INFO decode: the strings point into the reply buffer and are only valid as long as it is.
+    // Same member names as ServerInfoQueryResult, both are decoded by the one A2S_INFO schema.
+    struct ServerInfoQueryView
+    {
+        int32_t header1;
+        uint8_t header2; // header ('I' or 'm')
+        std::string_view LocalAddress; // 'm' only
+        uint8_t Protocol;
+        std::string_view ServerName;
+        std::string_view Map;
+        std::string_view Folder;
+        std::string_view Game;
+        int16_t SteamID;
+        int PlayerCount;
+        int MaxPlayers;
+        int BotCount;
+        ServerType_e ServerType;
+        Environment_e Environment;
+        Visibility_e Visibility;
+
+        bool Mod;
+        struct ModData_s
+        {
+            std::string_view Link;
+            std::string_view DownloadLink;
+            uint8_t NULL_;
+            int32_t Version;
+            int32_t Size;
+            ServerInfoQueryResult::ModData_s::ModType_e Type;
+            bool DLL;
+        };
+        std::optional<ModData_s> ModData;
+
+        bool VAC;
+        std::string_view GameVersion;
+
+        uint8_t EDF;
+        std::optional<int16_t> Port;
+        std::optional<std::array<int32_t, 2>> SteamIDExtended;
+
+        struct SourceTVData_s
+        {
+            int16_t SourceTVPort;
+            std::string_view SourceTVName;
+        };
+        std::optional<SourceTVData_s> SourceTVData;
+        std::string_view Keywords;
+        std::optional<std::array<int32_t, 2>> GameID;
+    };
+
+    // A2S_INFO reply cut at the fields that vary per request. The fixed bytes between them are serialized once,
+    // ServerName and Map are picked from pre-serialized candidates and VAC is one byte, so a reply is only
+    // a buffer sequence over shared data.
+    struct ServerInfoReplyTemplate
+    {
+        enum Slot_e { ServerName, Map, VAC };
+        std::array<std::string, 4> Fixed;
+        std::array<Slot_e, 3> Order; // slots in wire order, Fixed[i] precedes Order[i]
+        std::vector<std::string> ServerNames; // NUL included
+        std::vector<std::string> Maps;
+
+        // vac must stay alive until the send completes
+        std::array<asio::const_buffer, 7> Buffers(std::size_t name, std::size_t map, const uint8_t& vac) const;
+    };
+
+    struct ServerFillResult
+    {
+        int PlayerCount;
+        int MaxPlayers;
+        int BotCount;
+    };
+
     struct PlayerListQueryResult
     {
         std::chrono::time_point<std::chrono::steady_clock> GenerateTime;
@@ -116,18 +191,62 @@ public:
         std::variant<int32_t, std::vector<PlayerInfo_s>> Results;
     };
 
+    struct RulesQueryResult
+    {
+        std::chrono::time_point<std::chrono::steady_clock> GenerateTime;
+        int32_t header1;  // header -1
+        uint8_t  header2; // header ('A') for challenge or header ('E') for A2S_RULES
+
+        struct RuleTable_s
+        {
+            uint16_t Count;
+            std::string Strings; // "name\0value\0" pairs as sent on the wire
+        };
+        std::variant<int32_t, RuleTable_s> Results;
+    };
+
+    // Layout of the 0xFFFFFFFE multi-packet header
+    enum class SplitPacketFormat_e
+    {
+        GoldSrc, // long ID, byte (number << 4 | total)
+        Source, // long ID, byte total, byte number, short size
+    };
+
+    // Long-lived: every query shares one socket and one timeout queue, so keep a single instance around
+    // and issue queries to as many endpoints concurrently as needed.
     TSourceEngineQuery(asio::io_context& ioc);
     ~TSourceEngineQuery();
+    TSourceEngineQuery(const TSourceEngineQuery&) = delete;
+    TSourceEngineQuery& operator=(const TSourceEngineQuery&) = delete;
     asio::awaitable<std::vector<ServerInfoQueryResult>> GetServerInfoDataAsync(asio::ip::udp::endpoint endpoint, std::chrono::system_clock::duration timeout);
     asio::awaitable<PlayerListQueryResult> GetPlayerListDataAsync(asio::ip::udp::endpoint endpoint, std::chrono::system_clock::duration timeout);
+    // PlayerCount/MaxPlayers only, decoded straight from the receive buffer; empty on timeout
+    asio::awaitable<std::optional<ServerFillResult>> GetServerFillAsync(asio::ip::udp::endpoint endpoint, std::chrono::system_clock::duration timeout);
+    asio::awaitable<RulesQueryResult> GetRulesDataAsync(asio::ip::udp::endpoint endpoint, std::chrono::system_clock::duration timeout);
 
 public:
     static ServerInfoQueryResult MakeServerInfoQueryResultFromBuffer(const char *reply, std::size_t reply_length);
+    static std::optional<ServerInfoQueryView> MakeServerInfoQueryViewFromBuffer(const char *reply, std::size_t reply_length);
     static PlayerListQueryResult MakePlayerListQueryResultFromBuffer(const char *reply, std::size_t reply_length);
+    static RulesQueryResult MakeRulesQueryResultFromBuffer(const char *reply, std::size_t reply_length);
 
+    // exact encoded sizes, the writers throw std::length_error when max_len is smaller
+    static std::size_t ServerInfoQueryResultSize(const ServerInfoQueryResult& res);
+    static std::size_t PlayerListQueryResultSize(const PlayerListQueryResult& res);
     static std::size_t WriteServerInfoQueryResultToBuffer(const ServerInfoQueryResult &res, char* buffer, std::size_t max_len);
     static std::size_t WritePlayerListQueryResultToBuffer(const PlayerListQueryResult& res, char* buffer, std::size_t max_len);
+    // empty names/maps keep the ones in info
+    static ServerInfoReplyTemplate MakeServerInfoReplyTemplate(const ServerInfoQueryResult& info, const std::vector<std::string>& names, const std::vector<std::string>& maps);
+    static std::vector<std::string> WritePlayerListQueryResultToPackets(const PlayerListQueryResult& res, SplitPacketFormat_e format, int32_t id);
+    static std::vector<std::string> WriteRulesQueryResultToPackets(const RulesQueryResult& res, SplitPacketFormat_e format, int32_t id);
+
+    // -1 replies larger than max_packet_size are cut into -2 fragments, smaller ones are returned as is
+    static std::vector<std::string> SplitPacket(std::string_view reply, SplitPacketFormat_e format, int32_t id, std::size_t max_packet_size = 1400);
+    // all fragments of one split packet in any order, either format; empty until every fragment is present
+    static std::optional<std::string> ReassembleSplitPacket(const std::vector<std::string>& fragments);
+    static SplitPacketFormat_e SplitPacketFormatOf(const ServerInfoQueryResult& info);
 
 private:
-    asio::io_context &ioc;
+    struct Engine;
+    std::shared_ptr<Engine> engine;
 };
\ No newline at end of file
@@ -0,0 +1,159 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <ostream>
+#include <asio.hpp>
+
+#include "EndpointKey.h"
+
+// tracked source addresses in the heavy hitter table, and how many sessions a dump lists
+inline std::size_t traffic_top_sources = 128;
+inline std::size_t traffic_dump_sessions = 20;
+
+// Packets and bytes in both directions: up is client => backend, down is backend => client.
+// Relaxed atomics, a backend's totals are bumped from every listener.
+struct TrafficCounters
+{
+    std::atomic<std::uint64_t> packets_up = 0;
+    std::atomic<std::uint64_t> bytes_up = 0;
+    std::atomic<std::uint64_t> packets_down = 0;
+    std::atomic<std::uint64_t> bytes_down = 0;
+
+    void Up(std::size_t bytes)
+    {
+        packets_up.fetch_add(1, std::memory_order_relaxed);
+        bytes_up.fetch_add(bytes, std::memory_order_relaxed);
+    }
+
+    void Down(std::size_t bytes)
+    {
+        packets_down.fetch_add(1, std::memory_order_relaxed);
+        bytes_down.fetch_add(bytes, std::memory_order_relaxed);
+    }
+
+    std::uint64_t Bytes() const { return bytes_up.load(std::memory_order_relaxed) + bytes_down.load(std::memory_order_relaxed); }
+
+    // "up=12p/3400B down=40p/52000B"
+    friend std::ostream& operator<<(std::ostream& os, const TrafficCounters& c)
+    {
+        return os << "up=" << c.packets_up.load(std::memory_order_relaxed) << "p/" << c.bytes_up.load(std::memory_order_relaxed) << "B"
+            << " down=" << c.packets_down.load(std::memory_order_relaxed) << "p/" << c.bytes_down.load(std::memory_order_relaxed) << "B";
+    }
+};
+
+// SpaceSaving top-K of source addresses by packet count, in fixed space whatever a spoofed flood throws at it.
+// A new address evicts the smallest entry and inherits its count as error, so count - error <= true count <= count,
+// and every address with more than total / capacity packets is guaranteed to be in the table.
+// The entries form a min-heap on count, one packet costs a hash lookup and a short sift.
+class HeavyHitters
+{
+public:
+    struct Entry
+    {
+        asio::ip::address address;
+        std::uint64_t packets = 0;
+        std::uint64_t bytes = 0; // since it entered the table
+        std::uint64_t error = 0;
+    };
+
+    explicit HeavyHitters(std::size_t capacity) : capacity(std::max<std::size_t>(capacity, 1))
+    {
+        heap.reserve(this->capacity);
+        index.reserve(this->capacity);
+    }
+
+    void Record(const asio::ip::udp::endpoint& from, std::size_t bytes)
+    {
+        ++total;
+        EndpointKey key(from);
+        key.port = 0;
+        if (auto iter = index.find(key); iter != index.end())
+        {
+            Slot& slot = heap[iter->second];
+            ++slot.entry.packets;
+            slot.entry.bytes += bytes;
+            SiftDown(iter->second);
+            return;
+        }
+        if (heap.size() < capacity)
+        {
+            heap.push_back({ key, { NormalizeAddress(from.address()), 1, bytes, 0 } });
+            index.emplace(key, heap.size() - 1);
+            SiftUp(heap.size() - 1);
+            return;
+        }
+        // evict the minimum, the newcomer may have been it all along
+        Slot& min = heap.front();
+        index.erase(min.key);
+        min.key = key;
+        min.entry = { NormalizeAddress(from.address()), min.entry.packets + 1, bytes, min.entry.packets };
+        index.emplace(key, 0);
+        SiftDown(0);
+    }
+
+    // the k heaviest, heaviest first
+    std::vector<Entry> Top(std::size_t k) const
+    {
+        std::vector<Entry> entries;
+        entries.reserve(heap.size());
+        for (const auto& slot : heap)
+            entries.push_back(slot.entry);
+        k = std::min(k, entries.size());
+        std::partial_sort(entries.begin(), entries.begin() + k, entries.end(), [](const Entry& a, const Entry& b) { return a.packets > b.packets; });
+        entries.resize(k);
+        return entries;
+    }
+
+    std::uint64_t Total() const { return total; }
+
+private:
+    struct Slot
+    {
+        EndpointKey key;
+        Entry entry;
+    };
+
+    void Swap(std::size_t a, std::size_t b)
+    {
+        std::swap(heap[a], heap[b]);
+        index[heap[a].key] = a;
+        index[heap[b].key] = b;
+    }
+
+    void SiftUp(std::size_t i)
+    {
+        while (i > 0)
+        {
+            const std::size_t parent = (i - 1) / 2;
+            if (heap[parent].entry.packets <= heap[i].entry.packets)
+                return;
+            Swap(i, parent);
+            i = parent;
+        }
+    }
+
+    void SiftDown(std::size_t i)
+    {
+        while (true)
+        {
+            std::size_t smallest = i;
+            for (std::size_t child = 2 * i + 1; child <= 2 * i + 2 && child < heap.size(); ++child)
+                if (heap[child].entry.packets < heap[smallest].entry.packets)
+                    smallest = child;
+            if (smallest == i)
+                return;
+            Swap(i, smallest);
+            i = smallest;
+        }
+    }
+
+    const std::size_t capacity;
+    std::vector<Slot> heap;
+    std::unordered_map<EndpointKey, std::size_t> index;
+    std::uint64_t total = 0;
+};
@@ -3,13 +3,48 @@
 #include <iostream>
 #include <sstream>
 #include <ctime>
+#include <string_view>
+#include <optional>
+
+// error < warn < info < debug; log() is info, changeable at runtime through the admin socket
+enum class LogLevel
+{
+    error,
+    warn,
+    info,
+    debug,
+};
+
+inline LogLevel log_level = LogLevel::info;
+
+inline std::string_view LogLevelName(LogLevel level)
+{
+    constexpr std::string_view names[] = { "error", "warn", "info", "debug" };
+    return names[static_cast<int>(level)];
+}
+
+inline std::optional<LogLevel> ParseLogLevel(std::string_view name)
+{
+    for (auto level : { LogLevel::error, LogLevel::warn, LogLevel::info, LogLevel::debug })
+        if (LogLevelName(level) == name)
+            return level;
+    return std::nullopt;
+}
 
 template<class...Args>
-void log(Args &&...args)
+void log_at(LogLevel level, Args &&...args)
 {
+    if (level > log_level)
+        return;
     std::ostringstream oss;
     std::time_t now = std::time(nullptr);
     oss << std::ctime(&now); // thread-unsafe
     (oss << ... << args);
     puts(oss.str().c_str());
-}
\ No newline at end of file
+}
+
+template<class...Args>
+void log(Args &&...args)
+{
+    log_at(LogLevel::info, std::forward<Args>(args)...);
+}
@@ -4,6 +4,8 @@
 #include <numeric>
 #include <ranges>
 #include <random>
+#include <cstring>
+#include <limits>
 
 #include "server_name.h"
 #include "log.hpp"
@@ -15,28 +17,24 @@
 #include <asio/use_awaitable.hpp>
 
 #include "TSourceEngineQuery.h"
-#include "parse_args.h"
 #include "parse_ip.h"
+#include "MasterServer.h"
+#include "RateLimiter.h"
+#include "RouterConfig.h"
+#include "Handoff.h"
+#include "TrafficStats.h"
+#include "PacketCapture.h"
+#include "AdminSocket.h"
+#include "RefreshPolicy.h"
 
 #ifdef ENABLE_STEAM_SUPPORT
 #include <archtypes.h>
 #include <steam/steam_api.h>
 #include <steam/steam_gameserver.h>
+#include "SteamPump.h"
+using SteamServerPump = SteamPump<ISteamGameServer>;
 #endif
 
-const auto desc_host = "z4.moemod.com";
-std::string master_servers[] = {
-    "hlmaster.net:27010",
-    "hl1master.dt-club.net:27010",
-    "hl1master.steampowered.com:27010",
-    "css.setti.info:27010", // alive
-    "188.40.40.201:27010", // alive
-    "69.28.140.247:27010",
-    "209.197.20.34:27010",
-    "69.28.158.131:27010",
-    "hl1master.5eplay.com:27010",
-	"68.142.72.250:27010"
-};
 
 bool IsValidInitialPacket(const char *buffer, std::size_t n)
 {
@@ -55,6 +53,11 @@ bool IsPlayerListQueryPacket(const char* buffer, std::size_t n)
     return n >= 5 && !strncmp(buffer, "\xFF\xFF\xFF\xFF" "U", 5);
 }
 
+bool IsRulesQueryPacket(const char* buffer, std::size_t n)
+{
+    return n >= 5 && !strncmp(buffer, "\xFF\xFF\xFF\xFF" "V", 5);
+}
+
 bool IsServerListResPacket(const char* buffer, std::size_t n)
 {
     return n >= 5 && !strncmp(buffer, "\xFF\xFF\xFF\xFF" "f", 5);
@@ -77,17 +80,57 @@ class Citrus
 {
     asio::io_context& ioc;
     udp::endpoint desc_endpoint;
+    TSourceEngineQuery tseq;
 
     std::optional<std::vector<TSourceEngineQuery::ServerInfoQueryResult>> ServerInfoQueryResultCache;
+    std::uint64_t ServerInfoCacheGeneration = 0; // bumped on every refresh, listeners rebuild their reply templates
+    std::chrono::system_clock::time_point ServerInfoCacheTime{}; // of the last good answer, served until the next one
     std::optional<TSourceEngineQuery::PlayerListQueryResult> PlayerListQueryResultCache;
+    std::shared_ptr<const std::vector<std::string>> PlayerListReplyCache; // pre-serialized, split when needed
+    std::shared_ptr<const std::vector<std::string>> RulesReplyCache;
+    MasterServerScheduler masters;
+
+    // every listen socket with its clients, for the handoff and the traffic dump
+    struct ListenerRef
+    {
+        udp::socket* socket;
+        ClientManager* clients;
+        const SourceRateLimiter* a2s_limiter;
+#ifdef ENABLE_STEAM_SUPPORT
+        std::shared_ptr<SteamServerPump> steam_pump;
+#endif
+    };
+    std::vector<ListenerRef> listeners;
+    // all packets on the listen sockets by source address, players and floods alike
+    HeavyHitters traffic_sources;
+
+    // graceful restart: what the previous process handed us, and what we hand to the next one
+    std::optional<HandoffState> inherited;
+    bool handed_off = false;
+    asio::steady_timer handoff_resumed; // cancelled to wake the listeners when a handoff fell through
+
+    AdminServer admin;
+    asio::system_timer a2s_cache_timer; // cancelled to refresh the A2S cache right away
+    RefreshPolicy a2s_refresh;
 
 public:
     Citrus(asio::io_context& ioc) :
-        ioc(ioc)
+        ioc(ioc),
+        tseq(ioc),
+        masters(ioc, [this] { return ServerInfoQueryResultCache && !ServerInfoQueryResultCache->empty() ? &ServerInfoQueryResultCache->front() : nullptr; }),
+        traffic_sources(traffic_top_sources),
+        handoff_resumed(ioc, asio::steady_timer::time_point::max()),
+        a2s_cache_timer(ioc)
     {
 
     }
 
+    // listen sockets and sessions of the previous process, picked up by CoHandlePlayerSection
+    void Inherit(HandoffState state)
+    {
+        inherited = std::move(state);
+    }
+
     template<std::ranges::input_range Ports, class...Args>
     void CoSpawn(Ports ports, unsigned dest_port, Args &&...args)
     {
@@ -98,122 +141,447 @@ public:
     template<std::ranges::input_range Ports, class...Args>
     asio::awaitable<void> CoMain(Ports ports, unsigned dest_port, const Args &...args)
     {
-        udp::resolver resolver(ioc);
+        const std::string desc_name = router_config.desc_host + ":" + std::to_string(dest_port);
+        std::vector<std::string> names = backend_names;
+        names.push_back(desc_name);
+
+        // start from the last-known endpoints and re-resolve behind them; before the listeners,
+        // so that sessions taken over from a previous process find their backends
+        auto resolved = LoadResolverCache();
+        if (!resolved.empty())
+            log("[Start] Serving from ", resolver_cache_path, " while resolving");
+        ApplyResolved(resolved, desc_name);
+
+        // the listen ports don't depend on DNS, clients without a backend yet are simply not forwarded
+        for (unsigned int port : ports)
+            asio::co_spawn(ioc, CoHandlePlayerSection(port, args...), asio::detached);
+        asio::co_spawn(ioc, CoPollBackendServers(), asio::detached);
+        asio::co_spawn(ioc, masters.Run(router_config.masters), asio::detached);
+        asio::co_spawn(ioc, CoDumpTrafficOnSignal(), asio::detached);
+        RegisterAdminCommands();
+        asio::co_spawn(ioc, admin.Run(ioc), asio::detached);
+        asio::co_spawn(ioc, CoServeHandoff(ioc, [this] { return HandOff(); }, [] {
+            log("[Handoff] ", "done, exiting");
+            std::fflush(stdout);
+            std::_Exit(0);
+        }, [this] { ResumeAfterHandOff(); }), asio::detached);
+
+        if (!co_await CoResolve(resolved, names, desc_name))
+            log("[Start] ", desc_name, " could not be resolved, A2S replies wait for it");
+
+        // srcds do move to new addresses; getaddrinfo doesn't tell TTLs, so poll on an interval
+        // with jitter so that several routers don't hit the resolver together
+        std::mt19937 rng(std::random_device{}());
+        asio::steady_timer resolve_timer(ioc);
+        while (true)
+        {
+            const auto jitter = std::uniform_real_distribution<double>(0.8, 1.2)(rng);
+            resolve_timer.expires_after(std::chrono::duration_cast<std::chrono::steady_clock::duration>(resolve_interval * jitter));
+            co_await resolve_timer.async_wait(asio::use_awaitable);
+            co_await CoResolve(resolved, names, desc_name);
+        }
+    }
 
-        auto desc_endpoints = co_await resolver.async_resolve(udp::v4(), desc_host, std::to_string(dest_port), asio::use_awaitable);
-        for (const auto& ep : desc_endpoints)
+    asio::awaitable<bool> CoResolve(ResolvedEndpoints& resolved, const std::vector<std::string>& names, const std::string& desc_name)
+    {
+        std::erase_if(resolved, [&](const auto& entry) { return std::ranges::find(names, entry.first) == names.end(); });
+        // each backend goes live as soon as its own name answers; names that fail keep their last-known address
+        co_await ResolveEach(ioc, names, [&](const std::string& name, const udp::endpoint& endpoint) {
+            auto [iter, inserted] = resolved.try_emplace(name, endpoint);
+            if (!inserted && iter->second == endpoint)
+                return;
+            iter->second = endpoint;
+            ApplyResolved(resolved, desc_name);
+        });
+        SaveResolverCache(resolved);
+        co_return resolved.contains(desc_name);
+    }
+
+    // starts the A2S cache the first time desc_endpoint is known, false while it isn't
+    bool ApplyResolved(const ResolvedEndpoints& resolved, const std::string& desc_name)
+    {
+        UpdateServers(resolved);
+        auto iter = resolved.find(desc_name);
+        if (iter == resolved.end())
+            return false;
+        const bool first = desc_endpoint == udp::endpoint();
+        if (desc_endpoint != iter->second)
         {
-            desc_endpoint = ep;
+            // CoCacheTSourceEngineQuery picks it up on its next round
+            desc_endpoint = iter->second;
             log("[Start] Resolved IP Address ", desc_endpoint);
         }
+        if (first)
+            asio::co_spawn(ioc, CoCacheTSourceEngineQuery(), asio::detached);
+        return true;
+    }
 
-        co_await InitServers(ioc);
-
-        using namespace std::chrono_literals;
+    // stops every listener and session from reading, the next process owns the sockets from here on;
+    // nothing while clients are being migrated, the new process asks again
+    std::optional<HandoffState> HandOff()
+    {
+        if (std::ranges::any_of(listeners, [](const ListenerRef& listener) { return listener.clients->MigrationInProgress(); }))
+        {
+            for (const auto& listener : listeners)
+                listener.clients->PauseMigrations(handoff_busy_wait);
+            return std::nullopt;
+        }
+        HandoffState state;
+        handed_off = true;
+        masters.Stop();
+        for (const auto& listener : listeners)
+        {
+            state.listeners.push_back({ listener.socket->local_endpoint().port(), listener.socket->native_handle() });
+            auto sessions = listener.clients->ExportSessions();
+            state.sessions.insert(state.sessions.end(), sessions.begin(), sessions.end());
+            listener.clients->Freeze();
+            asio::error_code ec;
+            listener.socket->cancel(ec);
+        }
+        return state;
+    }
 
-        asio::co_spawn(ioc, CoCacheTSourceEngineQuery(), asio::detached);
+    // the next process got none of the sockets, read them again
+    void ResumeAfterHandOff()
+    {
+        handed_off = false;
+        for (const auto& listener : listeners)
+            listener.clients->Thaw();
+        handoff_resumed.cancel();
+        asio::co_spawn(ioc, masters.Run(router_config.masters), asio::detached);
+    }
 
-        for (unsigned int port : ports)
-            asio::co_spawn(ioc, CoHandlePlayerSection(port, args...), asio::detached);
+    // backends, the busiest sessions and the heaviest sources, one line each
+    std::string TrafficReport() const
+    {
+        std::ostringstream oss;
+        for (const auto& backend : *BackendServers())
+            oss << "backend " << backend->endpoint << " sessions=" << backend->sessions << ' ' << backend->traffic << (backend->draining ? " draining" : "") << '\n';
+        for (const auto& listener : listeners)
+            listener.clients->DumpTraffic(oss, traffic_dump_sessions);
+        oss << "sources: " << traffic_sources.Total() << " packets total\n";
+        for (const auto& entry : traffic_sources.Top(traffic_dump_sessions))
+            oss << "source " << entry.address << " packets=" << entry.packets - entry.error << ".." << entry.packets << " bytes>=" << entry.bytes << '\n';
+        return oss.str();
     }
 
-    asio::awaitable<void> CoHandleMasterServer(udp::socket& socket, std::string master_host, std::string master_port)
+    void RegisterAdminCommands()
     {
-        udp::resolver resolver(ioc);
+        admin.Register("sessions", "", [this](const AdminServer::Args&) {
+            std::ostringstream oss;
+            for (const auto& listener : listeners)
+            {
+                oss << "listener " << listener.socket->local_endpoint() << " clients=" << listener.clients->Size() << '\n';
+                listener.clients->DumpTraffic(oss, std::numeric_limits<std::size_t>::max());
+            }
+            return oss.str();
+        });
+        admin.Register("backends", "", [](const AdminServer::Args&) {
+            std::ostringstream oss;
+            for (const auto& backend : *BackendServers())
+                oss << "backend " << backend->endpoint << " sessions=" << backend->sessions << " players~" << backend->EstimatedPlayers()
+                    << "/" << backend->max_players << ' ' << backend->traffic << (backend->draining ? " draining" : "") << '\n';
+            return oss.str();
+        });
+        auto drain = [](bool on) {
+            return [on](const AdminServer::Args& args) -> std::string {
+                const auto endpoint = args.size() == 1 ? ParseBackendEndpoint(args[0]) : std::nullopt;
+                if (!endpoint)
+                    return "usage: address:port of a backend, see backends";
+                return DrainBackend(*endpoint, on) ? "ok" : "no such backend";
+            };
+        };
+        admin.Register("drain", "<address:port>", drain(true));
+        admin.Register("undrain", "<address:port>", drain(false));
+        admin.Register("migrate", "<from address:port> <count> [to address:port]", [this](const AdminServer::Args& args) -> std::string {
+            const auto from = args.size() >= 2 ? ParseBackendEndpoint(args[0]) : std::nullopt;
+            const auto to = args.size() == 3 ? ParseBackendEndpoint(args[2]) : std::nullopt;
+            if (!from || args.size() > 3 || (args.size() == 3 && !to))
+                return "usage: migrate <from address:port> <count> [to address:port], see backends";
+            const auto from_backend = FindBackendServer(*from);
+            const auto to_backend = to ? FindBackendServer(*to) : nullptr;
+            if (!from_backend || (to && !to_backend))
+                return "no such backend";
+            const int count = std::stoi(args[1]);
+            if (count <= 0)
+                return "count must be positive";
+            int moved = 0;
+            for (const auto& listener : listeners)
+            {
+                if (listener.clients->MigrationsPaused())
+                    return "migrations are paused for a handoff";
+                moved += listener.clients->MigrateClients(from_backend, count - moved, to_backend);
+            }
+            return "redirecting " + std::to_string(moved) + " of " + args[1];
+        });
+        admin.Register("loglevel", "[error|warn|info|debug]", [](const AdminServer::Args& args) -> std::string {
+            if (!args.empty())
+                if (auto error = ConfigLoader::Set("log.level", args[0]); !error.empty())
+                    return error;
+            return std::string(LogLevelName(log_level));
+        });
+        admin.Register("stats", "", [this](const AdminServer::Args&) {
+            std::ostringstream oss;
+            for (const auto& listener : listeners)
+            {
+                const auto& migration = listener.clients->GetMigrationStats();
+                oss << "listener " << listener.socket->local_endpoint() << " clients=" << listener.clients->Size()
+                    << " a2s_dropped=" << listener.a2s_limiter->Dropped() << " a2s_sources=" << listener.a2s_limiter->Sources() << '\n'
+                    << "  migration started=" << migration.started << " ok=" << migration.succeeded << " failed=" << migration.failed
+                    << " rejoin_ms " << migration.rejoin_ms.ToString() << '\n';
+#ifdef ENABLE_STEAM_SUPPORT
+                const auto& steam = listener.steam_pump->GetStats();
+                oss << "  steam packets=" << steam.packets << " bytes=" << steam.bytes << " batches=" << steam.batches << " wakeups=" << steam.wakeups << '\n';
+#endif
+            }
+            oss << "a2s_cache age=" << (ServerInfoQueryResultCache ? CacheAge().count() : -1) << "s failures=" << a2s_refresh.Failures() << '\n';
+            oss << "sources packets=" << traffic_sources.Total() << " capture=" << (packet_capture.Enabled() ? "on" : "off") << '\n';
+            return oss.str();
+        });
+        admin.Register("traffic", "", [this](const AdminServer::Args&) { return TrafficReport(); });
+        admin.Register("cache", "[refresh]", [this](const AdminServer::Args& args) -> std::string {
+            if (!args.empty() && args[0] == "refresh")
+            {
+                a2s_cache_timer.cancel();
+                return "refreshing";
+            }
+            std::ostringstream oss;
+            oss << "refresh in " << std::chrono::duration_cast<std::chrono::seconds>(a2s_cache_timer.expiry() - std::chrono::system_clock::now()).count()
+                << "s, failures " << a2s_refresh.Failures() << '\n';
+            if (!ServerInfoQueryResultCache)
+                return oss.str() + "empty";
+            oss << "generation " << ServerInfoCacheGeneration << " age " << CacheAge().count() << "s\n";
+            for (const auto& finfo : *ServerInfoQueryResultCache)
+                oss << "info \"" << finfo.ServerName << "\" " << finfo.Map << ' ' << finfo.PlayerCount << '/' << finfo.MaxPlayers << '\n';
+            if (PlayerListQueryResultCache)
+                if (const auto* players = std::get_if<std::vector<TSourceEngineQuery::PlayerListQueryResult::PlayerInfo_s>>(&PlayerListQueryResultCache->Results))
+                    for (const auto& player : *players)
+                        oss << "player \"" << player.Name << "\" score=" << player.Score << " time=" << static_cast<int>(player.Duration) << "s\n";
+            oss << "player packets=" << (PlayerListReplyCache ? PlayerListReplyCache->size() : 0)
+                << " rules packets=" << (RulesReplyCache ? RulesReplyCache->size() : 0) << '\n';
+            return oss.str();
+        });
+        admin.Register("ratelimit", "[rate [burst]]", [](const AdminServer::Args& args) -> std::string {
+            if (args.size() >= 1)
+                if (auto error = ConfigLoader::Set("a2s.rate", args[0]); !error.empty())
+                    return error;
+            if (args.size() >= 2)
+                if (auto error = ConfigLoader::Set("a2s.burst", args[1]); !error.empty())
+                    return error;
+            std::ostringstream oss;
+            oss << "rate=" << a2s_rate_limit << "/s burst=" << a2s_rate_burst;
+            return oss.str();
+        });
+        admin.Register("capture", "[path]", [](const AdminServer::Args& args) -> std::string {
+            if (!packet_capture.Enabled())
+                return "not enabled, start with -capture <packets>";
+            const std::string path = args.empty() ? capture_path : args[0];
+            return "wrote " + std::to_string(packet_capture.WritePcap(path)) + " packets to " + path;
+        });
+        admin.Register("config", "[key [value]]", [](const AdminServer::Args& args) -> std::string {
+            if (args.size() >= 2)
+                if (auto error = ConfigLoader::Set(args[0], args[1]); !error.empty())
+                    return error;
+            std::ostringstream oss;
+            for (const auto& option : ConfigOptions())
+                if (args.empty() || option.key == args[0])
+                    oss << option.key << " = " << option.show() << '\n';
+            return oss.str();
+        });
+    }
 
-        udp::endpoint master_endpoint;
-        try
+    // kill -USR1 <pid> logs TrafficReport(), kill -USR2 <pid> writes the packet capture
+    asio::awaitable<void> CoDumpTrafficOnSignal()
+    {
+#if defined(SIGUSR1) && defined(SIGUSR2)
+        asio::signal_set signals(ioc, SIGUSR1, SIGUSR2);
+        while (true)
         {
-            auto desc_endpoints = co_await resolver.async_resolve(udp::v4(), master_host, master_port, asio::use_awaitable);
-            for (const auto& ep : desc_endpoints)
+            int signal_number = 0;
+            try
             {
-                master_endpoint = ep;
-                log("[MasterServer] Resolved IP Address ", master_endpoint);
+                signal_number = co_await signals.async_wait(asio::use_awaitable);
             }
+            catch (const asio::system_error& e)
+            {
+                co_return;
+            }
+            if (signal_number == SIGUSR1)
+                log("[Traffic] ", "\n", TrafficReport());
+            else if (packet_capture.Enabled())
+                packet_capture.WritePcap(capture_path);
+            else
+                log("[Capture] ", "not enabled, start with -capture <packets>");
         }
-        catch (const std::system_error& e)
+#else
+        co_return;
+#endif
+    }
+
+    // the inherited socket for port, or a new one; the previous process may still hold the port for a moment
+    asio::awaitable<udp::socket> CoOpenListenSocket(unsigned short port)
+    {
+        if (inherited)
         {
-            log("[MasterServer] Resolved IP Address ", master_host, ":", master_port, " failed:", e.what());
-            co_return;
+            auto& listeners = inherited->listeners;
+            auto iter = std::ranges::find_if(listeners, [port](const HandoffListener& l) { return l.port == port; });
+            if (iter != listeners.end())
+            {
+                const int fd = iter->fd;
+                listeners.erase(iter);
+                if (auto protocol = SocketProtocol(fd))
+                {
+                    udp::socket socket(ioc);
+                    socket.assign(*protocol, fd);
+                    co_return socket;
+                }
+                log("[Handoff] ", "inherited socket for port ", port, " is unusable");
+            }
         }
-
-        constexpr auto S2M_HEARTBEAT3 = 'Z';
-        constexpr auto S2M_HEARTBEAT2 = '0';
-        constexpr auto S2M_GETFILE = 'J';
-
-        constexpr char buffer[] = "\xFF\xFF\xFF\xFF" "Zcstrike" "\0";
-        constexpr char buffer2[] = "\xFF\xFF\xFF\xFF" "i";
-
-        std::atomic_int failed_times = 0;
-        while (true)
+        for (int attempt = 1; ; ++attempt)
         {
             try
             {
-                co_await socket.async_send_to(asio::buffer(buffer), master_endpoint, asio::use_awaitable);
-                co_await socket.async_send_to(asio::buffer(buffer2), master_endpoint, asio::use_awaitable);
-
-                failed_times.store(0);
-
-                asio::system_timer query_timer(ioc, 5s);
-                co_await query_timer.async_wait(asio::use_awaitable);
-                log("[MasterServer] Send S2M_HEARTBEAT3 to ", master_endpoint);
+                co_return OpenDualStackSocket(ioc, port);
             }
             catch (const asio::system_error& e)
             {
-                failed_times.fetch_add(1);
-                log("[MasterServer] Send S2M_HEARTBEAT3 failed with retry: ", e.what());
-                continue;
+                if (e.code() != asio::error::address_in_use || attempt >= 10)
+                    throw;
             }
+            asio::steady_timer retry(ioc, 1s);
+            co_await retry.async_wait(asio::use_awaitable);
         }
     }
 
+    // Serve-stale-while-revalidate: the cached replies stay until a refresh brings a good answer, a failed or empty
+    // one only reschedules (see RefreshPolicy).
     asio::awaitable<void> CoCacheTSourceEngineQuery()
     {
-        TSourceEngineQuery tseq(ioc);
-        std::atomic_int failed_times = 0;
-        bool wait = false;
         while (true)
         {
+            asio::steady_timer::duration next;
             try
             {
-            	// dont know why we should add a delay here.
-            	if(wait)
-            	{
-                    asio::system_timer query_timer(ioc, 180s);
-                    co_await query_timer.async_wait(asio::use_awaitable);
-            	}
-            	
-                auto vecfinfo = co_await tseq.GetServerInfoDataAsync(desc_endpoint, 500ms);
-                auto fplayer = co_await tseq.GetPlayerListDataAsync(desc_endpoint, 500ms);
-
-                if (!vecfinfo.empty())
-                    log("[TSourceEngineQuery] Get TSourceEngineQuery success: ", vecfinfo[0].Map, " ", vecfinfo[0].PlayerCount, "/", vecfinfo[0].MaxPlayers);
-                else
-                    log("[TSourceEngineQuery] Get TSourceEngineQuery failed");
+                auto vecfinfo = co_await tseq.GetServerInfoDataAsync(desc_endpoint, router_config.a2s_query_timeout);
+                if (vecfinfo.empty())
+                    throw asio::system_error(asio::error::timed_out);
+                auto fplayer = co_await tseq.GetPlayerListDataAsync(desc_endpoint, router_config.a2s_query_timeout);
+
+                // players joining or leaving, or a map change: look again soon
+                const bool changed = !ServerInfoQueryResultCache || ServerInfoQueryResultCache->empty()
+                    || ServerInfoQueryResultCache->front().PlayerCount != vecfinfo[0].PlayerCount
+                    || ServerInfoQueryResultCache->front().MaxPlayers != vecfinfo[0].MaxPlayers
+                    || ServerInfoQueryResultCache->front().Map != vecfinfo[0].Map;
+                next = a2s_refresh.OnSuccess(changed, router_config.a2s_cache_fast_interval, router_config.a2s_cache_interval);
+                log_at(changed ? LogLevel::info : LogLevel::debug, "[TSourceEngineQuery] Get TSourceEngineQuery success: ", vecfinfo[0].Map, " ", vecfinfo[0].PlayerCount, "/", vecfinfo[0].MaxPlayers,
+                    ", next in ", std::chrono::duration_cast<std::chrono::milliseconds>(next).count(), "ms");
 #ifdef ENABLE_STEAM_SUPPORT
-                if (!vecfinfo.empty())
+                UpdateSteamInfoConfig(vecfinfo[0]);
+#endif
+
+                static int32_t split_id = 0;
+                const auto format = TSourceEngineQuery::SplitPacketFormatOf(vecfinfo[0]);
+                const auto now = std::chrono::system_clock::now();
+                try
                 {
-                    const auto& info = vecfinfo[0];
-                    UpdateSteamInfoConfig(info);
+                    PlayerListReplyCache = std::make_shared<const std::vector<std::string>>(TSourceEngineQuery::WritePlayerListQueryResultToPackets(fplayer, format, ++split_id));
+                }
+                catch (const std::length_error& e)
+                {
+                    log("[TSourceEngineQuery] Serialize A2S_PLAYER failed: ", e.what());
+                    PlayerListReplyCache = nullptr;
+                }
+
+                try
+                {
+                    auto frules = co_await tseq.GetRulesDataAsync(desc_endpoint, router_config.a2s_query_timeout);
+                    // the replies are prebuilt, so a timestamp instead of an age: clients see how old the table is
+                    if (auto* table = std::get_if<TSourceEngineQuery::RulesQueryResult::RuleTable_s>(&frules.Results))
+                    {
+                        const auto unix_time = std::chrono::duration_cast<std::chrono::seconds>(now.time_since_epoch()).count();
+                        table->Strings += std::string("gorouter_cache_time") + '\0' + std::to_string(unix_time) + '\0';
+                        ++table->Count;
+                    }
+                    if (frules.header2 == 'E')
+                        RulesReplyCache = std::make_shared<const std::vector<std::string>>(TSourceEngineQuery::WriteRulesQueryResultToPackets(frules, format, ++split_id));
+                }
+                catch (const asio::system_error& e)
+                {
+                    // not every server answers A2S_RULES, keep serving the last table
+                    log("[TSourceEngineQuery] Get A2S_RULES failed: ", e.what());
+                }
+                catch (const std::logic_error& e)
+                {
+                    log("[TSourceEngineQuery] Get A2S_RULES failed: ", e.what());
                 }
-#endif
 
                 ServerInfoQueryResultCache = std::move(vecfinfo);
+                ++ServerInfoCacheGeneration;
+                ServerInfoCacheTime = now;
                 PlayerListQueryResultCache = std::move(fplayer);
-
-                failed_times.store(0);
-
-                wait = true;
-                continue;
             }
             catch (const asio::system_error& e)
             {
-                failed_times.fetch_add(1);
-                log("[TSourceEngineQuery] Get TSourceEngineQuery error with retry: ", e.what());
-            	
-                wait = true;
-                continue;
+                next = a2s_refresh.OnFailure(router_config.a2s_cache_fast_interval, router_config.a2s_cache_max_backoff);
+                log_at(LogLevel::warn, "[TSourceEngineQuery] Get TSourceEngineQuery error with retry in ",
+                    std::chrono::duration_cast<std::chrono::milliseconds>(next).count(), "ms (", a2s_refresh.Failures(), " in a row, serving ",
+                    ServerInfoQueryResultCache ? std::to_string(CacheAge().count()) + "s old replies" : std::string("nothing"), "): ", e.what());
             }
+
+            // cancelled by the admin "cache refresh"
+            asio::error_code ec;
+            a2s_cache_timer.expires_after(next);
+            co_await a2s_cache_timer.async_wait(asio::redirect_error(asio::use_awaitable, ec));
+        }
+    }
+
+    std::chrono::seconds CacheAge() const
+    {
+        return std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now() - ServerInfoCacheTime);
+    }
+
+    // Stateless S2C_CHALLENGE, keyed on the address only like srcds does, so the rules reply
+    // (often several packets) cannot be reflected at a spoofed source.
+    static int32_t A2SChallenge(const udp::endpoint& endpoint)
+    {
+        static const std::uint64_t secret = (std::uint64_t(std::random_device{}()) << 32) | std::random_device{}();
+        std::uint64_t h = secret;
+        auto mix = [&h](const auto& bytes) {
+            for (auto b : bytes)
+                h = (h ^ b) * 0x100000001B3ull;
+        };
+        if (const auto address = NormalizeAddress(endpoint.address()); address.is_v4())
+            mix(address.to_v4().to_bytes());
+        else
+            mix(address.to_v6().to_bytes());
+        h ^= h >> 29;
+        const auto challenge = static_cast<int32_t>(h);
+        return challenge == -1 || challenge == 0 ? 1 : challenge;
+    }
+
+    // keeps PlayerCount/MaxPlayers of every backend fresh for SelectBackendServer
+    asio::awaitable<void> CoPollBackendServers()
+    {
+        while (true)
+        {
+            // snapshot, the list may be swapped while we are waiting on a reply
+            const auto backends = BackendServers();
+            for (const auto& backend : *backends)
+            {
+                try
+                {
+                    if (auto fill = co_await tseq.GetServerFillAsync(backend->endpoint, router_config.a2s_query_timeout))
+                        backend->UpdateFill(fill->PlayerCount, fill->MaxPlayers);
+                }
+                catch (const asio::system_error& e)
+                {
+                    log("[ServerManager] Poll ", backend->endpoint, " error: ", e.what());
+                }
+            }
+
+            asio::system_timer poll_timer(ioc, router_config.backend_poll_interval);
+            co_await poll_timer.async_wait(asio::use_awaitable);
         }
     }
 
@@ -223,8 +591,12 @@ public:
         udp::socket socket(ioc);
         try
         {
-            socket = udp::socket(ioc, udp::endpoint(asio::ip::udp::v4(), read_port));
-
+            socket = co_await CoOpenListenSocket(read_port);
+            if (const int size = router_config.socket_buffer_size; size > 0)
+            {
+                socket.set_option(asio::socket_base::receive_buffer_size(size));
+                socket.set_option(asio::socket_base::send_buffer_size(size));
+            }
         }
         catch (const std::system_error& e)
         {
@@ -232,29 +604,57 @@ public:
             co_return;
         }
 #ifdef ENABLE_STEAM_SUPPORT
-        asio::co_spawn(ioc, CoHandleSteamServer(socket, server_names, map_names, player_num), asio::detached);
+        auto steam_pump = std::make_shared<SteamServerPump>(ioc, socket);
+        asio::co_spawn(ioc, CoHandleSteamServer(socket, steam_pump, server_names, map_names, player_num), asio::detached);
 #endif
         auto read_endpoint = socket.local_endpoint();
-        /*
-        for (const auto &server : master_servers)
+        masters.Register(socket);
+        ClientManager MyClientManager(ioc, desc_endpoint, socket);
+        SourceRateLimiter a2s_limiter;
+#ifdef ENABLE_STEAM_SUPPORT
+        listeners.push_back({ &socket, &MyClientManager, &a2s_limiter, steam_pump });
+#else
+        listeners.push_back({ &socket, &MyClientManager, &a2s_limiter });
+#endif
+        if (inherited)
         {
-            auto [host, port] = ParseHostPort(server);
-            asio::co_spawn(ioc, CoHandleMasterServer(socket, host, port), asio::detached);
+            for (const auto& session : inherited->sessions)
+            {
+                if (session.listen_port != read_endpoint.port())
+                    continue;
+                if (auto protocol = SocketProtocol(session.fd))
+                {
+                    udp::socket upstream(ioc);
+                    upstream.assign(*protocol, session.fd);
+                    MyClientManager.AdoptSession(session, std::move(upstream));
+                }
+            }
         }
-        */
-        ClientManager MyClientManager(ioc, desc_endpoint, socket);
         char buffer[4096];
         int id = 0;
+        const std::vector<std::string> names(std::ranges::begin(server_names), std::ranges::end(server_names));
+        const std::vector<std::string> maps(std::ranges::begin(map_names), std::ranges::end(map_names));
+        std::shared_ptr<const std::vector<TSourceEngineQuery::ServerInfoReplyTemplate>> info_templates;
+        std::uint64_t info_templates_generation = 0;
         log("[", read_endpoint, "]", "Start");
 
         while (true)
         {
+            if (handed_off)
+            {
+                // the socket and the sessions belong to the next process now, keep ours alive until we exit
+                asio::error_code ec;
+                co_await handoff_resumed.async_wait(asio::redirect_error(asio::use_awaitable, ec));
+                continue;
+            }
             try
             {
                 ++id;
                 udp::endpoint sender_endpoint;
                 co_await socket.async_wait(socket.wait_read, asio::use_awaitable);
                 std::size_t n = co_await socket.async_receive_from(asio::buffer(buffer), sender_endpoint, asio::use_awaitable);
+                traffic_sources.Record(sender_endpoint, n);
+                packet_capture.Record(CaptureDirection::FromClient, sender_endpoint, read_endpoint, buffer, n);
 
                 if (IsChallengePacket(buffer, n))
                 {
@@ -270,48 +670,51 @@ public:
                     if (IsValidInitialPacket(buffer, n))
                     {
 #ifdef ENABLE_STEAM_SUPPORT
-                    	if(SteamGameServer()->BLoggedOn() && !IsTSourceEngineQueryPacket(buffer, n) && !IsPlayerListQueryPacket(buffer, n))
+                        // the Steam GameServer API is IPv4 only
+                        const auto from = NormalizeAddress(sender_endpoint.address());
+                    	if(from.is_v4() && SteamGameServer()->BLoggedOn() && !IsTSourceEngineQueryPacket(buffer, n) && !IsPlayerListQueryPacket(buffer, n) && !IsRulesQueryPacket(buffer, n))
                         {
-                            auto fromip = sender_endpoint.address().to_v4().to_uint();
+                            auto fromip = from.to_v4().to_uint();
                             auto port = sender_endpoint.port();
                             SteamGameServer()->HandleIncomingPacket(buffer, n, fromip, port);
+                            steam_pump->Poke();
                         }
 #endif
+                        if ((IsTSourceEngineQueryPacket(buffer, n) || IsPlayerListQueryPacket(buffer, n) || IsRulesQueryPacket(buffer, n) || IsPingPacket(buffer, n))
+                            && !a2s_limiter.Allow(sender_endpoint))
+                            continue;
                         if (IsTSourceEngineQueryPacket(buffer, n))
                         {
                             if (ServerInfoQueryResultCache.has_value()) {
-                                auto vecfinfo = ServerInfoQueryResultCache.value();
-                                char send_buffer[4096];
-                                for (auto finfo : vecfinfo)
+                                if (info_templates_generation != ServerInfoCacheGeneration)
                                 {
-                                    //finfo.PlayerCount = 233;
-                                    std::size_t len;
-                                    co_await socket.async_wait(socket.wait_write, asio::use_awaitable);
-
-                                    std::ostringstream oss;
-                                    oss << read_endpoint;
-                                    finfo.LocalAddress = oss.str();
-                                    finfo.Port = read_endpoint.port();
-
-                                    static std::random_device rd;
-                                    //if (!std::uniform_int_distribution<std::size_t>(0, 10)(rd))
-                                	if(auto size = std::ranges::distance(server_names))
+                                    // only rebuilt when the cache changes, per request we just pick slots
+                                    auto templates = std::make_shared<std::vector<TSourceEngineQuery::ServerInfoReplyTemplate>>();
+                                    for (auto finfo : ServerInfoQueryResultCache.value())
                                     {
-                                        auto& str = server_names[std::uniform_int_distribution<std::size_t>(0, size - 1)(rd)];
-                                        finfo.ServerName = str;
-                                    }
-                                	if(auto size = std::ranges::distance(map_names))
-                                    {
-                                        auto& str = map_names[std::uniform_int_distribution<std::size_t>(0, size - 1)(rd)];
-                                        finfo.Map = str;
+                                        std::ostringstream oss;
+                                        oss << read_endpoint;
+                                        finfo.LocalAddress = oss.str();
+                                        finfo.Port = read_endpoint.port();
+                                        if (player_num >= 0 && player_num <= finfo.MaxPlayers)
+                                            finfo.PlayerCount = player_num;
+                                        templates->push_back(TSourceEngineQuery::MakeServerInfoReplyTemplate(finfo, names, maps));
                                     }
+                                    info_templates = std::move(templates);
+                                    info_templates_generation = ServerInfoCacheGeneration;
+                                }
 
-                                    finfo.VAC = id % 2;
-                                    if (player_num >= 0 && player_num <= finfo.MaxPlayers)
-                                        finfo.PlayerCount = player_num;
+                                // hold a reference, the templates may be rebuilt while we are sending
+                                auto templates = info_templates;
+                                static std::random_device rd;
+                                for (const auto& reply : *templates)
+                                {
+                                    const auto name = std::uniform_int_distribution<std::size_t>(0, reply.ServerNames.size() - 1)(rd);
+                                    const auto map = std::uniform_int_distribution<std::size_t>(0, reply.Maps.size() - 1)(rd);
+                                    const std::uint8_t vac = id % 2;
 
-                                    len = TSourceEngineQuery::WriteServerInfoQueryResultToBuffer(finfo, send_buffer, sizeof(buffer));
-                                    co_await socket.async_send_to(asio::const_buffer(send_buffer, len), sender_endpoint, asio::use_awaitable);
+                                    co_await socket.async_wait(socket.wait_write, asio::use_awaitable);
+                                    co_await socket.async_send_to(reply.Buffers(name, map, vac), sender_endpoint, asio::use_awaitable);
 
                                     if (buffer[4] == 'd')
                                         log("[", read_endpoint, "]", "Reply package #", id, " details to ", sender_endpoint);
@@ -322,12 +725,14 @@ public:
                         }
                         else if (IsPlayerListQueryPacket(buffer, n))
                         {
-                            if (PlayerListQueryResultCache.has_value()) {
-                                auto fplayer = PlayerListQueryResultCache.value();
-                                char send_buffer[4096];
-                                std::size_t len = TSourceEngineQuery::WritePlayerListQueryResultToBuffer(fplayer, send_buffer, sizeof(buffer));
-                                co_await socket.async_wait(socket.wait_write, asio::use_awaitable);
-                                std::size_t bytes_transferred = co_await socket.async_send_to(asio::const_buffer(send_buffer, len), sender_endpoint, asio::use_awaitable);
+                            if (PlayerListReplyCache) {
+                                // hold a reference, the cache may be swapped while we are sending
+                                auto packets = PlayerListReplyCache;
+                                for (const auto& packet : *packets)
+                                {
+                                    co_await socket.async_wait(socket.wait_write, asio::use_awaitable);
+                                    co_await socket.async_send_to(asio::buffer(packet), sender_endpoint, asio::use_awaitable);
+                                }
                                 log("[", read_endpoint, "]", "Reply package #", id, " A2S_PLAYERS to ", sender_endpoint);
                             }
                         }
@@ -336,16 +741,43 @@ public:
                         {
                             // connect packet
                             cd = MyClientManager.AcceptClient(ioc, sender_endpoint);
-                            const std::string response = "\xFF\xFF\xFF\xFF" "L" + std::string(desc_host) + ":" + std::to_string(desc_endpoint.port());
+                            const std::string response = "\xFF\xFF\xFF\xFF" "L" + router_config.desc_host + ":" + std::to_string(desc_endpoint.port());
                             std::size_t bytes_transferred = co_await socket.async_send_to(asio::buffer(response, sizeof(response)), sender_endpoint, asio::use_awaitable);
                             log("[", read_endpoint, "]", "Reply package #", id, " redirect to ", sender_endpoint);
                         }
                         */
+                        else if (IsRulesQueryPacket(buffer, n))
+                        {
+                            int32_t challenge = -1;
+                            if (n >= 9)
+                                std::memcpy(&challenge, buffer + 5, sizeof(challenge));
+
+                            if (const int32_t expected = A2SChallenge(sender_endpoint); challenge != expected)
+                            {
+                                char response[9] = "\xFF\xFF\xFF\xFF" "A";
+                                std::memcpy(response + 5, &expected, sizeof(expected));
+                                co_await socket.async_send_to(asio::buffer(response), sender_endpoint, asio::use_awaitable);
+                            }
+                            else if (RulesReplyCache)
+                            {
+                                auto packets = RulesReplyCache;
+                                for (const auto& packet : *packets)
+                                {
+                                    co_await socket.async_wait(socket.wait_write, asio::use_awaitable);
+                                    co_await socket.async_send_to(asio::buffer(packet), sender_endpoint, asio::use_awaitable);
+                                }
+                                log("[", read_endpoint, "]", "Reply package #", id, " A2S_RULES to ", sender_endpoint);
+                            }
+                        }
                         else if (IsPingPacket(buffer, n))
                         {
                             constexpr const char response[] = "\xFF\xFF\xFF\xFF" "j\r\n";
                             std::size_t bytes_transferred = co_await socket.async_send_to(asio::buffer(response, sizeof(response)), sender_endpoint, asio::use_awaitable);
                         }
+                        else if (IsMasterChallengePacket(buffer, n) && co_await masters.OnChallenge(socket, sender_endpoint, buffer, n))
+                        {
+                            // heartbeat sent
+                        }
                         else if (IsServerListResPacket(buffer, n) && false)
                         {
                             // ignored
@@ -374,7 +806,10 @@ public:
                 if (e.code() == asio::error::connection_aborted) // 10053
                     continue;
 
-                log("[", read_endpoint, "]", "Error with retry: ", e.what());
+                if (e.code() == asio::error::operation_aborted) // handed off
+                    continue;
+
+                log_at(LogLevel::warn, "[", read_endpoint, "]", "Error with retry: ", e.what());
                 continue;
             }
         }
@@ -441,11 +876,13 @@ public:
     };
 
     template<std::ranges::random_access_range ServerNames, std::ranges::random_access_range MapNames>
-    asio::awaitable<void> CoHandleSteamServer(udp::socket &socket, ServerNames server_names, MapNames map_names, int player_num)
+    asio::awaitable<void> CoHandleSteamServer(udp::socket &socket, std::shared_ptr<SteamServerPump> pump, ServerNames server_names, MapNames map_names, int player_num)
     {
         auto steam_port = 26900;
         auto game_endpoint = socket.local_endpoint();
-        if(!SteamGameServer_Init(game_endpoint.address().to_v4().to_uint(), steam_port, game_endpoint.port(), 0xFFFFu, eServerModeAuthenticationAndSecure, "1.1.2.7"))
+        // [::] of a dual-stack socket binds Steam to any v4 address as well
+        const auto game_address = NormalizeAddress(game_endpoint.address());
+        if(!SteamGameServer_Init(game_address.is_v4() ? game_address.to_v4().to_uint() : 0, steam_port, game_endpoint.port(), 0xFFFFu, eServerModeAuthenticationAndSecure, "1.1.2.7"))
         {
             log("[Steam] ", "Unable to initialize Steam.");
             co_return;
@@ -454,30 +891,6 @@ public:
         CSteam3Server steamsrv;
     	
         using namespace std::chrono_literals;
-        // send
-        asio::co_spawn(ioc, [&ioc = this->ioc, &socket]()->asio::awaitable<void> {
-            try {
-                while (1) {
-                    asio::system_timer ddl(ioc, std::chrono::duration_cast<std::chrono::system_clock::duration>(0.01s));
-                    co_await ddl.async_wait(asio::use_awaitable);
-
-                    uint16 port = 0;
-                    uint32 ip = 0;
-                    char buffer[4096];
-                    int iLen = SteamGameServer()->GetNextOutgoingPacket(buffer, sizeof(buffer), &ip, &port);
-                    while (iLen > 0) {
-                        udp::endpoint out_endpoint(asio::ip::address_v4(ip), port);
-
-                        log("[Steam] ", " Send packet to ", out_endpoint, " size=", iLen);
-                        co_await socket.async_send_to(asio::const_buffer(buffer, iLen), out_endpoint, asio::use_awaitable);
-
-                        iLen = SteamGameServer()->GetNextOutgoingPacket(buffer, sizeof(buffer), &ip, &port);
-                    }
-                }
-            }
-            catch (const asio::system_error& e) { co_return; } // asio::error::operation_aborted
-        }, asio::detached);
-
         // wait for server info
         while (!ServerInfoQueryResultCache.has_value())  {
             asio::system_timer ddl(ioc, std::chrono::duration_cast<std::chrono::system_clock::duration>(1s));
@@ -511,15 +924,8 @@ public:
             //SteamGameServer()->SendUserDisconnect(steamid);
     	}
 
-        try {
-            while (1) {
-
-                asio::system_timer ddl(ioc, std::chrono::duration_cast<std::chrono::system_clock::duration>(0.1s));
-                co_await ddl.async_wait(asio::use_awaitable);
-                SteamGameServer_RunCallbacks();
-            }
-        }
-        catch (const asio::system_error& e) { co_return; } // asio::error::operation_aborted
+        // callbacks and outgoing packets, steamsrv has to stay alive while this runs
+        co_await pump->Run(*SteamGameServer(), [] { SteamGameServer_RunCallbacks(); });
     	
         SteamGameServer()->EnableHeartbeats(false);
         SteamGameServer()->LogOff();
@@ -541,15 +947,31 @@ public:
 int main(int argc, char *argv[])
 {
     auto spsv = std::span<char *>(argv, argc) | std::ranges::views::transform([](const char* arg) { return std::string_view(arg); });
-    auto ports = GetPortsFromArgs(spsv);
-    auto dest_port = 6666;
-	auto server_names = GetMultiArgs("+hostname", spsv);
-    auto map_names = GetMultiArgs("+map", spsv);
-    int player_num = GetPlayerNum(spsv);
+    if (std::ranges::find(spsv, "-help") != spsv.end())
+    {
+        log("usage: ", argv[0], " [-config file.ini] [options], every option is also a key in the config file:");
+        ConfigLoader::Usage();
+        return 0;
+    }
+    ConfigLoader().LoadArgs(spsv);
+    auto ports = router_config.ports;
+    ports.insert(ports.end(), router_config.ephemeral_ports, 0);
+    if (ports.empty())
+        ports.push_back(27015);
+    ConfigLoader::Dump();
+
+    packet_capture.Enable(capture_packets, capture_snaplen, capture_sample);
+
     asio::io_context ioc;
     Citrus app(ioc);
-    app.CoSpawn(ports, dest_port, server_names, map_names, player_num);
+    // before binding anything, a running router hands over its sockets
+    if (auto state = ReceiveHandoff())
+    {
+        ports = MergeInheritedPorts(std::move(ports), *state);
+        app.Inherit(std::move(*state));
+    }
+    app.CoSpawn(ports, router_config.dest_port, router_config.server_names, router_config.map_names, router_config.player_num);
 
     ioc.run();
     return 0;
-}
\ No newline at end of file
+}
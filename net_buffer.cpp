@@ -17,45 +17,67 @@ GNU General Public License for more details.
 
 #include <cmath>
 #include <cstdio>
+#include <cstring>
 
 //#define DEBUG_NET_MESSAGES_SEND
 //#define DEBUG_NET_MESSAGES_READ
 
-// precalculated bit masks for WriteUBitLong.
-// Using these tables instead of doing the calculations
-// gives a 33% speedup in WriteUBitLong.
-static thread_local std::uint32_t	BitWriteMasks[32][33];
-static thread_local std::uint32_t	ExtraMasks[32];
+#if defined( __BMI2__ )
+#include <immintrin.h>
+#endif
 
 #define BIT( n )		( 1U << ( n ))
 
-short MSG_BigShort( short swap )
+// lowest n bits set, n <= 32. No mask tables: one shift, or bzhi where BMI2 is available.
+static inline std::uint64_t MSG_LowBits( int n )
 {
-	return (swap >> 8)|(swap << 8);
+#if defined( __BMI2__ )
+	return _bzhi_u64( ~0ULL, n );
+#else
+	return ( 1ULL << n ) - 1;
+#endif
 }
 
-void MSG_InitMasks( void )
+// Any bit field of up to 32 bits lies within 5 bytes starting at its first byte, so every read or
+// write is a single 64-bit window (little-endian, like the rest of the wire code). The window is
+// loaded with one 8-byte copy when the buffer is long enough and byte by byte near its end.
+static inline std::uint64_t MSG_LoadWindow( const sizebuf_t *sb, int iByte, int nBytes )
 {
-	std::uint32_t	startbit, endbit;
-	std::uint32_t	maskBit, nBitsLeft;
+	std::uint64_t window = 0;
 
-	for( startbit = 0; startbit < 32; startbit++ )
+	if( iByte + 8 <= BitByte( sb->nDataBits ))
 	{
-		for( nBitsLeft = 0; nBitsLeft < 33; nBitsLeft++ )
-		{
-			endbit = startbit + nBitsLeft;
+		memcpy( &window, sb->pData + iByte, 8 );
+		return window;
+	}
 
-			BitWriteMasks[startbit][nBitsLeft] = (std::uint32_t)BIT( startbit ) - 1;
-			if( endbit < 32 ) BitWriteMasks[startbit][nBitsLeft] |= ~((std::uint32_t)BIT( endbit ) - 1 );
-		}
+	for( int i = 0; i < nBytes; i++ )
+		window |= (std::uint64_t)sb->pData[iByte + i] << ( i << 3 );
+	return window;
+}
+
+static inline void MSG_StoreWindow( sizebuf_t *sb, int iByte, int nBytes, std::uint64_t window )
+{
+	if( iByte + 8 <= BitByte( sb->nDataBits ))
+	{
+		memcpy( sb->pData + iByte, &window, 8 );
+		return;
 	}
 
-	for( maskBit = 0; maskBit < 32; maskBit++ )
-		ExtraMasks[maskBit] = (std::uint32_t)BIT( maskBit ) - 1;
+	for( int i = 0; i < nBytes; i++ )
+		sb->pData[iByte + i] = (std::uint8_t)( window >> ( i << 3 ));
+}
+
+short MSG_BigShort( short swap )
+{
+	return (swap >> 8)|(swap << 8);
+}
+
+void MSG_InitMasks( void )
+{
+	// nothing to precalculate anymore, kept for API compatibility
 }
 
-static thread_local bool initialized = (MSG_InitMasks(), true);
- 
 void MSG_InitExt( sizebuf_t *sb, const char *pDebugName, void *pData, int nBytes, int nMaxBits )
 {
 	MSG_StartWriting( sb, pData, nBytes, 0, nMaxBits );
@@ -161,35 +183,55 @@ void MSG_WriteUBitLong( sizebuf_t *sb, std::uint32_t curData, int numbits )
 		sb->bOverflow = true;
 		sb->iCurBit = sb->nDataBits;
 	}
-	else
+	else if( numbits )
 	{
-		int	nBitsLeft = numbits;
-		int	iCurBit = sb->iCurBit;
-		std::uint32_t	iDWord = iCurBit >> 5;	// Mask in a std::uint32_t.
-		std::uint32_t	iCurBitMasked;
-		int	nBitsWritten;
+		int	iByte = sb->iCurBit >> 3;
+		int	iShift = sb->iCurBit & 7;
+		int	nBytes = ( iShift + numbits + 7 ) >> 3;
+		std::uint64_t	mask = MSG_LowBits( numbits ) << iShift;
+		std::uint64_t	window = MSG_LoadWindow( sb, iByte, nBytes );
 
-		assert(( iDWord * 4 + sizeof( int )) <= (std::uint32_t)MSG_GetMaxBytes( sb ));
+		window = ( window & ~mask ) | (((std::uint64_t)curData << iShift ) & mask );
+		MSG_StoreWindow( sb, iByte, nBytes, window );
 
-		iCurBitMasked = iCurBit & 31;
-		((std::uint32_t *)sb->pData)[iDWord] &= BitWriteMasks[iCurBitMasked][nBitsLeft];
-		((std::uint32_t *)sb->pData)[iDWord] |= curData << iCurBitMasked;
+		sb->iCurBit += numbits;
+	}
+}
 
-		// did it span a std::uint32_t?
-		nBitsWritten = 32 - iCurBitMasked;
+/*
+=======================
+MSG_WriteAlignedBits
 
-		if( nBitsWritten < nBitsLeft )
-		{
-			nBitsLeft -= nBitsWritten;
-			iCurBit += nBitsWritten;
-			curData >>= nBitsWritten;
+fast path for whole bytes on a byte boundary, plain stores
+instead of the masked dword read-modify-write.
+returns false if the buffer is not byte aligned
+=======================
+*/
+static bool MSG_WriteAlignedBits( sizebuf_t *sb, std::uint32_t curData, int nBytes )
+{
+	if( sb->iCurBit & 7 )
+		return false;
 
-			iCurBitMasked = iCurBit & 31;
-			((std::uint32_t *)sb->pData)[iDWord+1] &= BitWriteMasks[iCurBitMasked][nBitsLeft];
-			((std::uint32_t *)sb->pData)[iDWord+1] |= curData << iCurBitMasked;
-		}
-		sb->iCurBit += numbits;
+	if(( sb->iCurBit + ( nBytes << 3 )) > sb->nDataBits )
+	{
+		sb->bOverflow = true;
+		sb->iCurBit = sb->nDataBits;
+		return true;
 	}
+
+	std::uint8_t *pOut = sb->pData + ( sb->iCurBit >> 3 );
+	for( int i = 0; i < nBytes; i++ )
+		pOut[i] = (std::uint8_t)( curData >> ( i << 3 ));
+	sb->iCurBit += nBytes << 3;
+	return true;
+}
+
+// the bit pattern MSG_WriteSBitLong produces: value bits first, sign bit on top
+static std::uint32_t MSG_SignedBits( int data, int numbits )
+{
+	std::uint32_t bits = (std::uint32_t)data & ( BIT( numbits - 1 ) - 1 );
+	if( data < 0 ) bits |= BIT( numbits - 1 );
+	return bits;
 }
 
 /*
@@ -230,6 +272,13 @@ bool MSG_WriteBits( sizebuf_t *sb, const void *pData, int nBits )
 	std::uint8_t	*pOut = (std::uint8_t *)pData;
 	int	nBitsLeft = nBits;
 
+	if(!( sb->iCurBit & 7 ) && !( nBits & 7 ) && ( sb->iCurBit + nBits ) <= sb->nDataBits )
+	{
+		memcpy( sb->pData + ( sb->iCurBit >> 3 ), pData, nBits >> 3 );
+		sb->iCurBit += nBits;
+		return !sb->bOverflow;
+	}
+
 	// get output std::uint32_t-aligned.
 	while((reinterpret_cast<std::uintptr_t>(pOut) & 3 ) != 0 && nBitsLeft >= 8 )
 	{
@@ -316,32 +365,38 @@ void MSG_WriteBitFloat( sizebuf_t *sb, float val )
 
 void MSG_WriteChar( sizebuf_t *sb, int val )
 {
-	MSG_WriteSBitLong( sb, val, sizeof( char ) << 3 );
+	if( !MSG_WriteAlignedBits( sb, MSG_SignedBits( val, sizeof( char ) << 3 ), sizeof( char )))
+		MSG_WriteSBitLong( sb, val, sizeof( char ) << 3 );
 }
 
 void MSG_WriteByte( sizebuf_t *sb, int val )
 {
-	MSG_WriteUBitLong( sb, val, sizeof( std::uint8_t ) << 3 );
+	if( !MSG_WriteAlignedBits( sb, (std::uint32_t)val, sizeof( std::uint8_t )))
+		MSG_WriteUBitLong( sb, val, sizeof( std::uint8_t ) << 3 );
 }
 
 void MSG_WriteShort( sizebuf_t *sb, int val )
 {
-	MSG_WriteSBitLong( sb, val, sizeof(short ) << 3 );
+	if( !MSG_WriteAlignedBits( sb, MSG_SignedBits( val, sizeof( short ) << 3 ), sizeof( short )))
+		MSG_WriteSBitLong( sb, val, sizeof( short ) << 3 );
 }
 
 void MSG_WriteWord( sizebuf_t *sb, int val )
 {
-	MSG_WriteUBitLong( sb, val, sizeof( std::uint16_t ) << 3 );
+	if( !MSG_WriteAlignedBits( sb, (std::uint32_t)val, sizeof( std::uint16_t )))
+		MSG_WriteUBitLong( sb, val, sizeof( std::uint16_t ) << 3 );
 }
 
 void MSG_WriteLong( sizebuf_t *sb, int val )
 {
-	MSG_WriteSBitLong( sb, val, sizeof( int ) << 3 );
+	if( !MSG_WriteAlignedBits( sb, MSG_SignedBits( val, sizeof( int ) << 3 ), sizeof( int )))
+		MSG_WriteSBitLong( sb, val, sizeof( int ) << 3 );
 }
 
 void MSG_WriteDword( sizebuf_t *sb, std::uint32_t val )
 {
-	MSG_WriteUBitLong( sb, val, sizeof( std::uint32_t ) << 3 );
+	if( !MSG_WriteAlignedBits( sb, val, sizeof( std::uint32_t )))
+		MSG_WriteUBitLong( sb, val, sizeof( std::uint32_t ) << 3 );
 }
 
 void MSG_WriteFloat( sizebuf_t *sb, float val )
@@ -356,6 +411,18 @@ bool MSG_WriteBytes( sizebuf_t *sb, const void *pBuf, int nBytes )
 
 bool MSG_WriteString( sizebuf_t *sb, const char *pStr )
 {
+	if( pStr && !( sb->iCurBit & 7 ))
+	{
+		int nBytes = (int)strlen( pStr ) + 1;
+
+		if(( sb->iCurBit + ( nBytes << 3 )) <= sb->nDataBits )
+		{
+			memcpy( sb->pData + ( sb->iCurBit >> 3 ), pStr, nBytes );
+			sb->iCurBit += nBytes << 3;
+			return !sb->bOverflow;
+		}
+	}
+
 	if( pStr )
 	{
 		do
@@ -382,8 +449,8 @@ int MSG_ReadOneBit( sizebuf_t *sb )
 
 std::uint32_t MSG_ReadUBitLong( sizebuf_t *sb, int numbits )
 {
-	int	idword1;
-	std::uint32_t	dword1, ret;
+	int	iByte, iShift;
+	std::uint64_t	window;
 
 	if (numbits == 8)
 	{
@@ -402,30 +469,16 @@ std::uint32_t MSG_ReadUBitLong( sizebuf_t *sb, int numbits )
 
 	assert(numbits > 0 && numbits <= 32);
 
-	// Read the current dword.
-	idword1 = sb->iCurBit >> 5;
-	dword1 = ((std::uint32_t*)sb->pData)[idword1];
-	dword1 >>= (sb->iCurBit & 31);	// get the bits we're interested in.
+	iByte = sb->iCurBit >> 3;
+	iShift = sb->iCurBit & 7;
+	window = MSG_LoadWindow(sb, iByte, (iShift + numbits + 7) >> 3);
 
 	sb->iCurBit += numbits;
-	ret = dword1;
-
-	// Does it span this dword?
-	if ((sb->iCurBit - 1) >> 5 == idword1)
-	{
-		if (numbits != 32)
-			ret &= ExtraMasks[numbits];
-	}
-	else
-	{
-		int	nExtraBits = sb->iCurBit & 31;
-		std::uint32_t	dword2 = ((std::uint32_t*)sb->pData)[idword1 + 1] & ExtraMasks[nExtraBits];
-
-		// no need to mask since we hit the end of the dword.
-		// shift the second dword's part into the high bits.
-		ret |= (dword2 << (numbits - nExtraBits));
-	}
-	return ret;
+#if defined( __BMI2__ )
+	return (std::uint32_t)_bzhi_u64(window >> iShift, numbits);
+#else
+	return (std::uint32_t)((window >> iShift) & MSG_LowBits(numbits));
+#endif
 }
 
 float MSG_ReadBitFloat( sizebuf_t *sb )
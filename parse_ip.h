@@ -2,27 +2,200 @@
 
 #include <utility>
 #include <string>
-#include <regex>
+#include <string_view>
+#include <optional>
 
-std::pair<std::string, std::string> ParseHostPort(const std::string& msg) {
-    static std::regex r1(R"((^[0-9a-zA-Z]+[0-9a-zA-Z\.-]*\.[a-zA-Z]{2,4}):*(\d+)*)");
-    static std::regex r2(
-        R"((?:(?:25[0-5]|2[0-4]\d|((1\d{2})|([1-9]?\d)))\.){3}(?:25[0-5]|2[0-4]\d|((1\d{2})|([1-9]?\d)))(:\d+)*)");
+struct HostPort
+{
+    std::string_view host; // IPv6 without the brackets
+    std::string_view port; // empty when not given
+};
 
-    std::pair<std::string, std::string> ret{ {}, "27015" };
-    auto& [host, port] = ret;
+namespace parse_ip_detail
+{
+    constexpr bool IsDigit(char c) { return c >= '0' && c <= '9'; }
+    constexpr bool IsAlpha(char c) { return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z'); }
+    constexpr bool IsHex(char c) { return IsDigit(c) || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F'); }
+
+    constexpr bool IsPort(std::string_view sv)
+    {
+        if (sv.empty() || sv.size() > 5)
+            return false;
+        unsigned value = 0;
+        for (char c : sv)
+        {
+            if (!IsDigit(c))
+                return false;
+            value = value * 10 + (c - '0');
+        }
+        return value > 0 && value <= 65535;
+    }
+
+    // dotted quad, no leading zeros
+    constexpr bool IsIPv4(std::string_view sv)
+    {
+        int octets = 0;
+        while (true)
+        {
+            const auto dot = sv.find('.');
+            const auto octet = sv.substr(0, dot);
+            if (octet.empty() || octet.size() > 3 || (octet.size() > 1 && octet[0] == '0'))
+                return false;
+            unsigned value = 0;
+            for (char c : octet)
+            {
+                if (!IsDigit(c))
+                    return false;
+                value = value * 10 + (c - '0');
+            }
+            if (value > 255)
+                return false;
+            ++octets;
+            if (dot == std::string_view::npos)
+                return octets == 4;
+            sv.remove_prefix(dot + 1);
+        }
+    }
+
+    // hex groups and at most one "::", optionally ending in a dotted quad
+    constexpr bool IsIPv6(std::string_view sv)
+    {
+        if (sv.size() < 2 || sv.size() > 45)
+            return false;
+        int groups = 0;
+        bool compressed = false;
+        if (sv.substr(0, 2) == "::")
+        {
+            compressed = true;
+            sv.remove_prefix(2);
+        }
+        while (!sv.empty())
+        {
+            const auto colon = sv.find(':');
+            const auto group = sv.substr(0, colon);
+            if (colon == std::string_view::npos && group.find('.') != std::string_view::npos)
+                return IsIPv4(group) && groups + 2 <= (compressed ? 7 : 8) && (compressed || groups + 2 == 8);
+            if (group.empty() || group.size() > 4)
+                return false;
+            for (char c : group)
+                if (!IsHex(c))
+                    return false;
+            ++groups;
+            if (colon == std::string_view::npos)
+                break;
+            sv.remove_prefix(colon + 1);
+            if (!sv.empty() && sv[0] == ':')
+            {
+                if (compressed)
+                    return false;
+                compressed = true;
+                sv.remove_prefix(1);
+            }
+            else if (sv.empty())
+                return false; // trailing single ':'
+        }
+        return compressed ? groups <= 7 : groups == 8;
+    }
 
-    if (std::smatch sm; std::regex_match(msg, sm, r1) && sm.size() > 2) {
-        // host:port, host, port
-        host = sm[1].str();
-        if (sm[2].str().size()) port = sm[2].str();
+    // RFC 1123 labels; an all-numeric name has to be a valid IPv4 address
+    constexpr bool IsHostname(std::string_view sv)
+    {
+        if (sv.empty() || sv.size() > 253)
+            return false;
+        bool numeric = true;
+        std::size_t label = 0;
+        for (std::size_t i = 0; i < sv.size(); ++i)
+        {
+            const char c = sv[i];
+            if (c == '.')
+            {
+                if (!label || sv[i - 1] == '-')
+                    return false;
+                label = 0;
+                continue;
+            }
+            if (!IsDigit(c) && !IsAlpha(c) && c != '-')
+                return false;
+            if (c == '-' && !label)
+                return false;
+            if (!IsDigit(c))
+                numeric = false;
+            if (++label > 63)
+                return false;
+        }
+        if (!label || sv.back() == '-')
+            return false;
+        return !numeric || IsIPv4(sv);
     }
-    else if (std::smatch sm; std::regex_match(msg, sm, r2) && sm.size() > 2) {
-        // ip:port, ...
-        const auto adr = sm[0].str();
-        auto iter = std::find(adr.begin(), adr.end(), ':');
-        host.assign(adr.begin(), iter);
-        if (iter != adr.end()) port.assign(iter + 1, adr.end());
+}
+
+// "host", "host:port", "1.2.3.4:port", "[::1]:port" or a bare IPv6 literal; no allocation, usable in constant expressions
+constexpr std::optional<HostPort> ParseHostPortView(std::string_view msg)
+{
+    using namespace parse_ip_detail;
+    if (!msg.empty() && msg[0] == '[')
+    {
+        const auto close = msg.find(']');
+        if (close == std::string_view::npos || !IsIPv6(msg.substr(1, close - 1)))
+            return std::nullopt;
+        const auto rest = msg.substr(close + 1);
+        if (rest.empty())
+            return HostPort{ msg.substr(1, close - 1), {} };
+        if (rest[0] != ':' || !IsPort(rest.substr(1)))
+            return std::nullopt;
+        return HostPort{ msg.substr(1, close - 1), rest.substr(1) };
+    }
+
+    const auto colon = msg.find(':');
+    if (colon != std::string_view::npos && msg.find(':', colon + 1) != std::string_view::npos)
+    {
+        // more than one ':' can only be an IPv6 address without a port
+        if (!IsIPv6(msg))
+            return std::nullopt;
+        return HostPort{ msg, {} };
+    }
+
+    const auto host = msg.substr(0, colon);
+    if (!IsHostname(host))
+        return std::nullopt;
+    if (colon == std::string_view::npos)
+        return HostPort{ host, {} };
+    if (!IsPort(msg.substr(colon + 1)))
+        return std::nullopt;
+    return HostPort{ host, msg.substr(colon + 1) };
+}
+
+static_assert(ParseHostPortView("hl1master.steampowered.com:27010")->host == "hl1master.steampowered.com");
+static_assert(ParseHostPortView("hl1master.steampowered.com:27010")->port == "27010");
+static_assert(ParseHostPortView("z4.moemod.com")->port.empty());
+static_assert(ParseHostPortView("master.example.network:27010")->host == "master.example.network");
+static_assert(ParseHostPortView("localhost:6666")->host == "localhost");
+static_assert(ParseHostPortView("188.40.40.201:27010")->host == "188.40.40.201");
+static_assert(ParseHostPortView("[2001:db8::1]:27015")->host == "2001:db8::1");
+static_assert(ParseHostPortView("[::ffff:1.2.3.4]:27015")->port == "27015");
+static_assert(ParseHostPortView("[::1]")->host == "::1");
+static_assert(ParseHostPortView("fe80::1")->host == "fe80::1");
+static_assert(!ParseHostPortView(""));
+static_assert(!ParseHostPortView("256.1.1.1:27015"));
+static_assert(!ParseHostPortView("1.2.3:27015"));
+static_assert(!ParseHostPortView("host:0"));
+static_assert(!ParseHostPortView("host:65536"));
+static_assert(!ParseHostPortView("host:"));
+static_assert(!ParseHostPortView("-host.com"));
+static_assert(!ParseHostPortView("host..com"));
+static_assert(!ParseHostPortView("[2001:db8::1"));
+static_assert(!ParseHostPortView("[1:2:3:4:5:6:7:8:9]"));
+static_assert(!ParseHostPortView("1::2::3"));
+
+// empty host when msg doesn't parse, port defaults to 27015
+inline std::pair<std::string, std::string> ParseHostPort(std::string_view msg)
+{
+    std::pair<std::string, std::string> ret{ {}, "27015" };
+    if (auto hp = ParseHostPortView(msg))
+    {
+        ret.first = hp->host;
+        if (!hp->port.empty())
+            ret.second = hp->port;
     }
     return ret;
-}
\ No newline at end of file
+}
@@ -16,13 +16,19 @@
 //  parsemsg.h
 //
 
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+
 #define ASSERT( x )
 
 class BufferReader
 {
 public:
     BufferReader(const char *name, const void *buf, int size) :
-            m_szMsgName(name), m_pBuf((uint8_t*)buf), m_iSize(size), m_iRead(0), m_bBad(false) {}
+            m_szMsgName(name), m_pBuf((uint8_t*)buf), m_iSize(size), m_iRead(0), m_bBad(false), m_bTruncated(false) {}
     BufferReader(const void *buf, int size) : BufferReader("not set", buf, size) {}
 
 
@@ -33,19 +39,27 @@ public:
     int16_t ReadShort(void);
     int16_t ReadWord(void);
     int32_t ReadLong(void); // no mistake here, we assume that long is 32 bit.
-    char *ReadString(void);
+    std::string_view ReadString(void);
     float ReadFloat(void);
     float ReadCoord(void);
     float ReadAngle(void);
     float ReadHiResAngle(void);
     bool Eof() const { return m_iRead >= m_iSize; }
 
+    // view into the source buffer, only valid as long as the buffer is.
+    // a missing terminator returns the rest of the buffer and marks the reader truncated (and bad).
+    std::string_view ReadStringView(void);
+    bool Bad() const { return m_bBad; }
+    bool Truncated() const { return m_bTruncated; }
+    size_t Remaining() const { return m_iRead < m_iSize ? m_iSize - m_iRead : 0; }
+
 private:
     const char *m_szMsgName;
     uint8_t *m_pBuf;
     size_t   m_iSize;
     size_t   m_iRead;
     bool     m_bBad;
+    bool     m_bTruncated;
 };
 
 template<typename T>
@@ -66,44 +80,38 @@ inline T BufferReader::Read(void)
     if (sizeof(T) == 1)
         return m_pBuf[m_iRead++];
 
-    T t = *(T*)(m_pBuf + m_iRead);
+    T t;
+    memcpy(&t, m_pBuf + m_iRead, sizeof(T));
     m_iRead += sizeof(T);
 
     return t;
 }
 
 
-template<>
-inline char* BufferReader::Read(void)
+inline std::string_view BufferReader::ReadStringView(void)
 {
-    static char string[2048];
-
     if (m_bBad)
-        return (char*)""; // do not return NULL, may break strcpy's
+        return {};
 
-    size_t l;
-    for (l = 0; l < sizeof(string) - 1; l++)
+    const size_t left = Remaining();
+    const char *begin = (const char *)(m_pBuf + m_iRead);
+    const char *terminator = (const char *)memchr(begin, 0, left);
+    if (!terminator)
     {
-        if (m_iRead > m_iSize)
-            break;
-
-        int8_t c = ReadChar();
-        if (c == -1 || c == 0)
-            break;
-
-        string[l] = c;
+        m_iRead = m_iSize;
+        m_bBad = true;
+        m_bTruncated = true;
+        return std::string_view(begin, left);
     }
 
-    string[l] = 0;
-
-    return string;
-
+    m_iRead += terminator - begin + 1;
+    return std::string_view(begin, terminator - begin);
 }
 
 template<>
-inline const char * BufferReader::Read(void)
+inline std::string_view BufferReader::Read(void)
 {
-    return Read<char *>();
+    return ReadStringView();
 }
 
 template<>
@@ -157,9 +165,9 @@ inline int32_t BufferReader::ReadLong(void)
     return Read<int32_t>();
 }
 
-inline char *BufferReader::ReadString(void)
+inline std::string_view BufferReader::ReadString(void)
 {
-    return Read<char*>();
+    return ReadStringView();
 }
 
 inline float BufferReader::ReadFloat(void)
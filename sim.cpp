@@ -0,0 +1,459 @@
+// gorouter-sim: local stand-ins for the internet side of the router, so the master-server and server-browser
+// paths can be exercised on one box.
+//
+//   -master <port>              fake master server: 'q' challenges, '0' heartbeats, '1' list queries answered with 'f'
+//   -storm <host:port>          server-browser storm against a router
+//     -rate <n>                 queries per second over all clients (default 1000)
+//     -clients <n>              source sockets, i.e. distinct source addresses (default 16)
+//     -duration <s>             default 10
+//     -kind info|player|rules   repeatable, default all three
+//
+// Point the router at the fake master with -master 127.0.0.1:<port>.
+
+#include <vector>
+#include <deque>
+#include <map>
+#include <array>
+#include <span>
+#include <ranges>
+#include <random>
+#include <numeric>
+#include <chrono>
+#include <cstring>
+#include <algorithm>
+#include <asio.hpp>
+#include <asio/awaitable.hpp>
+
+#include "log.hpp"
+#include "parse_args.h"
+#include "parse_ip.h"
+#include "Histogram.h"
+
+using namespace asio::ip;
+using namespace std::chrono_literals;
+
+// "\key\value\key\value" => map
+std::map<std::string, std::string, std::less<>> ParseInfoString(std::string_view sv)
+{
+    std::map<std::string, std::string, std::less<>> res;
+    while (!sv.empty() && sv[0] == '\\')
+    {
+        sv.remove_prefix(1);
+        const auto key_end = sv.find('\\');
+        if (key_end == std::string_view::npos)
+            break;
+        const auto key = sv.substr(0, key_end);
+        sv.remove_prefix(key_end + 1);
+        const auto value_end = std::min(sv.find('\\'), sv.find('\n'));
+        res[std::string(key)] = std::string(sv.substr(0, value_end));
+        sv.remove_prefix(value_end == std::string_view::npos ? sv.size() : value_end);
+    }
+    return res;
+}
+
+class FakeMaster
+{
+public:
+    static constexpr std::chrono::minutes server_timeout{ 15 };
+    static constexpr std::size_t max_packet_size = 1400;
+
+    FakeMaster(asio::io_context& ioc, unsigned short port) :
+        socket(ioc, udp::endpoint(udp::v4(), port)),
+        rng(std::random_device{}())
+    {}
+
+    asio::awaitable<void> Run()
+    {
+        log("[FakeMaster] ", "listening on ", socket.local_endpoint());
+        char buffer[2048];
+        while (true)
+        {
+            udp::endpoint sender;
+            std::size_t n;
+            try
+            {
+                n = co_await socket.async_receive_from(asio::buffer(buffer), sender, asio::use_awaitable);
+            }
+            catch (const asio::system_error& e)
+            {
+                log("[FakeMaster] ", "receive error: ", e.what());
+                continue;
+            }
+            Expire();
+
+            if (n >= 1 && buffer[0] == 'q')
+                co_await OnChallengeRequest(sender);
+            else if (n >= 2 && buffer[0] == '0' && buffer[1] == '\n')
+                OnHeartbeat(sender, std::string_view(buffer + 2, n - 2));
+            else if (n >= 2 && buffer[0] == '1')
+                co_await OnListQuery(sender, std::string_view(buffer + 2, n - 2));
+            else
+                log("[FakeMaster] ", "unknown packet from ", sender, " (", n, " bytes)");
+        }
+    }
+
+private:
+    struct Server
+    {
+        std::map<std::string, std::string, std::less<>> info;
+        std::chrono::steady_clock::time_point last_heartbeat;
+    };
+
+    asio::awaitable<void> OnChallengeRequest(const udp::endpoint& sender)
+    {
+        const std::int32_t challenge = std::uniform_int_distribution<std::int32_t>(1)(rng);
+        challenges[sender] = challenge;
+        char reply[10] = "\xFF\xFF\xFF\xFF" "s\n";
+        std::memcpy(reply + 6, &challenge, sizeof(challenge));
+        asio::error_code ec;
+        co_await socket.async_send_to(asio::buffer(reply), sender, asio::redirect_error(asio::use_awaitable, ec));
+    }
+
+    void OnHeartbeat(const udp::endpoint& sender, std::string_view infostring)
+    {
+        auto info = ParseInfoString(infostring);
+        auto challenge = challenges.find(sender);
+        auto value = info.find("challenge");
+        if (challenge == challenges.end() || value == info.end() || value->second != std::to_string(challenge->second))
+        {
+            log("[FakeMaster] ", "heartbeat from ", sender, " with a bad challenge");
+            return;
+        }
+        challenges.erase(challenge);
+        const bool known = servers.contains(sender);
+        log("[FakeMaster] ", known ? "heartbeat from " : "new server ", sender, " ", info["map"], " ", info["players"], "/", info["max"]);
+        servers[sender] = { std::move(info), std::chrono::steady_clock::now() };
+    }
+
+    // '1' region "ip:port\0" filter: every server after the seed address, 0.0.0.0:0 ends the list
+    asio::awaitable<void> OnListQuery(const udp::endpoint& sender, std::string_view query)
+    {
+        const auto seed_end = query.find('\0');
+        const auto seed = ParseHostPortView(query.substr(0, seed_end));
+        udp::endpoint after;
+        if (seed && !seed->host.empty())
+        {
+            asio::error_code ec;
+            auto address = make_address_v4(std::string(seed->host), ec);
+            if (!ec)
+                after = udp::endpoint(address, static_cast<unsigned short>(std::stoi(std::string(seed->port.empty() ? "0" : seed->port))));
+        }
+
+        std::string reply("\xFF\xFF\xFF\xFF" "f\n", 6);
+        auto iter = after == udp::endpoint() ? servers.begin() : servers.upper_bound(after);
+        for (; iter != servers.end() && reply.size() + 12 <= max_packet_size; ++iter)
+            AppendAddress(reply, iter->first);
+        if (iter == servers.end())
+            AppendAddress(reply, udp::endpoint(address_v4::any(), 0));
+        asio::error_code ec;
+        co_await socket.async_send_to(asio::buffer(reply), sender, asio::redirect_error(asio::use_awaitable, ec));
+    }
+
+    static void AppendAddress(std::string& out, const udp::endpoint& ep)
+    {
+        const auto bytes = ep.address().to_v4().to_bytes();
+        out.append(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+        out.push_back(static_cast<char>(ep.port() >> 8));
+        out.push_back(static_cast<char>(ep.port() & 0xFF));
+    }
+
+    void Expire()
+    {
+        const auto now = std::chrono::steady_clock::now();
+        std::erase_if(servers, [&](const auto& entry) {
+            if (now - entry.second.last_heartbeat < server_timeout)
+                return false;
+            log("[FakeMaster] ", "server ", entry.first, " timed out");
+            return true;
+        });
+    }
+
+    udp::socket socket;
+    std::mt19937 rng;
+    std::map<udp::endpoint, std::int32_t> challenges;
+    std::map<udp::endpoint, Server> servers;
+};
+
+// Fires A2S queries at a router from several source sockets and measures the replies. A2S has no request IDs,
+// so replies are matched to requests in order per socket and kind; anything not answered within reply_timeout is lost.
+class BrowserStorm
+{
+public:
+    enum Kind_e { Info, Player, Rules, KindCount };
+    static constexpr const char* kind_names[KindCount] = { "A2S_INFO", "A2S_PLAYER", "A2S_RULES" };
+    static constexpr std::chrono::seconds reply_timeout{ 1 };
+
+    struct Stats
+    {
+        std::uint64_t sent = 0;
+        std::uint64_t replies = 0;
+        std::uint64_t lost = 0;
+        std::uint64_t challenges = 0;
+        std::uint64_t bytes = 0;
+        Histogram latency_us;
+    };
+
+    BrowserStorm(asio::io_context& ioc, udp::endpoint target, std::vector<Kind_e> kinds) :
+        ioc(ioc),
+        target(target),
+        kinds(std::move(kinds))
+    {}
+
+    asio::awaitable<void> Run(unsigned rate, unsigned clients, std::chrono::seconds duration)
+    {
+        log("[BrowserStorm] ", rate, " queries/s from ", clients, " sockets at ", target, " for ", duration.count(), "s");
+        const auto deadline = std::chrono::steady_clock::now() + duration;
+        auto done = std::make_shared<asio::steady_timer>(ioc, asio::steady_timer::time_point::max());
+        auto pending = std::make_shared<unsigned>(clients);
+        const auto interval = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(double(clients) / std::max(rate, 1u)));
+        for (unsigned i = 0; i < clients; ++i)
+        {
+            asio::co_spawn(ioc, [this, i, clients, interval, deadline, done, pending]() -> asio::awaitable<void> {
+                co_await CoClient(i, clients, interval, deadline);
+                if (--*pending == 0)
+                    done->cancel();
+            }, asio::detached);
+        }
+        asio::error_code ec;
+        co_await done->async_wait(asio::redirect_error(asio::use_awaitable, ec));
+        Report();
+    }
+
+    const Stats& GetStats(Kind_e kind) const { return stats[kind]; }
+
+private:
+    struct Client
+    {
+        explicit Client(asio::io_context& ioc) : socket(ioc, udp::endpoint(udp::v4(), 0)) {}
+
+        udp::socket socket;
+        std::int32_t challenge = -1;
+        std::array<std::deque<std::chrono::steady_clock::time_point>, KindCount> outstanding;
+    };
+
+    static std::string Query(Kind_e kind, std::int32_t challenge)
+    {
+        if (kind == Info)
+            return std::string("\xFF\xFF\xFF\xFF" "TSource Engine Query", 25);
+        std::string query("\xFF\xFF\xFF\xFF", 4);
+        query.push_back(kind == Player ? 'U' : 'V');
+        query.append(reinterpret_cast<const char*>(&challenge), sizeof(challenge));
+        return query;
+    }
+
+    asio::awaitable<void> CoClient(unsigned index, unsigned clients, std::chrono::steady_clock::duration interval, std::chrono::steady_clock::time_point deadline)
+    {
+        auto client = std::make_shared<Client>(ioc);
+        asio::co_spawn(ioc, CoReceive(client), asio::detached);
+
+        asio::steady_timer timer(ioc);
+        // spread the clients over one interval
+        auto next = std::chrono::steady_clock::now() + interval * index / clients;
+        std::size_t turn = index;
+        while (next < deadline)
+        {
+            timer.expires_at(next);
+            co_await timer.async_wait(asio::use_awaitable);
+            next += interval;
+
+            const Kind_e kind = kinds[turn++ % kinds.size()];
+            co_await Send(*client, kind, std::chrono::steady_clock::now());
+            ExpireOutstanding(*client);
+        }
+
+        timer.expires_after(reply_timeout);
+        co_await timer.async_wait(asio::use_awaitable);
+        // anything left is older than reply_timeout now
+        for (int kind = 0; kind < KindCount; ++kind)
+        {
+            stats[kind].lost += client->outstanding[kind].size();
+            client->outstanding[kind].clear();
+        }
+        client->socket.close();
+    }
+
+    asio::awaitable<void> Send(Client& client, Kind_e kind, std::chrono::steady_clock::time_point started)
+    {
+        const std::string query = Query(kind, client.challenge);
+        asio::error_code ec;
+        co_await client.socket.async_send_to(asio::buffer(query), target, asio::redirect_error(asio::use_awaitable, ec));
+        if (ec)
+            co_return;
+        ++stats[kind].sent;
+        client.outstanding[kind].push_back(started);
+    }
+
+    void ExpireOutstanding(Client& client)
+    {
+        const auto limit = std::chrono::steady_clock::now() - reply_timeout;
+        for (int kind = 0; kind < KindCount; ++kind)
+        {
+            auto& queue = client.outstanding[kind];
+            while (!queue.empty() && queue.front() < limit)
+            {
+                queue.pop_front();
+                ++stats[kind].lost;
+            }
+        }
+    }
+
+    // reply type of a -1 packet or of the first fragment of a -2 one, 0 for the other fragments
+    static char ReplyType(const char* buffer, std::size_t n)
+    {
+        if (n >= 5 && !std::memcmp(buffer, "\xFF\xFF\xFF\xFF", 4))
+            return buffer[4];
+        if (n >= 4 && !std::memcmp(buffer, "\xFE\xFF\xFF\xFF", 4))
+        {
+            // the payload of the first fragment starts with -1 again, after a 9 (GoldSrc) or 12 (Source) byte header
+            for (std::size_t offset : { 9, 12 })
+                if (n >= offset + 5 && !std::memcmp(buffer + offset, "\xFF\xFF\xFF\xFF", 4))
+                    return buffer[offset + 4];
+        }
+        return 0;
+    }
+
+    asio::awaitable<void> CoReceive(std::shared_ptr<Client> client)
+    {
+        char buffer[4096];
+        while (client->socket.is_open())
+        {
+            udp::endpoint sender;
+            asio::error_code ec;
+            const std::size_t n = co_await client->socket.async_receive_from(asio::buffer(buffer), sender, asio::redirect_error(asio::use_awaitable, ec));
+            if (ec == asio::error::operation_aborted || ec == asio::error::bad_descriptor)
+                co_return;
+            if (ec)
+                continue;
+
+            Kind_e kind;
+            switch (ReplyType(buffer, n))
+            {
+            case 'I':
+            case 'm':
+                kind = Info;
+                break;
+            case 'D':
+                kind = Player;
+                break;
+            case 'E':
+                kind = Rules;
+                break;
+            case 'A':
+            {
+                // a player or rules query was challenged, ask again with the same start time. Which one can't be told,
+                // rules first since every server challenges those
+                if (n < 9)
+                    continue;
+                std::memcpy(&client->challenge, buffer + 5, sizeof(client->challenge));
+                auto& players = client->outstanding[Player];
+                auto& rules = client->outstanding[Rules];
+                if (players.empty() && rules.empty())
+                    continue;
+                const Kind_e challenged = rules.empty() ? Player : Rules;
+                const auto started = client->outstanding[challenged].front();
+                client->outstanding[challenged].pop_front();
+                --stats[challenged].sent;
+                ++stats[challenged].challenges;
+                co_await Send(*client, challenged, started);
+                continue;
+            }
+            default:
+                stats[Info].bytes += n; // continuation fragments, counted towards traffic only
+                continue;
+            }
+
+            stats[kind].bytes += n;
+            auto& queue = client->outstanding[kind];
+            if (queue.empty())
+                continue; // answered after we gave up on it
+            const auto latency = std::chrono::steady_clock::now() - queue.front();
+            queue.pop_front();
+            ++stats[kind].replies;
+            stats[kind].latency_us.Record(std::chrono::duration_cast<std::chrono::microseconds>(latency).count());
+        }
+    }
+
+    void Report() const
+    {
+        for (int kind = 0; kind < KindCount; ++kind)
+        {
+            const auto& s = stats[kind];
+            if (!s.sent)
+                continue;
+            log("[BrowserStorm] ", kind_names[kind], " sent=", s.sent, " replies=", s.replies, " lost=", s.lost,
+                " challenges=", s.challenges, " bytes=", s.bytes, " latency_us ", s.latency_us.ToString());
+        }
+    }
+
+    asio::io_context& ioc;
+    udp::endpoint target;
+    std::vector<Kind_e> kinds;
+    std::array<Stats, KindCount> stats;
+};
+
+int main(int argc, char* argv[])
+{
+    auto spsv = std::span<char*>(argv, argc) | std::ranges::views::transform([](const char* arg) { return std::string_view(arg); });
+    auto master_port = GetMultiArgs("-master", spsv);
+    auto storm = GetMultiArgs("-storm", spsv);
+    if (master_port.empty() && storm.empty())
+    {
+        log("usage: ", argc ? argv[0] : "gorouter-sim", " [-master <port>] [-storm <host:port> [-rate n] [-clients n] [-duration s] [-kind info|player|rules]...]");
+        return 1;
+    }
+
+    auto number = [&](std::string_view arg, unsigned def) {
+        auto values = GetMultiArgs(arg, spsv);
+        try
+        {
+            return values.empty() ? def : static_cast<unsigned>(std::stoul(values.back()));
+        }
+        catch (const std::exception& e)
+        {
+            log("bad ", arg, ": ", e.what());
+            return def;
+        }
+    };
+
+    asio::io_context ioc;
+    std::unique_ptr<FakeMaster> master;
+    if (!master_port.empty())
+    {
+        master = std::make_unique<FakeMaster>(ioc, static_cast<unsigned short>(number("-master", 27010)));
+        asio::co_spawn(ioc, master->Run(), asio::detached);
+    }
+
+    std::unique_ptr<BrowserStorm> browser;
+    if (!storm.empty())
+    {
+        auto [host, port] = ParseHostPort(storm.back());
+        udp::resolver resolver(ioc);
+        const udp::endpoint target = *resolver.resolve(udp::v4(), host, port).begin();
+
+        std::vector<BrowserStorm::Kind_e> kinds;
+        for (const auto& kind : GetMultiArgs("-kind", spsv))
+        {
+            if (kind == "info")
+                kinds.push_back(BrowserStorm::Info);
+            else if (kind == "player")
+                kinds.push_back(BrowserStorm::Player);
+            else if (kind == "rules")
+                kinds.push_back(BrowserStorm::Rules);
+            else
+                log("unknown -kind ", kind);
+        }
+        if (kinds.empty())
+            kinds = { BrowserStorm::Info, BrowserStorm::Player, BrowserStorm::Rules };
+
+        browser = std::make_unique<BrowserStorm>(ioc, target, std::move(kinds));
+        asio::co_spawn(ioc, [&]() -> asio::awaitable<void> {
+            co_await browser->Run(number("-rate", 1000), std::max(1u, number("-clients", 16)), std::chrono::seconds(number("-duration", 10)));
+            // the fake master keeps running on its own
+            if (!master)
+                ioc.stop();
+        }, asio::detached);
+    }
+
+    ioc.run();
+    return 0;
+}
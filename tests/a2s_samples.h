@@ -0,0 +1,77 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "TSourceEngineQuery.h"
+
+// A2S_INFO replies as the wire has them: Source with every EDF field, the same without EDF, and GoldSrc 'm' with mod info
+inline std::vector<std::string> SampleServerInfoReplies()
+{
+    using Info = TSourceEngineQuery::ServerInfoQueryResult;
+    std::vector<Info> infos;
+
+    Info source{};
+    source.header1 = -1;
+    source.header2 = 'I';
+    source.Protocol = 48;
+    source.ServerName = "Citrus | de_dust2 24/7";
+    source.Map = "de_dust2";
+    source.Folder = "cstrike";
+    source.Game = "Counter-Strike";
+    source.SteamID = 10;
+    source.PlayerCount = 17;
+    source.MaxPlayers = 32;
+    source.BotCount = 2;
+    source.ServerType = TSourceEngineQuery::ServerType_e::dedicated;
+    source.Environment = TSourceEngineQuery::Environment_e::linux;
+    source.Visibility = TSourceEngineQuery::Public;
+    source.VAC = true;
+    source.GameVersion = "1.1.2.7/Stdio";
+    source.EDF = 0x80 | 0x10 | 0x40 | 0x20 | 0x01;
+    source.Port = 27015;
+    source.SteamIDExtended = { { 0x01234567, 0x0089ABCD } };
+    source.SourceTVData = Info::SourceTVData_s{ 27020, "Citrus TV" };
+    source.Keywords = "secure,dust2";
+    source.GameID = { { 10, 0 } };
+    infos.push_back(source);
+
+    Info plain = source;
+    plain.EDF.reset();
+    plain.Port.reset();
+    plain.SteamIDExtended.reset();
+    plain.SourceTVData.reset();
+    plain.Keywords.reset();
+    plain.GameID.reset();
+    infos.push_back(plain);
+
+    Info goldsrc{};
+    goldsrc.header1 = -1;
+    goldsrc.header2 = 'm';
+    goldsrc.LocalAddress = "127.0.0.1:27015";
+    goldsrc.ServerName = "Citrus";
+    goldsrc.Map = "cs_office";
+    goldsrc.Folder = "cstrike";
+    goldsrc.Game = "Counter-Strike";
+    goldsrc.PlayerCount = 5;
+    goldsrc.MaxPlayers = 20;
+    goldsrc.Protocol = 47;
+    goldsrc.ServerType = TSourceEngineQuery::ServerType_e::DEDICATED;
+    goldsrc.Environment = TSourceEngineQuery::Environment_e::WINDOWS;
+    goldsrc.Visibility = TSourceEngineQuery::Private;
+    goldsrc.Mod = true;
+    goldsrc.ModData = Info::ModData_s{ "http://example.com", "http://example.com/dl", 0, 1, 1024 * 1024,
+        Info::ModData_s::ModType_e::MultiplayerOnly, true };
+    goldsrc.VAC = false;
+    goldsrc.BotCount = 0;
+    infos.push_back(goldsrc);
+
+    std::vector<std::string> replies;
+    for (const auto& info : infos)
+    {
+        std::string reply(TSourceEngineQuery::ServerInfoQueryResultSize(info), '\0');
+        reply.resize(TSourceEngineQuery::WriteServerInfoQueryResultToBuffer(info, reply.data(), reply.size()));
+        replies.push_back(std::move(reply));
+    }
+    return replies;
+}
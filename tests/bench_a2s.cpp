@@ -0,0 +1,25 @@
+// A2S_INFO decode cost: the owning result (a std::string per field) against the in-place view.
+
+#include "TSourceEngineQuery.h"
+#include "a2s_samples.h"
+#include "check.h"
+
+int main(int argc, char* argv[])
+{
+    const std::size_t iterations = argc > 1 ? std::stoul(argv[1]) : 1000000;
+    const auto samples = SampleServerInfoReplies();
+    const char* names[] = { "Source with EDF", "Source without EDF", "GoldSrc 'm'" };
+    for (std::size_t i = 0; i < samples.size(); ++i)
+    {
+        const std::string& reply = samples[i];
+        std::printf("%s, %zu bytes\n", names[i], reply.size());
+        const double result = Bench("  MakeServerInfoQueryResultFromBuffer", iterations, [&] {
+            return TSourceEngineQuery::MakeServerInfoQueryResultFromBuffer(reply.data(), reply.size()).Map.size();
+        });
+        const double view = Bench("  MakeServerInfoQueryViewFromBuffer", iterations, [&] {
+            return TSourceEngineQuery::MakeServerInfoQueryViewFromBuffer(reply.data(), reply.size())->Map.size();
+        });
+        std::printf("  view is %.1fx faster\n", result / view);
+    }
+    return 0;
+}
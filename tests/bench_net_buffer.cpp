@@ -0,0 +1,40 @@
+// MSG_Write* on a byte boundary (the fast paths) against one bit off it (the bit writer).
+
+#include <string>
+
+#include "net_buffer.h"
+#include "check.h"
+
+constexpr int buffer_bytes = 1400;
+
+template<class Write>
+static double BenchWrites(const char* name, std::size_t iterations, int offset, Write write)
+{
+    alignas(4) static std::uint8_t data[buffer_bytes];
+    sizebuf_t sb;
+    // one iteration fills a packet
+    return Bench(name, iterations, [&] {
+        MSG_Init(&sb, name, data, sizeof(data));
+        for (int i = 0; i < offset; ++i)
+            MSG_WriteOneBit(&sb, 1);
+        while (!sb.bOverflow)
+            write(&sb);
+        return static_cast<std::size_t>(data[offset]);
+    });
+}
+
+int main(int argc, char* argv[])
+{
+    const std::size_t iterations = argc > 1 ? std::stoul(argv[1]) : 100000;
+    const char* map = "de_dust2";
+    const char payload[64] = "a player name, a say message or a short blob of user data";
+    for (int offset : { 0, 1 })
+    {
+        std::printf("%s\n", offset ? "one bit off" : "byte aligned");
+        BenchWrites("  MSG_WriteByte", iterations, offset, [](sizebuf_t* sb) { MSG_WriteByte(sb, 42); });
+        BenchWrites("  MSG_WriteLong", iterations, offset, [](sizebuf_t* sb) { MSG_WriteLong(sb, -42); });
+        BenchWrites("  MSG_WriteString", iterations, offset, [&](sizebuf_t* sb) { MSG_WriteString(sb, map); });
+        BenchWrites("  MSG_WriteBytes", iterations, offset, [&](sizebuf_t* sb) { MSG_WriteBytes(sb, payload, sizeof(payload)); });
+    }
+    return 0;
+}
@@ -0,0 +1,64 @@
+// Startup cost of parsing the built-in backend and master tables: ParseHostPort against the std::regex version it replaced.
+
+#include <regex>
+#include <string>
+#include <algorithm>
+
+#include "ServerManager.h"
+#include "MasterServer.h"
+#include "check.h"
+
+// as parse_ip.h had it before, for comparison
+static std::pair<std::string, std::string> RegexParseHostPort(const std::string& msg)
+{
+    static std::regex r1(R"((^[0-9a-zA-Z]+[0-9a-zA-Z\.-]*\.[a-zA-Z]{2,4}):*(\d+)*)");
+    static std::regex r2(
+        R"((?:(?:25[0-5]|2[0-4]\d|((1\d{2})|([1-9]?\d)))\.){3}(?:25[0-5]|2[0-4]\d|((1\d{2})|([1-9]?\d)))(:\d+)*)");
+
+    std::pair<std::string, std::string> ret{ {}, "27015" };
+    auto& [host, port] = ret;
+
+    if (std::smatch sm; std::regex_match(msg, sm, r1) && sm.size() > 2)
+    {
+        host = sm[1].str();
+        if (sm[2].str().size())
+            port = sm[2].str();
+    }
+    else if (std::smatch sm; std::regex_match(msg, sm, r2) && sm.size() > 2)
+    {
+        const auto adr = sm[0].str();
+        auto iter = std::find(adr.begin(), adr.end(), ':');
+        host.assign(adr.begin(), iter);
+        if (iter != adr.end())
+            port.assign(iter + 1, adr.end());
+    }
+    return ret;
+}
+
+template<class Table>
+static void BenchTable(const char* name, const Table& table, std::size_t iterations)
+{
+    const std::vector<std::string> names(std::begin(table), std::end(table));
+    std::printf("%s, %zu names\n", name, names.size());
+    const double regex = Bench("  std::regex", iterations, [&] {
+        std::size_t n = 0;
+        for (const auto& server : names)
+            n += RegexParseHostPort(server).first.size();
+        return n;
+    });
+    const double parser = Bench("  ParseHostPort", iterations, [&] {
+        std::size_t n = 0;
+        for (const auto& server : names)
+            n += ParseHostPort(server).first.size();
+        return n;
+    });
+    std::printf("  ParseHostPort is %.1fx faster\n", regex / parser);
+}
+
+int main(int argc, char* argv[])
+{
+    const std::size_t iterations = argc > 1 ? std::stoul(argv[1]) : 10000;
+    BenchTable("dest_servers", dest_servers, iterations);
+    BenchTable("master_servers", master_servers, iterations);
+    return 0;
+}
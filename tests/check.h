@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstdio>
+#include <chrono>
+
+// Bare assertions for the test executables, no framework to vendor. A failed CHECK is reported with its location
+// and the run goes on, so one failure doesn't hide the next; main returns CheckResult().
+inline int check_failures = 0;
+
+#define CHECK(expr) \
+    do \
+    { \
+        if (!(expr)) \
+        { \
+            ++check_failures; \
+            std::fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #expr); \
+        } \
+    } while (0)
+
+inline int CheckResult(const char* name)
+{
+    std::printf("%s: %s\n", name, check_failures ? "FAILED" : "ok");
+    return check_failures ? 1 : 0;
+}
+
+// calls fn iterations times and prints the time per call; sink keeps the work from being optimized away
+template<class Fn>
+double Bench(const char* name, std::size_t iterations, Fn&& fn)
+{
+    std::size_t sink = 0;
+    const auto start = std::chrono::steady_clock::now();
+    for (std::size_t i = 0; i < iterations; ++i)
+        sink += fn();
+    const double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / iterations;
+    std::printf("%-40s %10.1f ns/op  (%zu)\n", name, ns, sink);
+    return ns;
+}
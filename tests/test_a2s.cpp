@@ -0,0 +1,233 @@
+// A2S_INFO decoding (the owning result and the in-place view share one schema) and split packet reassembly,
+// against well-formed replies and against random mutations of them.
+
+#include <random>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+
+#include "TSourceEngineQuery.h"
+#include "parsemsg.h"
+#include "a2s_samples.h"
+#include "check.h"
+
+using Info = TSourceEngineQuery::ServerInfoQueryResult;
+using View = TSourceEngineQuery::ServerInfoQueryView;
+
+static std::optional<Info> ParseResult(const std::string& reply)
+{
+    try
+    {
+        return TSourceEngineQuery::MakeServerInfoQueryResultFromBuffer(reply.data(), reply.size());
+    }
+    catch (const std::exception& e)
+    {
+        return std::nullopt;
+    }
+}
+
+static bool WithinReply(std::string_view field, const std::string& reply)
+{
+    return field.empty() || (field.data() >= reply.data() && field.data() + field.size() <= reply.data() + reply.size());
+}
+
+static void TestRoundTrip()
+{
+    for (const auto& reply : SampleServerInfoReplies())
+    {
+        const auto view = TSourceEngineQuery::MakeServerInfoQueryViewFromBuffer(reply.data(), reply.size());
+        const auto result = ParseResult(reply);
+        CHECK(view.has_value());
+        CHECK(result.has_value());
+        if (!view || !result)
+            continue;
+        CHECK(view->header2 == result->header2);
+        CHECK(view->ServerName == result->ServerName);
+        CHECK(view->Map == result->Map);
+        CHECK(view->Folder == result->Folder);
+        CHECK(view->Game == result->Game);
+        CHECK(view->PlayerCount == result->PlayerCount);
+        CHECK(view->MaxPlayers == result->MaxPlayers);
+        CHECK(view->BotCount == result->BotCount);
+        CHECK(view->VAC == result->VAC);
+        CHECK(view->GameVersion == result->GameVersion.value_or(""));
+        CHECK(view->Port == result->Port);
+        CHECK(view->Keywords == result->Keywords.value_or(""));
+        CHECK(view->SourceTVData.has_value() == result->SourceTVData.has_value());
+        if (view->SourceTVData && result->SourceTVData)
+            CHECK(view->SourceTVData->SourceTVName == result->SourceTVData->SourceTVName);
+        CHECK(view->ModData.has_value() == result->ModData.has_value());
+        if (view->ModData && result->ModData)
+            CHECK(view->ModData->DownloadLink == result->ModData->DownloadLink);
+        CHECK(WithinReply(view->ServerName, reply));
+        CHECK(WithinReply(view->Keywords, reply));
+
+        // encoding what was decoded gives the reply back
+        std::string again(TSourceEngineQuery::ServerInfoQueryResultSize(*result), '\0');
+        again.resize(TSourceEngineQuery::WriteServerInfoQueryResultToBuffer(*result, again.data(), again.size()));
+        CHECK(again == reply);
+    }
+}
+
+static void TestTruncated()
+{
+    // EDF is optional on old servers, anything cut before it is malformed
+    for (const auto& reply : SampleServerInfoReplies())
+    {
+        for (std::size_t n = 0; n < reply.size(); ++n)
+        {
+            const std::string cut = reply.substr(0, n);
+            const auto view = TSourceEngineQuery::MakeServerInfoQueryViewFromBuffer(cut.data(), cut.size());
+            CHECK(view.has_value() == ParseResult(cut).has_value());
+        }
+    }
+}
+
+static std::string DecodeError(const std::string& reply)
+{
+    try
+    {
+        TSourceEngineQuery::MakeServerInfoQueryResultFromBuffer(reply.data(), reply.size());
+        return {};
+    }
+    catch (const std::invalid_argument& e)
+    {
+        return e.what();
+    }
+}
+
+static void TestTruncatedString()
+{
+    // a string without its terminator is reported as such, a short fixed field is not
+    const char data[] = { 'a', 'b', 'c', '\0', 'd', 'e' };
+    BufferReader buf(data, sizeof(data));
+    CHECK(buf.ReadStringView() == "abc");
+    CHECK(!buf.Bad() && !buf.Truncated());
+    CHECK(buf.ReadStringView() == "de");
+    CHECK(buf.Bad() && buf.Truncated());
+    CHECK(buf.ReadStringView().empty());
+
+    BufferReader fixed(data, 2);
+    fixed.ReadLong();
+    CHECK(fixed.Bad() && !fixed.Truncated());
+
+    const std::string reply = SampleServerInfoReplies().front();
+    const std::size_t name = 6; // header, type and protocol before it
+    CHECK(DecodeError(reply.substr(0, name + 3)) == "truncated string in reply");
+    const std::size_t steam_id = reply.find(std::string("Counter-Strike") + '\0') + 15;
+    CHECK(DecodeError(reply.substr(0, steam_id + 1)) == "truncated reply");
+    CHECK(DecodeError(reply).empty());
+}
+
+static void FuzzServerInfo()
+{
+    const auto samples = SampleServerInfoReplies();
+    std::mt19937 rng(30);
+    for (int i = 0; i < 200000; ++i)
+    {
+        std::string reply = samples[rng() % samples.size()];
+        switch (rng() % 4)
+        {
+        case 0: // flip bytes
+            for (int j = 1 + rng() % 4; j; --j)
+                reply[rng() % reply.size()] = static_cast<char>(rng());
+            break;
+        case 1: // cut anywhere
+            reply.resize(rng() % reply.size());
+            break;
+        case 2: // drop the terminators of strings
+            std::replace_if(reply.begin() + 5, reply.end(), [&](char c) { return c == '\0' && rng() % 2; }, 'x');
+            break;
+        default: // junk appended
+            for (int j = rng() % 64; j; --j)
+                reply.push_back(static_cast<char>(rng()));
+            break;
+        }
+        const auto view = TSourceEngineQuery::MakeServerInfoQueryViewFromBuffer(reply.data(), reply.size());
+        const auto result = ParseResult(reply);
+        // both go through the same schema, they only differ in what the strings are
+        CHECK(view.has_value() == result.has_value());
+        if (view)
+        {
+            CHECK(WithinReply(view->ServerName, reply));
+            CHECK(WithinReply(view->Map, reply));
+            CHECK(WithinReply(view->GameVersion, reply));
+            CHECK(WithinReply(view->Keywords, reply));
+        }
+    }
+}
+
+static std::string RandomReply(std::mt19937& rng, std::size_t size)
+{
+    std::string reply = "\xFF\xFF\xFF\xFF" "E";
+    while (reply.size() < size)
+        reply.push_back(static_cast<char>(rng()));
+    return reply;
+}
+
+static void TestSplitRoundTrip()
+{
+    std::mt19937 rng(28);
+    for (auto format : { TSourceEngineQuery::SplitPacketFormat_e::Source, TSourceEngineQuery::SplitPacketFormat_e::GoldSrc })
+    {
+        for (std::size_t size : { 6, 1399, 1400, 1401, 2800, 4000, 12000 })
+        {
+            const std::string reply = RandomReply(rng, size);
+            auto fragments = TSourceEngineQuery::SplitPacket(reply, format, 0x1234);
+            if (size <= 1400)
+            {
+                CHECK(fragments.size() == 1 && fragments[0] == reply);
+                continue;
+            }
+            std::shuffle(fragments.begin(), fragments.end(), rng);
+            CHECK(TSourceEngineQuery::ReassembleSplitPacket(fragments) == reply);
+
+            // a duplicate changes nothing, a missing fragment means not yet
+            auto duplicated = fragments;
+            duplicated.push_back(fragments.front());
+            CHECK(TSourceEngineQuery::ReassembleSplitPacket(duplicated) == reply);
+            auto missing = fragments;
+            missing.pop_back();
+            CHECK(!TSourceEngineQuery::ReassembleSplitPacket(missing));
+        }
+    }
+}
+
+static void FuzzSplit()
+{
+    std::mt19937 rng(2828);
+    for (int i = 0; i < 50000; ++i)
+    {
+        const auto format = rng() % 2 ? TSourceEngineQuery::SplitPacketFormat_e::Source : TSourceEngineQuery::SplitPacketFormat_e::GoldSrc;
+        auto fragments = TSourceEngineQuery::SplitPacket(RandomReply(rng, 1401 + rng() % 6000), format, static_cast<int32_t>(rng()));
+        switch (rng() % 3)
+        {
+        case 0: // header bytes garbled
+            fragments[rng() % fragments.size()][4 + rng() % 6] = static_cast<char>(rng());
+            break;
+        case 1: // cut inside the header
+            fragments[rng() % fragments.size()].resize(rng() % 11);
+            break;
+        default: // a fragment of something else
+            fragments.push_back(RandomReply(rng, rng() % 32));
+            fragments.back()[0] = '\xFE';
+            break;
+        }
+        std::shuffle(fragments.begin(), fragments.end(), rng);
+        // must not crash; whatever comes out starts like a reply
+        if (auto payload = TSourceEngineQuery::ReassembleSplitPacket(fragments))
+            CHECK(payload->size() >= 4 && payload->compare(0, 4, "\xFF\xFF\xFF\xFF") == 0);
+    }
+}
+
+int main()
+{
+    TestRoundTrip();
+    TestTruncated();
+    TestTruncatedString();
+    FuzzServerInfo();
+    TestSplitRoundTrip();
+    FuzzSplit();
+    return CheckResult("test_a2s");
+}
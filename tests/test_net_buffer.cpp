@@ -0,0 +1,176 @@
+// The byte-aligned fast paths of the MSG_Write* functions against the plain bit writer they shortcut:
+// random sequences of writes at random bit offsets must leave the same position, overflow flag and (short of an overflow) bytes.
+
+#include <random>
+#include <string>
+#include <cstring>
+
+#include "net_buffer.h"
+#include "check.h"
+
+constexpr int max_bytes = 64;
+
+struct Buffers
+{
+    alignas(4) std::uint8_t fast[max_bytes];
+    alignas(4) std::uint8_t slow[max_bytes];
+    sizebuf_t fast_sb;
+    sizebuf_t slow_sb;
+
+    explicit Buffers(int bytes)
+    {
+        std::memset(fast, 0xCC, sizeof(fast));
+        std::memset(slow, 0xCC, sizeof(slow));
+        MSG_Init(&fast_sb, "fast", fast, bytes);
+        MSG_Init(&slow_sb, "slow", slow, bytes);
+    }
+
+    // what an overflowed buffer holds is unspecified (MSG_WriteBits stores whole dwords up to the end), only that it overflowed
+    bool Same() const
+    {
+        if (fast_sb.iCurBit != slow_sb.iCurBit || fast_sb.bOverflow != slow_sb.bOverflow)
+            return false;
+        return fast_sb.bOverflow || std::memcmp(fast, slow, sizeof(fast)) == 0;
+    }
+};
+
+static std::string RandomString(std::mt19937& rng)
+{
+    std::string s;
+    for (int n = rng() % 24; n; --n)
+        s.push_back(static_cast<char>(1 + rng() % 255));
+    return s;
+}
+
+// one random write through the public function and through the bit writer it falls back to
+static void WriteBoth(Buffers& b, std::mt19937& rng)
+{
+    const int value = static_cast<int>(rng());
+    switch (rng() % 9)
+    {
+    case 0:
+        MSG_WriteOneBit(&b.fast_sb, value & 1);
+        MSG_WriteOneBit(&b.slow_sb, value & 1);
+        break;
+    case 1:
+        MSG_WriteChar(&b.fast_sb, static_cast<signed char>(value));
+        MSG_WriteSBitLong(&b.slow_sb, static_cast<signed char>(value), 8);
+        break;
+    case 2:
+        MSG_WriteByte(&b.fast_sb, value & 0xFF);
+        MSG_WriteUBitLong(&b.slow_sb, value & 0xFF, 8);
+        break;
+    case 3:
+        MSG_WriteShort(&b.fast_sb, static_cast<short>(value));
+        MSG_WriteSBitLong(&b.slow_sb, static_cast<short>(value), 16);
+        break;
+    case 4:
+        MSG_WriteWord(&b.fast_sb, value & 0xFFFF);
+        MSG_WriteUBitLong(&b.slow_sb, value & 0xFFFF, 16);
+        break;
+    case 5:
+        MSG_WriteLong(&b.fast_sb, value);
+        MSG_WriteSBitLong(&b.slow_sb, value, 32);
+        break;
+    case 6:
+        MSG_WriteDword(&b.fast_sb, static_cast<std::uint32_t>(value));
+        MSG_WriteUBitLong(&b.slow_sb, static_cast<std::uint32_t>(value), 32);
+        break;
+    case 7:
+    {
+        const std::string s = RandomString(rng);
+        MSG_WriteString(&b.fast_sb, s.c_str());
+        for (std::size_t i = 0; i <= s.size(); ++i)
+            MSG_WriteSBitLong(&b.slow_sb, static_cast<signed char>(s.c_str()[i]), 8);
+        break;
+    }
+    default:
+    {
+        const std::string s = RandomString(rng);
+        MSG_WriteBytes(&b.fast_sb, s.data(), static_cast<int>(s.size()));
+        for (char c : s)
+            MSG_WriteUBitLong(&b.slow_sb, static_cast<std::uint8_t>(c), 8);
+        break;
+    }
+    }
+}
+
+static void FuzzFastPaths()
+{
+    std::mt19937 rng(31);
+    for (int i = 0; i < 100000; ++i)
+    {
+        Buffers b(1 + rng() % max_bytes);
+        // start aligned most of the time, that is what the fast paths are for
+        for (int skip = rng() % 4 ? 0 : rng() % 8; skip; --skip)
+        {
+            MSG_WriteOneBit(&b.fast_sb, 1);
+            MSG_WriteOneBit(&b.slow_sb, 1);
+        }
+        for (int n = 1 + rng() % 16; n; --n)
+            WriteBoth(b, rng);
+        CHECK(b.Same());
+    }
+}
+
+static void TestReadBack()
+{
+    for (int offset : { 0, 1, 3, 7 })
+    {
+        alignas(4) std::uint8_t data[max_bytes] = {};
+        sizebuf_t sb;
+        MSG_Init(&sb, "readback", data, sizeof(data));
+        for (int i = 0; i < offset; ++i)
+            MSG_WriteOneBit(&sb, 1);
+        MSG_WriteChar(&sb, -5);
+        MSG_WriteByte(&sb, 200);
+        MSG_WriteShort(&sb, -12345);
+        MSG_WriteWord(&sb, 54321);
+        MSG_WriteLong(&sb, -123456789);
+        MSG_WriteDword(&sb, 0xDEADBEEF);
+        MSG_WriteString(&sb, "de_dust2");
+        MSG_WriteBytes(&sb, "abc", 3);
+        CHECK(!sb.bOverflow);
+        const int written = MSG_GetNumBitsWritten(&sb);
+        CHECK(written == offset + (1 + 1 + 2 + 2 + 4 + 4 + 9 + 3) * 8);
+
+        MSG_Init(&sb, "readback", data, sizeof(data));
+        for (int i = 0; i < offset; ++i)
+            CHECK(MSG_ReadOneBit(&sb) == 1);
+        CHECK(MSG_ReadChar(&sb) == -5);
+        CHECK(MSG_ReadByte(&sb) == 200);
+        CHECK(MSG_ReadShort(&sb) == -12345);
+        CHECK(MSG_ReadWord(&sb) == 54321);
+        CHECK(MSG_ReadLong(&sb) == -123456789);
+        CHECK(MSG_ReadDword(&sb) == 0xDEADBEEF);
+        CHECK(std::string(MSG_ReadString(&sb)) == "de_dust2");
+        char bytes[3];
+        CHECK(MSG_ReadBytes(&sb, bytes, 3) && std::memcmp(bytes, "abc", 3) == 0);
+        CHECK(MSG_GetNumBitsRead(&sb) == written && !sb.bOverflow);
+    }
+}
+
+static void TestOverflow()
+{
+    alignas(4) std::uint8_t data[8] = {};
+    sizebuf_t sb;
+    MSG_Init(&sb, "overflow", data, 6);
+    MSG_WriteLong(&sb, 1);
+    MSG_WriteLong(&sb, 2); // does not fit, nothing of it is written
+    CHECK(sb.bOverflow);
+    CHECK(MSG_GetNumBitsWritten(&sb) == 48);
+    CHECK(data[4] == 0 && data[5] == 0);
+    CHECK(!MSG_WriteString(&sb, "x"));
+
+    MSG_Init(&sb, "overflow", data, 6);
+    CHECK(!MSG_WriteString(&sb, "too long"));
+    CHECK(sb.bOverflow);
+}
+
+int main()
+{
+    FuzzFastPaths();
+    TestReadBack();
+    TestOverflow();
+    return CheckResult("test_net_buffer");
+}
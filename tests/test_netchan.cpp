@@ -0,0 +1,239 @@
+// NetchanRewriter against hand-built netchan packets: the reconnect goes out munged in the reliable part, the
+// client's ack settles it, and the reliable bit is hidden from srcds afterwards.
+
+#include <random>
+#include <string>
+#include <cstring>
+
+#include "NetchanRewriter.h"
+#include "check.h"
+
+constexpr std::uint32_t reliable_bit = 1u << 31;
+const std::string reconnect = std::string("\x09reconnect\n") + '\0';
+
+static std::string Words(std::uint32_t w1, std::uint32_t w2)
+{
+    std::string packet(8, '\0');
+    std::memcpy(packet.data(), &w1, 4);
+    std::memcpy(packet.data() + 4, &w2, 4);
+    return packet;
+}
+
+static std::uint32_t Word(const std::string& packet, std::size_t offset)
+{
+    std::uint32_t w;
+    std::memcpy(&w, packet.data() + offset, 4);
+    return w;
+}
+
+static std::string Munged(std::string payload, std::uint32_t sequence)
+{
+    COM_Munge2(reinterpret_cast<unsigned char*>(payload.data()), static_cast<int>(payload.size()), sequence & 0xFF);
+    return payload;
+}
+
+static std::string Unmunged(std::string payload, std::uint32_t sequence)
+{
+    COM_UnMunge2(reinterpret_cast<unsigned char*>(payload.data()), static_cast<int>(payload.size()), sequence & 0xFF);
+    return payload;
+}
+
+const std::string game_data = "unreliable entity and event data, whatever srcds sends every frame";
+
+// srcds => client through the rewriter, the packet as the client gets it
+static std::string FromServer(NetchanRewriter& netchan, std::uint32_t sequence, bool reliable = false, const std::string& payload = game_data)
+{
+    std::string packet = Words(sequence | (reliable ? reliable_bit : 0), 0) + Munged(payload, sequence);
+    const std::size_t n = packet.size();
+    packet.resize(NetchanRewriter::max_packet_size);
+    packet.resize(netchan.OnServerPacket(packet.data(), n, packet.size()));
+    return packet;
+}
+
+// client => srcds through the rewriter, the reliable ack bit as srcds gets it
+static bool FromClient(NetchanRewriter& netchan, std::uint32_t sequence, std::uint32_t ack, bool reliable)
+{
+    std::string packet = Words(sequence, ack | (reliable ? reliable_bit : 0)) + "move";
+    netchan.OnClientPacket(packet.data(), packet.size());
+    CHECK(packet.substr(8) == "move");
+    CHECK((Word(packet, 4) & ~reliable_bit) == ack);
+    return (Word(packet, 4) & reliable_bit) != 0;
+}
+
+static bool Injected(const std::string& packet, std::uint32_t sequence)
+{
+    return (Word(packet, 0) & reliable_bit) && Unmunged(packet.substr(8), sequence) == reconnect + game_data;
+}
+
+static void TestMungeRoundTrip()
+{
+    std::mt19937 rng(36);
+    for (int i = 0; i < 10000; ++i)
+    {
+        std::string payload(rng() % 1400, '\0');
+        for (char& c : payload)
+            c = static_cast<char>(rng());
+        const std::uint32_t sequence = rng();
+        CHECK(Unmunged(Munged(payload, sequence), sequence) == payload);
+    }
+}
+
+static void TestDelivered()
+{
+    NetchanRewriter netchan;
+    netchan.QueueReconnect();
+    // nothing before the client has been heard from, its reliable bit is unknown
+    CHECK(FromServer(netchan, 1) == Words(1, 0) + Munged(game_data, 1));
+
+    CHECK(!FromClient(netchan, 1, 1, false));
+    const std::string packet = FromServer(netchan, 2);
+    CHECK(packet.size() == 8 + reconnect.size() + game_data.size());
+    CHECK((Word(packet, 0) & ~reliable_bit) == 2);
+    CHECK(Injected(packet, 2));
+    CHECK(!netchan.Idle());
+
+    // one at a time, and an ack of an older packet settles nothing
+    CHECK(!Injected(FromServer(netchan, 3), 3));
+    CHECK(!FromClient(netchan, 2, 1, false));
+    CHECK(netchan.Delivered() == 0);
+
+    // the client took it and toggled, srcds keeps seeing the bit it expects
+    CHECK(!FromClient(netchan, 3, 2, true));
+    CHECK(netchan.Delivered() == 1);
+    CHECK(netchan.Parity());
+    CHECK(netchan.Idle());
+    CHECK(!FromClient(netchan, 4, 3, true));
+
+    // a second one toggles back
+    netchan.QueueReconnect();
+    CHECK(Injected(FromServer(netchan, 5), 5));
+    CHECK(!FromClient(netchan, 6, 5, false));
+    CHECK(netchan.Delivered() == 2);
+    CHECK(!netchan.Parity());
+    CHECK(!FromClient(netchan, 7, 6, false));
+}
+
+static void TestLost()
+{
+    NetchanRewriter netchan;
+    FromClient(netchan, 1, 1, false);
+    netchan.QueueReconnect();
+    netchan.QueueReconnect(); // once is enough
+    std::uint32_t sequence = 2;
+    for (int attempt = 1; attempt <= NetchanRewriter::max_attempts; ++attempt, ++sequence)
+    {
+        CHECK(Injected(FromServer(netchan, sequence), sequence));
+        // acked without the toggle: dropped on the way, sent again with the next packet
+        CHECK(!FromClient(netchan, sequence, sequence, false));
+    }
+    CHECK(netchan.Delivered() == 0);
+    CHECK(netchan.Failed() == 1);
+    CHECK(netchan.Idle());
+    CHECK(!netchan.Parity());
+    CHECK(!Injected(FromServer(netchan, sequence), sequence));
+}
+
+static void TestServerReliable()
+{
+    NetchanRewriter netchan;
+    FromClient(netchan, 1, 1, false);
+    // srcds has a reliable on the wire, it passes as is and nothing goes in until the client acked it
+    const std::string reliable = FromServer(netchan, 2, true);
+    CHECK(reliable == Words(2 | reliable_bit, 0) + Munged(game_data, 2));
+    netchan.QueueReconnect();
+    CHECK(!Injected(FromServer(netchan, 3), 3));
+    CHECK(!FromClient(netchan, 2, 1, false));
+    CHECK(!Injected(FromServer(netchan, 4), 4));
+    CHECK(FromClient(netchan, 3, 2, true));
+    CHECK(Injected(FromServer(netchan, 5), 5));
+    CHECK(FromClient(netchan, 4, 5, false)); // toggled back by the client, srcds still sees its own
+    CHECK(netchan.Delivered() == 1);
+}
+
+static void TestAmbiguous()
+{
+    NetchanRewriter netchan;
+    FromClient(netchan, 1, 1, false);
+    netchan.QueueReconnect();
+    CHECK(Injected(FromServer(netchan, 2), 2));
+    // srcds sends a reliable before the client answered: a toggle could be for either
+    FromServer(netchan, 3, true);
+    FromClient(netchan, 2, 3, true);
+    CHECK(netchan.Delivered() == 0);
+    CHECK(!netchan.Parity());
+    CHECK(!netchan.Idle());
+    // tried again once the client acked srcds' reliable
+    CHECK(Injected(FromServer(netchan, 4), 4));
+}
+
+static void TestCancel()
+{
+    NetchanRewriter netchan;
+    FromClient(netchan, 1, 1, false);
+    netchan.QueueReconnect();
+    netchan.Cancel();
+    CHECK(netchan.Idle());
+    CHECK(!Injected(FromServer(netchan, 2), 2));
+
+    // one already sent still settles, the bit stays hidden if the client took it
+    netchan.QueueReconnect();
+    CHECK(Injected(FromServer(netchan, 3), 3));
+    netchan.Cancel();
+    CHECK(!netchan.Idle());
+    CHECK(!FromClient(netchan, 2, 3, true));
+    CHECK(netchan.Delivered() == 1);
+    CHECK(netchan.Idle());
+    CHECK(!Injected(FromServer(netchan, 4), 4));
+}
+
+static void TestRestoreParity()
+{
+    // after a graceful restart: the client already toggled once, before this process saw any of its packets
+    NetchanRewriter netchan;
+    netchan.RestoreParity(true);
+    CHECK(!FromClient(netchan, 10, 9, true));
+    netchan.Reset();
+    CHECK(!netchan.Parity());
+    CHECK(FromClient(netchan, 1, 0, true));
+
+    // a restored one may inject right away, the client's bit is known from the parity
+    NetchanRewriter restored;
+    restored.RestoreParity(false);
+    restored.QueueReconnect();
+    CHECK(Injected(FromServer(restored, 20), 20));
+}
+
+static void TestPassThrough()
+{
+    NetchanRewriter netchan;
+    FromClient(netchan, 1, 1, false);
+    netchan.QueueReconnect();
+
+    // connectionless packets and runts are not netchan
+    std::string query = "\xFF\xFF\xFF\xFF" "TSource Engine Query";
+    query += '\0';
+    const std::string original = query;
+    query.resize(NetchanRewriter::max_packet_size);
+    CHECK(netchan.OnServerPacket(query.data(), original.size(), query.size()) == original.size());
+    CHECK(query.substr(0, original.size()) == original);
+    std::string runt = "\x01\x02\x03";
+    CHECK(netchan.OnServerPacket(runt.data(), runt.size(), runt.size()) == runt.size());
+
+    // no room for the command
+    const std::string full(NetchanRewriter::max_packet_size - 8 - reconnect.size() + 1, 'x');
+    CHECK(FromServer(netchan, 2, false, full).size() == 8 + full.size());
+    CHECK(Injected(FromServer(netchan, 3), 3));
+}
+
+int main()
+{
+    TestMungeRoundTrip();
+    TestDelivered();
+    TestLost();
+    TestServerReliable();
+    TestAmbiguous();
+    TestCancel();
+    TestRestoreParity();
+    TestPassThrough();
+    return CheckResult("test_netchan");
+}
@@ -0,0 +1,88 @@
+// ParseHostPort at run time: the 27015 default, what is rejected, and random input that must never read outside
+// the string. The accepted forms are also pinned by the static_asserts in parse_ip.h.
+
+#include <random>
+#include <string>
+#include <string_view>
+
+#include "parse_ip.h"
+#include "check.h"
+
+using Parsed = std::pair<std::string, std::string>;
+
+static void TestDefaultPort()
+{
+    CHECK(ParseHostPort("z4.moemod.com") == Parsed("z4.moemod.com", "27015"));
+    CHECK(ParseHostPort("localhost") == Parsed("localhost", "27015"));
+    CHECK(ParseHostPort("10.0.0.1") == Parsed("10.0.0.1", "27015"));
+    CHECK(ParseHostPort("[::1]") == Parsed("::1", "27015"));
+    CHECK(ParseHostPort("fe80::1") == Parsed("fe80::1", "27015"));
+
+    CHECK(ParseHostPort("localhost:6666") == Parsed("localhost", "6666"));
+    CHECK(ParseHostPort("188.40.40.201:27010") == Parsed("188.40.40.201", "27010"));
+    CHECK(ParseHostPort("[2001:db8::1]:27016") == Parsed("2001:db8::1", "27016"));
+    CHECK(ParseHostPort("game.example.network:1") == Parsed("game.example.network", "1"));
+    CHECK(ParseHostPort("host:65535") == Parsed("host", "65535"));
+}
+
+static void TestFailure()
+{
+    // no host, and still the default port
+    for (std::string_view bad : { "", ":27015", "host:", "host:0", "host:65536", "host:123456", "host:27o15", "host:-1",
+             "256.1.1.1", "1.2.3", "01.2.3.4:27015", "-host.com", "host-.com", "host..com", ".host.com", "a b:27015",
+             "[::1", "[::1]27015", "[::1]:", "[zz::1]:27015", "1::2::3", "[1:2:3:4:5:6:7:8:9]", "host:27015:1" })
+    {
+        const std::string copy(bad); // not a literal, nothing is folded at compile time
+        CHECK(!ParseHostPortView(copy));
+        CHECK(ParseHostPort(copy) == Parsed("", "27015"));
+    }
+    const std::string long_label = std::string(64, 'a') + ".com";
+    CHECK(!ParseHostPortView(long_label));
+    CHECK(ParseHostPortView(std::string(63, 'a') + ".com"));
+}
+
+static void FuzzHostPort()
+{
+    std::mt19937 rng(40);
+    const std::string_view alphabet = "0123456789abcdefxz.:[]-";
+    const std::string_view seeds[] = { "hl1master.steampowered.com:27010", "[2001:db8::1]:27015", "188.40.40.201:27010", "fe80::1" };
+    for (int i = 0; i < 200000; ++i)
+    {
+        std::string input;
+        if (rng() % 2)
+        {
+            for (int n = rng() % 40; n; --n)
+                input.push_back(alphabet[rng() % alphabet.size()]);
+        }
+        else
+        {
+            input = seeds[rng() % std::size(seeds)];
+            for (int n = 1 + rng() % 3; n; --n)
+                input[rng() % input.size()] = alphabet[rng() % alphabet.size()];
+        }
+        const auto hp = ParseHostPortView(input);
+        if (!hp)
+        {
+            CHECK(ParseHostPort(input).first.empty());
+            continue;
+        }
+        // views into the input, a port is 1..65535 in digits
+        const auto inside = [&](std::string_view sv) { return sv.empty() || (sv.data() >= input.data() && sv.data() + sv.size() <= input.data() + input.size()); };
+        CHECK(!hp->host.empty() && inside(hp->host) && inside(hp->port));
+        if (!hp->port.empty())
+        {
+            CHECK(hp->port.find_first_not_of("0123456789") == std::string_view::npos);
+            const int port = std::stoi(std::string(hp->port));
+            CHECK(port >= 1 && port <= 65535);
+        }
+        CHECK(ParseHostPort(input) == Parsed(hp->host, hp->port.empty() ? "27015" : hp->port));
+    }
+}
+
+int main()
+{
+    TestDefaultPort();
+    TestFailure();
+    FuzzHostPort();
+    return CheckResult("test_parse_ip");
+}
@@ -0,0 +1,118 @@
+// SteamPump with a stub in place of the Steam game server: everything it hands out arrives on loopback, in batches,
+// and Poke() flushes right away instead of at the next tick.
+
+#include <deque>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <asio.hpp>
+#include <asio/awaitable.hpp>
+
+#include "SteamPump.h"
+#include "check.h"
+
+using asio::ip::udp;
+
+struct FakeGameServer
+{
+    std::deque<std::string> outgoing;
+    std::uint16_t port = 0;
+
+    int GetNextOutgoingPacket(void* out, int max_out, std::uint32_t* ip, std::uint16_t* out_port)
+    {
+        if (outgoing.empty())
+            return 0;
+        std::string packet = std::move(outgoing.front());
+        outgoing.pop_front();
+        CHECK(static_cast<int>(packet.size()) <= max_out);
+        std::memcpy(out, packet.data(), packet.size());
+        *ip = 0x7F000001; // host order, like Steam
+        *out_port = port;
+        return static_cast<int>(packet.size());
+    }
+};
+
+static std::string MakePacket(int index)
+{
+    std::string packet = std::to_string(index) + ":";
+    packet.resize(1 + (index * 97) % 1400, static_cast<char>('a' + index % 26));
+    return packet;
+}
+
+constexpr int first_packets = 70; // two full batches and a part
+
+int main()
+{
+    asio::io_context ioc;
+    udp::socket listen(ioc, udp::endpoint(asio::ip::address_v4::loopback(), 0));
+    udp::socket client(ioc, udp::endpoint(asio::ip::address_v4::loopback(), 0));
+
+    // slow enough that only Poke() can explain a quick answer
+    steam_pump_min_interval = std::chrono::milliseconds(300);
+    steam_pump_max_interval = std::chrono::seconds(60);
+
+    FakeGameServer server;
+    server.port = client.local_endpoint().port();
+    std::uint64_t callbacks = 0;
+    std::size_t first_bytes = 0;
+    for (int i = 0; i < first_packets; ++i)
+    {
+        server.outgoing.push_back(MakePacket(i));
+        first_bytes += server.outgoing.back().size();
+    }
+
+    SteamPump<FakeGameServer> pump(ioc, listen);
+    asio::co_spawn(ioc, pump.Run(server, [&] { ++callbacks; }), asio::detached);
+
+    asio::steady_timer deadline(ioc, std::chrono::seconds(10));
+    deadline.async_wait([&](asio::error_code ec) {
+        if (!ec)
+        {
+            CHECK(!"timed out waiting for packets");
+            ioc.stop();
+        }
+    });
+
+    asio::co_spawn(ioc, [&]() -> asio::awaitable<void> {
+        try
+        {
+            std::vector<char> buffer(4096);
+            std::vector<bool> seen(first_packets);
+            udp::endpoint from;
+            for (int i = 0; i < first_packets; ++i)
+            {
+                const std::size_t n = co_await client.async_receive_from(asio::buffer(buffer), from, asio::use_awaitable);
+                CHECK(from.port() == listen.local_endpoint().port());
+                const std::string packet(buffer.data(), n);
+                const int index = std::stoi(packet);
+                CHECK(index >= 0 && index < first_packets && !seen[index]);
+                CHECK(packet == MakePacket(index));
+                seen[index] = true;
+            }
+            const auto& stats = pump.GetStats();
+            CHECK(stats.packets == first_packets);
+            CHECK(stats.bytes == first_bytes);
+            CHECK(stats.batches == 3);
+            CHECK(callbacks == stats.wakeups);
+
+            // a reply to something that just came in goes out now, not min_interval later
+            server.outgoing.push_back("poked");
+            const auto poked = std::chrono::steady_clock::now();
+            pump.Poke();
+            const std::size_t n = co_await client.async_receive_from(asio::buffer(buffer), from, asio::use_awaitable);
+            CHECK(std::string(buffer.data(), n) == "poked");
+            CHECK(std::chrono::steady_clock::now() - poked < steam_pump_min_interval / 2);
+            CHECK(stats.packets == first_packets + 1);
+            CHECK(stats.batches == 4);
+        }
+        catch (const asio::system_error& e)
+        {
+            CHECK(!"receive failed");
+        }
+        ioc.stop();
+    }, asio::detached);
+
+    ioc.run();
+    return CheckResult("test_steam_pump");
+}